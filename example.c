@@ -1,35 +1,34 @@
-#include <string.h>
 #include "lsreg.h"
 
-static lsreg_rec_t record;
-
-static lsreg_rec_t *rec_factory(void *match_prefix) {
-  return &record;
-}
-
-static int rec_handler(lsreg_rec_t *rec, void *match_prefix) {
-  lsreg_bundle_t *bundle;
-  size_t pxlen;
-  
-  if(rec->type == kLSRegRecTypeBundle) {
-    bundle = (lsreg_bundle_t *)rec->rec;
-    pxlen = strlen((const char *)match_prefix);
-    if ( (pxlen <= strlen(bundle->identifier.name)) &&
-         (strncasecmp((const char *)match_prefix, bundle->identifier.name, pxlen) == 0)
-       )
-    {
-      puts(bundle->path);
-    }
-  }
-  
-  return 0;
-}
-
 int main (int argc, const char * argv[]) {
+  lsreg_reader_t *r;
+  lsreg_db_t *db;
+  lsreg_bundle_t **bundles;
+  lsreg_fields_t fields;
+  size_t i, count;
+  
   if (argc < 2) {
     fprintf(stderr, "usage: %s PREFIX\n", argv[0]);
     return 1;
   }
-  lsreg_iterate(rec_factory, rec_handler, (void *)argv[1]);
+  if ((r = lsreg_reader_open_regdump()) == NULL) {
+    return 1;
+  }
+  
+  // We only look at the identifier and path of bundles
+  fields.bundle = kLSRegBundleIdentifierField | kLSRegBundlePathField;
+  fields.volume = 0;
+  fields.handler = 0;
+  lsreg_reader_set_fields(r, &fields);
+  lsreg_reader_set_types(r, kLSRegBundleTypeMask);
+  
+  if ((db = lsreg_db_open(r)) == NULL) {
+    return 1;
+  }
+  bundles = lsreg_db_find_prefix(db, argv[1], &count);
+  for (i = 0; i < count; i++) {
+    puts(bundles[i]->path);
+  }
+  lsreg_db_close(db);
   return 0;
 }
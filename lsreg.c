@@ -20,12 +20,33 @@
  * THE SOFTWARE.
  */
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <time.h>
 #include <ctype.h>
+#include <stddef.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "lsreg.h"
 
+#if defined(__SSE2__)
+  #define LSREG_SSE2 1
+  #include <emmintrin.h>
+  #if defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5)
+    // AVX2 is compiled in using a target attribute and selected at runtime
+    #define LSREG_AVX2 1
+    #include <immintrin.h>
+  #endif
+#endif
+
 #pragma mark -
 #pragma mark Macros
 
@@ -50,9 +71,44 @@ const char *kLSRegisterCmd = "/System/Library/Frameworks/CoreServices.framework/
 #endif
 
 
+// Size of the blocks in which readers consume their source. The buffer
+// grows beyond this if a single line does not fit.
+#define LSREG_BLOCK_SIZE (256*1024)
+
+// Number of header lines preceding the first record in a dump
+#define LSREG_HEADER_LINES 3
+
+// Maximum number of lines indexed in one pass over the read buffer
+#define LSREG_LINE_INDEX_SIZE 256
+
+// Size of arena blocks. A bundle and its strings typically need < 1kB.
+#define LSREG_ARENA_BLOCK_SIZE (64*1024)
+
+// Smallest chunk of a dump handed to a thread by parallel iteration.
+// Dumps are otherwise split into 8 chunks per thread.
+#define LSREG_PARALLEL_MIN_CHUNK (64*1024)
+
+// Snapshot file format version, bumped whenever the layout changes
+#define LSREG_SNAPSHOT_MAGIC "lsregsnp"
+#define LSREG_SNAPSHOT_VERSION 3
+
+// Number of independently locked parts of an intern table, selected by
+// the top bits of the string's hash. Must be a power of two <= 256.
+#define LSREG_INTERN_SHARDS 16
+
+// Pipelined iteration: number of blocks and record batches in flight
+// between stages, and records per batch
+#define LSREG_PIPELINE_BLOCKS 8
+#define LSREG_PIPELINE_BATCHES 8
+#define LSREG_PIPELINE_BATCH_SIZE 64
+
+// Capacity of the rings linking pipeline stages. Must be a power of two
+// and larger than the number of items circulating through a ring.
+#define LSREG_RING_SIZE 16
+
+
 // Record subtype parser
-typedef int lsreg_parser_func(FILE *f,
-                              char *linebuf, size_t linebufsize,
+typedef int lsreg_parser_func(lsreg_reader_t *r,
                               char *line, size_t linelen,
                               char *key, size_t keylen,
                               char *val, size_t vallen,
@@ -118,6 +174,29 @@ static void *_memrchr(const void *buf, unsigned char c, size_t length) {
 }
 
 
+// Like memmem, which glibc only declares with _GNU_SOURCE
+static void *_memmem(const void *buf, size_t length, const void *needle, size_t needlelen) {
+  const char *p = (const char *)buf, *end = p + length;
+  if(needlelen == 0) {
+    return (void *)buf;
+  }
+  while((size_t)(end - p) >= needlelen &&
+        (p = (const char *)memchr(p, *(const char *)needle, (end - p) - needlelen + 1)))
+  {
+    if(memcmp(p, needle, needlelen) == 0) {
+      return (void *)p;
+    }
+    p++;
+  }
+  return NULL;
+}
+
+
+static char *_strdup_null(const char *s) {
+  return s ? strdup(s) : NULL;
+}
+
+
 static char *_memltrim(char *bytes, size_t *length) {
   size_t i;
   for (i=0; isspace(*bytes) && (i < *length); i++) {
@@ -128,6 +207,62 @@ static char *_memltrim(char *bytes, size_t *length) {
 }
 
 
+// FNV-1a hash of len bytes of s
+static uint32_t _strhash(const char *s, size_t len) {
+  uint32_t h = 2166136261U;
+  while(len--) {
+    h = (h ^ (unsigned char)*s++) * 16777619U;
+  }
+  return h;
+}
+
+
+// Records are fingerprinted while they are parsed. Each key and value is
+// mixed into the running state, 8 bytes at a time, with trailing blanks
+// removed. The record type is the seed, uid is left out so that the same
+// record on different hosts has the same fingerprint.
+#define _FP_C1 0x87c37b91114253d5ULL
+#define _FP_C2 0x4cf5ad432745937fULL
+#define _FP_ROTL(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+static inline uint64_t _fingerprint_word(uint64_t h, uint64_t w) {
+  w *= _FP_C1;
+  w = _FP_ROTL(w, 31);
+  w *= _FP_C2;
+  h ^= w;
+  h = _FP_ROTL(h, 27);
+  return h*5 + 0x52dce729;
+}
+
+static void _fingerprint_add(uint64_t *fp, const char *p, size_t len) {
+  uint64_t h = *fp, w;
+  while(len && (p[len-1] == ' ' || p[len-1] == '\t')) {
+    len--;
+  }
+  h = _fingerprint_word(h, (uint64_t)len);
+  for(; len >= 8; p += 8, len -= 8) {
+    memcpy(&w, p, 8);
+    h = _fingerprint_word(h, w);
+  }
+  if(len) {
+    w = 0;
+    memcpy(&w, p, len);
+    h = _fingerprint_word(h, w);
+  }
+  *fp = h;
+}
+
+// Avalanches the running state. Never returns 0, which means "none".
+static uint64_t _fingerprint_final(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h ? h : 1;
+}
+
+
 static void _memrtrim(const char *bytes, size_t *length) {
   if(*length == 0) {
     return;
@@ -137,794 +272,5506 @@ static void _memrtrim(const char *bytes, size_t *length) {
 }
 
 
-static char *_readline(char *buf, int bufsize, FILE *f) {
-  char *line;
-  if((line = fgets(buf, bufsize, f)) == NULL) {
-    int errnum = ferror(f);
-    if(errnum) {
-      log_error("Error while reading: %s", strerror(errnum));
-      clearerr(f);
+// ---------------------------------------------
+#pragma mark -
+#pragma mark Line scanning
+
+// A line in the read buffer, with the offsets of its key/value separator
+// and value. Lines always end with LN.
+typedef struct {
+  char *ptr;
+  size_t len;     // including LN
+  size_t colon;   // offset of the first ':', or len if there is none
+  size_t val;     // offset of the first non-blank byte after colon
+} lsreg_line_t;
+
+// Indexes complete lines in [p, end), at most cap of them. Returns the
+// number of lines stored in lines.
+typedef size_t lsreg_scan_func(char *p, const char *end, lsreg_line_t *lines, size_t cap);
+
+
+#define _ISBLANK(c) ((c) == ' ' || (c) == '\t')
+
+
+// Portable kernel: one memchr per line and a short loop for the value.
+static size_t _scan_lines_scalar(char *p, const char *end, lsreg_line_t *lines, size_t cap) {
+  size_t n = 0;
+  char *nl, *colon, *v;
+  
+  while(n < cap && (nl = (char *)memchr(p, '\n', end - p)) != NULL) {
+    lines[n].ptr = p;
+    lines[n].len = (nl - p) + 1;
+    if((colon = (char *)memchr(p, ':', nl - p)) != NULL) {
+      for(v = colon+1; _ISBLANK(*v); v++);
+      lines[n].colon = colon - p;
+      lines[n].val = v - p;
+    }
+    else {
+      lines[n].colon = lines[n].val = lines[n].len;
     }
+    n++;
+    p = nl + 1;
   }
-  return line;
+  return n;
 }
 
 
-// ---------------------------------------------
-#pragma mark -
-#pragma mark Record methods
+#if LSREG_SSE2
 
-// Initialize record
-void lsreg_rec_init(lsreg_rec_t *s) {
-  s->uid = 0;
-  s->type = kLSRegRecTypeUnknown;
-  s->rec = NULL;
-}
+#if defined(__GNUC__) || defined(__clang__)
+  #define _CTZ64(x) ((unsigned int)__builtin_ctzll(x))
+#endif
 
-// Dump a record, in a human readable format, to stream
-void lsreg_rec_dump(lsreg_rec_t *s, FILE *stream) {
-  switch(s->type) {
-    case kLSRegRecTypeBundle:
-      lsreg_bundle_dump((lsreg_bundle_t *)s->rec, stream);
-      break;
-    case kLSRegRecTypeVolume:
-      lsreg_volume_dump((lsreg_volume_t *)s->rec, stream);
-      break;
-    case kLSRegRecTypeHandler:
-      lsreg_handler_dump((lsreg_handler_t *)s->rec, stream);
-      break;
-    default:
-      fprintf(stream, "No dump function for record of type unknown\n");
-  }
-}
+// Scanner state carried between 64-byte chunks
+typedef struct {
+  char *line;       // start of the current line
+  char *colon;      // ':' of the current line, or NULL
+  char *val;        // value of the current line, or NULL
+} lsreg_scan_state_t;
 
-// Free record members, but not the record itself
-void lsreg_rec_free_members(lsreg_rec_t *s) {
-  if(s->rec != NULL) {
-    switch(s->type) {
-      case kLSRegRecTypeBundle:
-        lsreg_bundle_free((lsreg_bundle_t *)s->rec);
+
+// Walks the newline, colon and blank masks of the 64 bytes at p, storing
+// each line which ends in the chunk. Returns the number of lines stored.
+static inline size_t _scan_masks(char *p, uint64_t nlm, uint64_t colm, uint64_t blankm,
+                                 lsreg_scan_state_t *st, lsreg_line_t *lines, size_t cap)
+{
+  size_t n = 0;
+  unsigned int pos = 0, i;
+  uint64_t m;
+  
+  while(pos < 64 && n < cap) {
+    m = ~(uint64_t)0 << pos;
+    if(st->colon == NULL) {
+      // Looking for the separator (or the end of a line without one)
+      if((m &= (colm | nlm)) == 0) {
         break;
-      case kLSRegRecTypeVolume:
-        lsreg_volume_free((lsreg_volume_t *)s->rec);
+      }
+      i = _CTZ64(m);
+      if(nlm & ((uint64_t)1 << i)) {
+        lines[n].ptr = st->line;
+        lines[n].len = (p + i - st->line) + 1;
+        lines[n].colon = lines[n].val = lines[n].len;
+        n++;
+        st->line = p + i + 1;
+      }
+      else {
+        st->colon = p + i;
+      }
+    }
+    else if(st->val == NULL) {
+      // Looking for the first non-blank byte after the separator
+      if((m &= ~blankm) == 0) {
         break;
-      case kLSRegRecTypeHandler:
-        lsreg_handler_free((lsreg_handler_t *)s->rec);
+      }
+      i = _CTZ64(m);
+      st->val = p + i;
+      continue; // the value may be LN itself
+    }
+    else {
+      // Looking for the end of the line
+      if((m &= nlm) == 0) {
         break;
-      default:
-        log_error("Failed to free record. No free method for record type.");
+      }
+      i = _CTZ64(m);
+      lines[n].ptr = st->line;
+      lines[n].len = (p + i - st->line) + 1;
+      lines[n].colon = st->colon - st->line;
+      lines[n].val = st->val - st->line;
+      n++;
+      st->line = p + i + 1;
+      st->colon = st->val = NULL;
     }
+    pos = i + 1;
   }
+  return n;
 }
 
-// Free record and all it's members
-void lsreg_rec_free(lsreg_rec_t *s) {
-  if(s != NULL) {
-    lsreg_rec_free_members(s);
-    free(s);
+
+// Finishes a vector scan using the scalar kernel
+static size_t _scan_tail(const char *end, lsreg_scan_state_t *st,
+                         lsreg_line_t *lines, size_t n, size_t cap)
+{
+  // Rescan the current (incomplete) line from its start
+  return n + _scan_lines_scalar(st->line, end, lines+n, cap-n);
+}
+
+
+static inline uint64_t _movemask16(__m128i v) {
+  return (uint64_t)(unsigned int)_mm_movemask_epi8(v);
+}
+
+
+static size_t _scan_lines_sse2(char *p, const char *end, lsreg_line_t *lines, size_t cap) {
+  const __m128i vnl = _mm_set1_epi8('\n');
+  const __m128i vcol = _mm_set1_epi8(':');
+  const __m128i vsp = _mm_set1_epi8(' ');
+  const __m128i vtab = _mm_set1_epi8('\t');
+  lsreg_scan_state_t st = { p, NULL, NULL };
+  size_t n = 0;
+  int k;
+  
+  while(n < cap && end - p >= 64) {
+    uint64_t nlm = 0, colm = 0, blankm = 0;
+    for(k = 0; k < 4; k++) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(p + k*16));
+      nlm    |= _movemask16(_mm_cmpeq_epi8(v, vnl)) << (k*16);
+      colm   |= _movemask16(_mm_cmpeq_epi8(v, vcol)) << (k*16);
+      blankm |= _movemask16(_mm_or_si128(_mm_cmpeq_epi8(v, vsp),
+                                         _mm_cmpeq_epi8(v, vtab))) << (k*16);
+    }
+    n += _scan_masks(p, nlm, colm, blankm, &st, lines+n, cap-n);
+    p += 64;
+  }
+  return n < cap ? _scan_tail(end, &st, lines, n, cap) : n;
+}
+
+
+#if LSREG_AVX2
+
+__attribute__((target("avx2")))
+static size_t _scan_lines_avx2(char *p, const char *end, lsreg_line_t *lines, size_t cap) {
+  const __m256i vnl = _mm256_set1_epi8('\n');
+  const __m256i vcol = _mm256_set1_epi8(':');
+  const __m256i vsp = _mm256_set1_epi8(' ');
+  const __m256i vtab = _mm256_set1_epi8('\t');
+  lsreg_scan_state_t st = { p, NULL, NULL };
+  size_t n = 0;
+  
+  while(n < cap && end - p >= 64) {
+    __m256i lo = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(p + 32));
+    uint64_t nlm, colm, blankm;
+    nlm = (uint64_t)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, vnl))
+        | (uint64_t)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, vnl)) << 32;
+    colm = (uint64_t)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, vcol))
+         | (uint64_t)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, vcol)) << 32;
+    blankm = (uint64_t)(unsigned int)_mm256_movemask_epi8(
+               _mm256_or_si256(_mm256_cmpeq_epi8(lo, vsp), _mm256_cmpeq_epi8(lo, vtab)))
+           | (uint64_t)(unsigned int)_mm256_movemask_epi8(
+               _mm256_or_si256(_mm256_cmpeq_epi8(hi, vsp), _mm256_cmpeq_epi8(hi, vtab))) << 32;
+    n += _scan_masks(p, nlm, colm, blankm, &st, lines+n, cap-n);
+    p += 64;
+  }
+  return n < cap ? _scan_tail(end, &st, lines, n, cap) : n;
+}
+
+#endif // LSREG_AVX2
+#endif // LSREG_SSE2
+
+
+static lsreg_scan_func *_scan_lines_impl = NULL;
+static pthread_once_t _scan_lines_once = PTHREAD_ONCE_INIT;
+
+// Picks the fastest kernel supported by the CPU
+static void _scan_lines_select() {
+#if LSREG_AVX2
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) {
+    _scan_lines_impl = _scan_lines_avx2;
+    return;
   }
+#endif
+#if LSREG_SSE2
+  _scan_lines_impl = _scan_lines_sse2;
+#else
+  _scan_lines_impl = _scan_lines_scalar;
+#endif
+}
+
+
+static size_t _scan_lines(char *p, const char *end, lsreg_line_t *lines, size_t cap) {
+  pthread_once(&_scan_lines_once, _scan_lines_select);
+  return _scan_lines_impl(p, end, lines, cap);
 }
 
 
+// ---------------------------------------------
 #pragma mark -
-#pragma mark Identifier methods
+#pragma mark Arena
 
+typedef struct lsreg_arena_block {
+  struct lsreg_arena_block *next;
+  size_t size;  // usable bytes following the header
+  size_t used;
+} lsreg_arena_block_t;
 
-int lsreg_identifier_parse(const char *ptr, size_t length, lsreg_identifier_t *s) {
-  size_t idlen;
-  const char *idstart;
-  int status;
+// Bump allocator. Blocks are kept when the arena is reset, so an arena
+// which is reused for one record after another stops calling malloc once
+// it has grown to fit the largest record.
+typedef struct lsreg_arena {
+  lsreg_arena_block_t *first;
+  lsreg_arena_block_t *current;
+} lsreg_arena_t;
+
+#define _ARENA_ALIGN(n) (((n) + (sizeof(void *)-1)) & ~(sizeof(void *)-1))
+#define _ARENA_BLOCK_DATA(b) ((char *)(b) + _ARENA_ALIGN(sizeof(lsreg_arena_block_t)))
+
+
+static void _arena_init(lsreg_arena_t *a) {
+  a->first = NULL;
+  a->current = NULL;
+}
+
+
+static lsreg_arena_block_t *_arena_block_create(size_t size) {
+  lsreg_arena_block_t *b;
+  if(size < LSREG_ARENA_BLOCK_SIZE) {
+    size = LSREG_ARENA_BLOCK_SIZE;
+  }
+  if((b = (lsreg_arena_block_t *)malloc(_ARENA_ALIGN(sizeof(lsreg_arena_block_t)) + size)) == NULL) {
+    return NULL;
+  }
+  b->next = NULL;
+  b->size = size;
+  b->used = 0;
+  return b;
+}
+
+
+static void *_arena_alloc(lsreg_arena_t *a, size_t size) {
+  lsreg_arena_block_t *b, *prev;
+  void *p;
   
-  status = 0;
+  size = _ARENA_ALIGN(size);
   
-  // "foo.bar.SomeThing (0x8000702f)"
-  if((idstart = _memrchr(ptr+length, '(', length)) != NULL) {
-    idstart += 3; // skip "(0x"
-    idlen = (length-(idstart-ptr))-1;
-    length = (idstart-ptr)-3; // skip "(0x"
-    if(_x32ntoi(idstart, idlen, &s->hash)) {
-      log_error_n("Failed to parse hexadecimal number in string '");
-      fwrite(idstart, sizeof(char), idlen, stderr);
-      fprintf(stderr, "'\n");
-      status = 1;
+  // Use the current block, or the next retained block with enough room
+  for(prev = NULL, b = a->current; b; prev = b, b = b->next) {
+    if(b->size - b->used >= size) {
+      break;
+    }
+    if(b->next) {
+      b->next->used = 0;
     }
   }
-  _memrtrim(ptr, &length);
-  STRCREATE(s->name, ptr, length);
-  return status;
+  
+  if(b == NULL) {
+    if((b = _arena_block_create(size)) == NULL) {
+      log_error("Arena allocation of %lu bytes failed", (unsigned long)size);
+      return NULL;
+    }
+    if(prev) {
+      prev->next = b;
+    }
+    else {
+      a->first = b;
+    }
+  }
+  
+  a->current = b;
+  p = _ARENA_BLOCK_DATA(b) + b->used;
+  b->used += size;
+  return p;
 }
 
 
-// Dump bundle, in a human readable format, to stream
-void lsreg_identifier_dump(lsreg_identifier_t *s, FILE *stream, const char *indent) {
-  fputs("<lsreg_identifier_t>", stream);
-  if(s == NULL) {
-    fputs("NULL\n", stream);
+// Forget all allocations in O(1), keeping blocks for reuse
+static void _arena_reset(lsreg_arena_t *a) {
+  a->current = a->first;
+  if(a->first) {
+    a->first->used = 0;
   }
-  else {
-    fprintf(stream,
-            "{\n"
-            "%s  name = \"%s\"\n"
-            "%s  hash = 0x%x\n"
-            "%s}\n",
-            indent, s->name,
-            indent, s->hash,
-            indent);
+}
+
+
+static void _arena_free(lsreg_arena_t *a) {
+  lsreg_arena_block_t *b, *next;
+  for(b = a->first; b; b = next) {
+    next = b->next;
+    free(b);
   }
+  _arena_init(a);
 }
 
 
 // ---------------------------------------------
 #pragma mark -
-#pragma mark Bundle methods
+#pragma mark String interning
 
-// Initialize bundle
-void lsreg_bundle_init(lsreg_bundle_t *s) {
-  s->uid = 0;
-  s->identifier.name = NULL;
-  s->identifier.hash = 0;
-  s->canonical_identifier.name = NULL;
-  s->canonical_identifier.hash = 0;
-  s->path = NULL;
-  s->name = NULL;
-  s->version = NULL;
-  s->type_code = NULL;
-  s->executable = NULL;
-  s->icon = NULL;
-  s->regdate = NULL;
-  s->moddate = NULL;
-  s->library = NULL;
-  s->library_items = NULL;
-}
+typedef struct {
+  char *str;                // NULL if the slot is empty
+  uint32_t hash;
+  uint32_t len;
+} lsreg_intern_entry_t;
 
-// Free all bundle members, but not the bundle itself
-void lsreg_bundle_free_members(lsreg_bundle_t *s) {
-  if(s->identifier.name)            free(s->identifier.name);
-  if(s->canonical_identifier.name)  free(s->canonical_identifier.name);
-  if(s->path)           free(s->path);
-  if(s->name)           free(s->name);
-  if(s->version)        free(s->version);
-  if(s->type_code)      free(s->type_code);
-  if(s->executable)     free(s->executable);
-  if(s->icon)           free(s->icon);
-  if(s->regdate)        free(s->regdate);
-  if(s->moddate)        free(s->moddate);
-  if(s->library)        free(s->library);
-  if(s->library_items) {
-    char *p;
-    char **pp;
-    for( pp = s->library_items; (p = *pp); pp++ ) {
-      free(p);
-    }
-    free(s->library_items);
+// Open addressing table of the strings whose hash selects the shard
+typedef struct {
+  pthread_mutex_t lock;
+  lsreg_intern_entry_t *slots;
+  size_t cap;               // power of two
+  size_t count;
+  lsreg_arena_t arena;      // string storage, never reset
+} lsreg_intern_shard_t;
+
+struct lsreg_intern {
+  lsreg_intern_shard_t shards[LSREG_INTERN_SHARDS];
+};
+
+
+lsreg_intern_t *lsreg_intern_create() {
+  lsreg_intern_t *t;
+  size_t i;
+  if((t = (lsreg_intern_t *)calloc(1, sizeof(lsreg_intern_t))) == NULL) {
+    return NULL;
   }
+  for(i = 0; i < LSREG_INTERN_SHARDS; i++) {
+    pthread_mutex_init(&t->shards[i].lock, NULL);
+    _arena_init(&t->shards[i].arena);
+  }
+  return t;
 }
 
-// Free bundle and all its members
-void lsreg_bundle_free(lsreg_bundle_t *s) {
-  if(s != NULL) {
-    lsreg_bundle_free_members(s);
-    free(s);
+
+void lsreg_intern_free(lsreg_intern_t *t) {
+  size_t i;
+  if(t == NULL) {
+    return;
+  }
+  for(i = 0; i < LSREG_INTERN_SHARDS; i++) {
+    pthread_mutex_destroy(&t->shards[i].lock);
+    free(t->shards[i].slots);
+    _arena_free(&t->shards[i].arena);
   }
+  free(t);
 }
 
-// Dump bundle, in a human readable format, to stream
-void lsreg_bundle_dump(lsreg_bundle_t *bundle, FILE *stream) {
-  if(bundle == NULL) {
-    fprintf(stream, "<lsreg_bundle_t>NULL\n");
+
+static int _intern_grow(lsreg_intern_shard_t *sh) {
+  lsreg_intern_entry_t *slots, *e;
+  size_t cap = sh->cap ? sh->cap * 2 : 256, i, j;
+  if((slots = (lsreg_intern_entry_t *)calloc(cap, sizeof(lsreg_intern_entry_t))) == NULL) {
+    return -1;
   }
-  else {
-    
-    char *regdate, *moddate;
-    regdate = strdup("0000-00-00 00:00:00");
-    moddate = strdup("0000-00-00 00:00:00");
-    if(bundle->regdate) {
-      strftime(regdate, 19, "%Y-%m-%d %T", bundle->regdate);
+  for(i = 0; i < sh->cap; i++) {
+    e = &sh->slots[i];
+    if(e->str) {
+      for(j = e->hash & (cap-1); slots[j].str; j = (j+1) & (cap-1));
+      slots[j] = *e;
     }
-    if(bundle->moddate) {
-      strftime(moddate, 19, "%Y-%m-%d %T", bundle->moddate);
+  }
+  free(sh->slots);
+  sh->slots = slots;
+  sh->cap = cap;
+  return 0;
+}
+
+
+const char *lsreg_intern(lsreg_intern_t *t, const char *ptr, size_t length) {
+  uint32_t hash = _strhash(ptr, length);
+  lsreg_intern_shard_t *sh = &t->shards[hash >> 24 & (LSREG_INTERN_SHARDS-1)];
+  lsreg_intern_entry_t *e;
+  char *str = NULL;
+  size_t i;
+  
+  pthread_mutex_lock(&sh->lock);
+  if(sh->count*2 >= sh->cap && _intern_grow(sh) != 0) {
+    goto done;
+  }
+  for(i = hash & (sh->cap-1); (e = &sh->slots[i])->str; i = (i+1) & (sh->cap-1)) {
+    if(e->hash == hash && e->len == length && memcmp(e->str, ptr, length) == 0) {
+      str = e->str;
+      goto done;
     }
-    
-    fprintf(stream,
-            "<lsreg_bundle_t>{\n"
+  }
+  if((str = (char *)_arena_alloc(&sh->arena, length+1)) != NULL) {
+    memcpy(str, ptr, length);
+    str[length] = '\0';
+    e->str = str;
+    e->hash = hash;
+    e->len = (uint32_t)length;
+    sh->count++;
+  }
+done:
+  pthread_mutex_unlock(&sh->lock);
+  return str;
+}
+
+
+// ---------------------------------------------
+#pragma mark -
+#pragma mark Reader
+
+// Reads at most size bytes into dst. Returns the number of bytes read,
+// 0 at end of input or -1 on error.
+typedef ssize_t lsreg_reader_fill_func(lsreg_reader_t *r, char *dst, size_t size);
+
+struct lsreg_reader {
+  lsreg_reader_fill_func *fill; // refills buf, or NULL for mapped sources
+  int fd;                   // fd sources, or -1
+  FILE *pipe;               // lsregister pipe, or NULL
+  const char *src;          // buffer source: unread input
+  const char *srcend;       // buffer source: end of input
+  void *pipeline;           // pipeline source: lsreg_pipeline_t
+  char *map;                // private mapping (or heap copy) owned by the reader
+  size_t maplen;
+  size_t mapsize;           // bytes mapped at map, a multiple of the page size
+  int map_is_heap;          // 1 if map was malloc'd rather than mmap'd
+  int zerocopy;             // 1 if strings may point into the source buffer
+  char *buf;                // block buffer
+  size_t bufsize;
+  char *pos;                // next unscanned byte in buf (or map)
+  char *end;                // end of valid data in buf (or map)
+  lsreg_line_t lines[LSREG_LINE_INDEX_SIZE]; // scanned lines preceding pos
+  size_t nlines;
+  size_t iline;             // next line to return from lines
+  int eof;
+  lsreg_arena_t arena;      // memory for the current record
+  char **items;             // scratch space for collecting library items
+  size_t itemssize;
+  size_t skip_lines;        // header lines left to skip
+  unsigned int fields[4];   // field masks, indexed by kLSRegRecType
+  unsigned int types;       // kLSRegRecTypeMasks
+  int keep_records;         // 1 to keep the arena between records
+  lsreg_intern_t *intern;   // table for kLSRegFieldInterned fields, or NULL
+  const struct lsreg_filter *filter; // records to produce, or NULL for all
+  const struct lsreg_snapshot_header *snap; // snapshot source, or NULL
+  size_t snap_next;         // next entry in the snapshot's record table
+  int done;
+};
+
+
+static lsreg_reader_t *_reader_create() {
+  lsreg_reader_t *r;
+  if((r = (lsreg_reader_t *)malloc(sizeof(lsreg_reader_t))) == NULL) {
+    return NULL;
+  }
+  r->fill = NULL;
+  r->fd = -1;
+  r->pipe = NULL;
+  r->src = NULL;
+  r->srcend = NULL;
+  r->pipeline = NULL;
+  r->map = NULL;
+  r->maplen = 0;
+  r->mapsize = 0;
+  r->map_is_heap = 0;
+  r->zerocopy = 0;
+  r->buf = NULL;
+  r->bufsize = 0;
+  r->pos = NULL;
+  r->end = NULL;
+  r->nlines = 0;
+  r->iline = 0;
+  r->eof = 0;
+  _arena_init(&r->arena);
+  r->items = NULL;
+  r->itemssize = 0;
+  r->skip_lines = LSREG_HEADER_LINES;
+  lsreg_reader_set_fields(r, NULL);
+  r->types = kLSRegAllTypesMask;
+  r->keep_records = 0;
+  r->intern = NULL;
+  r->filter = NULL;
+  r->snap = NULL;
+  r->snap_next = 0;
+  r->done = 0;
+  return r;
+}
+
+
+static ssize_t _reader_fill_fd(lsreg_reader_t *r, char *dst, size_t size) {
+  ssize_t n;
+  while((n = read(r->fd, dst, size)) == -1 && errno == EINTR);
+  return n;
+}
+
+
+static ssize_t _reader_fill_buffer(lsreg_reader_t *r, char *dst, size_t size) {
+  size_t n = r->srcend - r->src;
+  if(n > size) {
+    n = size;
+  }
+  memcpy(dst, r->src, n);
+  r->src += n;
+  return (ssize_t)n;
+}
+
+
+// Creates a reader which consumes its source in blocks using fill
+static lsreg_reader_t *_reader_create_block(lsreg_reader_fill_func *fill) {
+  lsreg_reader_t *r;
+  if((r = _reader_create()) == NULL) {
+    return NULL;
+  }
+  r->bufsize = LSREG_BLOCK_SIZE;
+  if((r->buf = (char *)malloc(r->bufsize)) == NULL) {
+    free(r);
+    return NULL;
+  }
+  r->pos = r->end = r->buf;
+  r->fill = fill;
+  return r;
+}
+
+
+// Moves unread data to the front of the buffer, growing it if it is
+// full, and reads another block. One byte is always left free so that a
+// final line lacking LN can be terminated.
+static void _reader_fill(lsreg_reader_t *r) {
+  size_t unread = r->end - r->pos;
+  ssize_t n;
+  
+  if(r->pos != r->buf) {
+    memmove(r->buf, r->pos, unread);
+  }
+  if(unread + 1 >= r->bufsize) {
+    char *buf;
+    if((buf = (char *)realloc(r->buf, r->bufsize * 2)) == NULL) {
+      log_error("Failed to grow read buffer to %lu bytes", (unsigned long)r->bufsize * 2);
+      r->eof = 1;
+      return;
+    }
+    r->buf = buf;
+    r->bufsize *= 2;
+  }
+  r->pos = r->buf;
+  r->end = r->buf + unread;
+  
+  if((n = r->fill(r, r->end, r->bufsize - unread - 1)) <= 0) {
+    if(n == -1) {
+      log_error("Error while reading: %s", strerror(errno));
+    }
+    r->eof = 1;
+    return;
+  }
+  r->end += n;
+}
+
+
+// Returns the next line, indexing another batch of lines when needed.
+// The line may be modified in place by the parser and is valid until the
+// next line is read.
+static lsreg_line_t *_nextline(lsreg_reader_t *r) {
+  if(r->iline < r->nlines) {
+    return &r->lines[r->iline++];
+  }
+  
+  for(;;) {
+    if((r->nlines = _scan_lines(r->pos, r->end, r->lines, LSREG_LINE_INDEX_SIZE))) {
+      r->pos = r->lines[r->nlines-1].ptr + r->lines[r->nlines-1].len;
+      r->iline = 1;
+      return &r->lines[0];
+    }
+    r->iline = 0;
+    if(r->eof) {
+      if(r->pos == r->end) {
+        return NULL;
+      }
+      // Terminate the last line. There is always room (see _reader_fill)
+      *r->end++ = '\n';
+      continue;
+    }
+    _reader_fill(r);
+  }
+}
+
+
+// Reads a line and stores its length in linelen. The line is terminated
+// by LN (but not NUL).
+static char *_readline(lsreg_reader_t *r, size_t *linelen) {
+  lsreg_line_t *line;
+  if((line = _nextline(r)) == NULL) {
+    return NULL;
+  }
+  *linelen = line->len;
+  return line->ptr;
+}
+
+
+// Pushes back the line which was last returned by _readline
+static void _unreadline(lsreg_reader_t *r) {
+  if(r->iline) {
+    r->iline--;
+  }
+}
+
+
+// Skips past the next line starting with "-", which ends the current
+// section. Lines which have not been indexed yet are not split up, but
+// searched for "-" directly. Returns 0 if the input ended first.
+static int _skip_section(lsreg_reader_t *r) {
+  char *p, *q, *lineend;
+  
+  // Lines already indexed
+  while(r->iline < r->nlines) {
+    if(r->lines[r->iline++].ptr[0] == '-') {
+      return 1;
+    }
+  }
+  
+  // r->pos is at the start of a line
+  for(;;) {
+    p = r->pos;
+    while( (q = (char *)memchr(p, '-', r->end - p)) ) {
+      if(q == r->pos || q[-1] == '\n') {
+        if((lineend = (char *)memchr(q, '\n', r->end - q)) == NULL) {
+          // Delimiter is the partial line at the end of the buffer
+          r->pos = q;
+          if(r->eof) {
+            r->pos = r->end;
+            return 1;
+          }
+          break;
+        }
+        r->pos = lineend+1;
+        return 1;
+      }
+      p = q+1;
+    }
+    if(q == NULL) {
+      // Nothing found. Keep the trailing partial line, if any, as its
+      // start is not known to the next search otherwise.
+      for(q = r->end; q > r->pos && q[-1] != '\n'; q--);
+      r->pos = q;
+    }
+    if(r->eof) {
+      r->pos = r->end;
+      return 0;
+    }
+    _reader_fill(r);
+  }
+}
+
+
+// Reads the lines of a plist document up to and including "</plist>",
+// searching the buffer for its end instead of splitting it into lines.
+// The document (without the final LN) is stored in *start and *len, and
+// is valid until the buffer is next filled. Returns 0 if the input ended.
+static int _read_plist(lsreg_reader_t *r, char **start, size_t *len) {
+  char *p, *q, *lineend;
+  size_t off = 0;
+  
+  // Give back lines already indexed
+  if(r->iline < r->nlines) {
+    r->pos = r->lines[r->iline].ptr;
+  }
+  r->nlines = r->iline = 0;
+  
+  for(;;) {
+    p = r->pos + off;
+    while( (q = (char *)_memmem(p, r->end - p, "</plist>", 8)) ) {
+      if(q == r->pos || q[-1] == '\n') {
+        if((lineend = (char *)memchr(q, '\n', r->end - q)) == NULL && !r->eof) {
+          break; // need the rest of the line
+        }
+        *start = r->pos;
+        *len = (q + 8) - r->pos;
+        r->pos = lineend ? lineend+1 : r->end;
+        return 1;
+      }
+      p = q+1;
+    }
+    if(r->eof) {
+      // Truncated document
+      *start = r->pos;
+      *len = r->end - r->pos;
+      r->pos = r->end;
+      return 0;
+    }
+    // Resume the search where a match could start
+    if(q == NULL) {
+      q = (r->end - r->pos > 7) ? r->end - 7 : r->pos;
+    }
+    off = q - r->pos;
+    _reader_fill(r);
+  }
+}
+
+
+// Allocates record memory from the reader's arena, or using malloc if r
+// is NULL.
+static void *_alloc(lsreg_reader_t *r, size_t size) {
+  return r ? _arena_alloc(&r->arena, size) : malloc(size);
+}
+
+
+// Returns a NUL terminated string with the contents of ptr.
+// For zero-copy readers, ptr is terminated in place and returned, otherwise
+// a copy is returned (see _alloc). The byte at ptr[len] must be part of the
+// current line (a separator or LN) when r is zero-copy.
+static char *_strref(lsreg_reader_t *r, const char *ptr, size_t len) {
+  char *s;
+  if(r && r->zerocopy) {
+    s = (char *)ptr;
+    s[len] = '\0';
+    return s;
+  }
+  if((s = (char *)_alloc(r, len+1)) == NULL) {
+    return NULL;
+  }
+  if(len) {
+    memcpy(s, ptr, len);
+  }
+  s[len] = '\0';
+  return s;
+}
+
+
+// Returns the interned copy of a string if the reader has an intern table
+static char *_strintern(lsreg_reader_t *r, const char *ptr, size_t len) {
+  char *s;
+  if(r && r->intern && (s = (char *)lsreg_intern(r->intern, ptr, len))) {
+    return s;
+  }
+  return _strref(r, ptr, len);
+}
+
+
+// ---------------------------------------------
+#pragma mark -
+#pragma mark Record methods
+
+// Initialize record
+void lsreg_rec_init(lsreg_rec_t *s) {
+  s->uid = 0;
+  s->type = kLSRegRecTypeUnknown;
+  s->flags = 0;
+  s->fingerprint = 0;
+  s->rec = NULL;
+}
+
+// Dump a record, in a human readable format, to stream
+void lsreg_rec_dump(lsreg_rec_t *s, FILE *stream) {
+  switch(s->type) {
+    case kLSRegRecTypeBundle:
+      lsreg_bundle_dump((lsreg_bundle_t *)s->rec, stream);
+      break;
+    case kLSRegRecTypeVolume:
+      lsreg_volume_dump((lsreg_volume_t *)s->rec, stream);
+      break;
+    case kLSRegRecTypeHandler:
+      lsreg_handler_dump((lsreg_handler_t *)s->rec, stream);
+      break;
+    default:
+      fprintf(stream, "No dump function for record of type unknown\n");
+  }
+}
+
+// Free record members, but not the record itself
+void lsreg_rec_free_members(lsreg_rec_t *s) {
+  if(s->rec != NULL) {
+    if(s->flags & kLSRegRecBorrowed) {
+      // Members live in the reader's arena, which is reset in O(1) for
+      // each record. Nothing to free.
+    }
+    else switch(s->type) {
+      case kLSRegRecTypeBundle:
+        lsreg_bundle_free((lsreg_bundle_t *)s->rec);
+        break;
+      case kLSRegRecTypeVolume:
+        lsreg_volume_free((lsreg_volume_t *)s->rec);
+        break;
+      case kLSRegRecTypeHandler:
+        lsreg_handler_free((lsreg_handler_t *)s->rec);
+        break;
+      default:
+        log_error("Failed to free record. No free method for record type.");
+    }
+    s->rec = NULL;
+    s->flags &= ~kLSRegRecBorrowed;
+  }
+}
+
+
+// Deep copy src into dst
+int lsreg_rec_copy(lsreg_rec_t *dst, const lsreg_rec_t *src) {
+  lsreg_rec_init(dst);
+  dst->uid = src->uid;
+  dst->type = src->type;
+  dst->fingerprint = src->fingerprint;
+  if(src->rec == NULL) {
+    return 0;
+  }
+  switch(src->type) {
+    case kLSRegRecTypeBundle:
+      dst->rec = lsreg_bundle_copy((const lsreg_bundle_t *)src->rec);
+      break;
+    case kLSRegRecTypeVolume:
+      dst->rec = lsreg_volume_copy((const lsreg_volume_t *)src->rec);
+      break;
+    case kLSRegRecTypeHandler:
+      dst->rec = lsreg_handler_copy((const lsreg_handler_t *)src->rec);
+      break;
+    default:
+      log_error("Failed to copy record. No copy method for record type.");
+      dst->type = kLSRegRecTypeUnknown;
+      return 1;
+  }
+  return 0;
+}
+
+// Free record and all it's members
+void lsreg_rec_free(lsreg_rec_t *s) {
+  if(s != NULL) {
+    lsreg_rec_free_members(s);
+    free(s);
+  }
+}
+
+
+#pragma mark -
+#pragma mark Identifier methods
+
+
+static int _identifier_parse(lsreg_reader_t *r, const char *ptr, size_t length,
+                             lsreg_identifier_t *s, int intern)
+{
+  size_t idlen;
+  const char *idstart;
+  int status;
+  
+  status = 0;
+  
+  // "foo.bar.SomeThing (0x8000702f)"
+  if((idstart = _memrchr(ptr+length, '(', length)) != NULL) {
+    idstart += 3; // skip "(0x"
+    idlen = (length-(idstart-ptr))-1;
+    length = (idstart-ptr)-3; // skip "(0x"
+    if(_x32ntoi(idstart, idlen, &s->hash)) {
+      log_error_n("Failed to parse hexadecimal number in string '");
+      fwrite(idstart, sizeof(char), idlen, stderr);
+      fprintf(stderr, "'\n");
+      status = 1;
+    }
+  }
+  _memrtrim(ptr, &length);
+  s->name = intern ? _strintern(r, ptr, length) : _strref(r, ptr, length);
+  return status;
+}
+
+
+int lsreg_identifier_parse(const char *ptr, size_t length, lsreg_identifier_t *s) {
+  return _identifier_parse(NULL, ptr, length, s, 0);
+}
+
+
+// Dump bundle, in a human readable format, to stream
+void lsreg_identifier_dump(lsreg_identifier_t *s, FILE *stream, const char *indent) {
+  fputs("<lsreg_identifier_t>", stream);
+  if(s == NULL) {
+    fputs("NULL\n", stream);
+  }
+  else {
+    fprintf(stream,
+            "{\n"
+            "%s  name = \"%s\"\n"
+            "%s  hash = 0x%x\n"
+            "%s}\n",
+            indent, s->name,
+            indent, s->hash,
+            indent);
+  }
+}
+
+
+// ---------------------------------------------
+#pragma mark -
+#pragma mark Date methods
+
+// Dates in the registry dump have no time zone and are taken to be UTC.
+// They are converted with the civil calendar algorithms by Howard Hinnant,
+// without going through struct tm or the locale.
+
+static int64_t _days_from_civil(int64_t y, unsigned int m, unsigned int d) {
+  int64_t era;
+  unsigned int yoe, doy, doe;
+  y -= m <= 2;
+  era = (y >= 0 ? y : y-399) / 400;
+  yoe = (unsigned int)(y - era * 400);
+  doy = (153*(m + (m > 2 ? -3 : 9)) + 2)/5 + d-1;
+  doe = yoe * 365 + yoe/4 - yoe/100 + doy;
+  return era * 146097 + (int64_t)doe - 719468;
+}
+
+
+static void _civil_from_days(int64_t z, int64_t *y, unsigned int *m, unsigned int *d) {
+  int64_t era;
+  unsigned int doe, yoe, doy, mp;
+  z += 719468;
+  era = (z >= 0 ? z : z - 146096) / 146097;
+  doe = (unsigned int)(z - era * 146097);
+  yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+  doy = doe - (365*yoe + yoe/4 - yoe/100);
+  mp = (5*doy + 2)/153;
+  *d = doy - (153*mp+2)/5 + 1;
+  *m = mp < 10 ? mp+3 : mp-9;
+  *y = (int64_t)yoe + era * 400 + (*m <= 2);
+}
+
+
+// Reads 1 to maxdigits decimal digits followed by sep (or the end of the
+// input if sep is 0). Returns a pointer past sep, or NULL.
+static const char *_date_field(const char *p, const char *end, int maxdigits,
+                               char sep, unsigned int *value)
+{
+  int n;
+  *value = 0;
+  for(n = 0; p < end && n < maxdigits && *p >= '0' && *p <= '9'; p++, n++) {
+    *value = *value * 10 + (unsigned int)(*p - '0');
+  }
+  if(n == 0) {
+    return NULL;
+  }
+  if(sep) {
+    return (p < end && *p == sep) ? p+1 : NULL;
+  }
+  return p;
+}
+
+
+static int _date_parse(const char *ptr, size_t length, time_t *date) {
+  const char *end = ptr + length;
+  unsigned int mon, day, year, hour, min, sec;
+  
+  // "6/26/2006 2:41:56"
+  if((ptr = _date_field(ptr, end, 2, '/', &mon)) == NULL ||
+     (ptr = _date_field(ptr, end, 2, '/', &day)) == NULL ||
+     (ptr = _date_field(ptr, end, 4, ' ', &year)) == NULL ||
+     (ptr = _date_field(ptr, end, 2, ':', &hour)) == NULL ||
+     (ptr = _date_field(ptr, end, 2, ':', &min)) == NULL ||
+     (ptr = _date_field(ptr, end, 2, 0, &sec)) == NULL ||
+     mon < 1 || mon > 12 || day < 1 || day > 31 || hour > 23 || min > 59 || sec > 60)
+  {
+    return 1;
+  }
+  *date = (time_t)(_days_from_civil(year, mon, day) * 86400 + hour*3600 + min*60 + sec);
+  return 0;
+}
+
+
+int lsreg_date_parse(const char *ptr, size_t length, time_t *date) {
+  return _date_parse(ptr, length, date);
+}
+
+
+static void _date_digits(char *p, unsigned int value, int n) {
+  while(n--) {
+    p[n] = (char)('0' + value % 10);
+    value /= 10;
+  }
+}
+
+
+// Formats date as "YYYY-MM-DD HH:MM:SS"
+char *lsreg_date_format(time_t date, char sep, char *buf) {
+  int64_t days, secs, y;
+  unsigned int m, d;
+  
+  days = (int64_t)date / 86400;
+  secs = (int64_t)date % 86400;
+  if(secs < 0) {
+    secs += 86400;
+    days--;
+  }
+  _civil_from_days(days, &y, &m, &d);
+  if(y < 0 || y > 9999) {
+    y = (y < 0) ? 0 : 9999;
+  }
+  _date_digits(buf, (unsigned int)y, 4);
+  buf[4] = '-';
+  _date_digits(buf+5, m, 2);
+  buf[7] = '-';
+  _date_digits(buf+8, d, 2);
+  buf[10] = sep;
+  _date_digits(buf+11, (unsigned int)(secs/3600), 2);
+  buf[13] = ':';
+  _date_digits(buf+14, (unsigned int)(secs/60%60), 2);
+  buf[16] = ':';
+  _date_digits(buf+17, (unsigned int)(secs%60), 2);
+  buf[19] = '\0';
+  return buf;
+}
+
+
+struct tm *lsreg_date_tm(time_t date, struct tm *tm) {
+  if(date == 0) {
+    return NULL;
+  }
+  return gmtime_r(&date, tm);
+}
+
+
+// ---------------------------------------------
+#pragma mark -
+#pragma mark Property lists
+
+// Returns a pointer past the '>' ending the markup starting at p ('<'),
+// or NULL if it is not terminated
+static const char *_plist_markup_end(const char *p, const char *end) {
+  const char *q;
+  if(end - p >= 4 && memcmp(p, "<!--", 4) == 0) {
+    q = (const char *)_memmem(p+4, end-p-4, "-->", 3);
+    return q ? q+3 : NULL;
+  }
+  q = (const char *)memchr(p, '>', end-p);
+  return q ? q+1 : NULL;
+}
+
+
+// Whether the tag at p ('<') is named name
+static int _plist_tag_is(const char *p, const char *gt, const char *name, size_t namelen) {
+  p++;
+  return (size_t)(gt - p) > namelen && memcmp(p, name, namelen) == 0 &&
+         (p[namelen] == '>' || p[namelen] == '/' || p[namelen] == ' ');
+}
+
+
+// Decodes an entity at p ('&') into out, which has room for 4 bytes.
+// Returns the number of bytes written and advances p, or 0 if p is not
+// at a known entity.
+static size_t _plist_entity(const char **p, const char *end, char *out) {
+  const char *s = *p + 1, *semi;
+  unsigned long c;
+  char *e;
+  
+  if((semi = (const char *)memchr(s, ';', end - s)) == NULL || semi - s > 8) {
+    return 0;
+  }
+  *p = semi + 1;
+  switch(semi - s) {
+    case 2:
+      if(memcmp(s, "lt", 2) == 0) { *out = '<'; return 1; }
+      if(memcmp(s, "gt", 2) == 0) { *out = '>'; return 1; }
+      break;
+    case 3:
+      if(memcmp(s, "amp", 3) == 0) { *out = '&'; return 1; }
+      break;
+    case 4:
+      if(memcmp(s, "quot", 4) == 0) { *out = '"'; return 1; }
+      if(memcmp(s, "apos", 4) == 0) { *out = '\''; return 1; }
+      break;
+  }
+  if(*s == '#') {
+    c = (s[1] == 'x') ? strtoul(s+2, &e, 16) : strtoul(s+1, &e, 10);
+    if(e == semi) {
+      // UTF-8
+      if(c < 0x80) { out[0] = (char)c; return 1; }
+      if(c < 0x800) {
+        out[0] = (char)(0xc0 | c >> 6);
+        out[1] = (char)(0x80 | (c & 0x3f));
+        return 2;
+      }
+      if(c < 0x10000) {
+        out[0] = (char)(0xe0 | c >> 12);
+        out[1] = (char)(0x80 | (c >> 6 & 0x3f));
+        out[2] = (char)(0x80 | (c & 0x3f));
+        return 3;
+      }
+      if(c < 0x110000) {
+        out[0] = (char)(0xf0 | c >> 18);
+        out[1] = (char)(0x80 | (c >> 12 & 0x3f));
+        out[2] = (char)(0x80 | (c >> 6 & 0x3f));
+        out[3] = (char)(0x80 | (c & 0x3f));
+        return 4;
+      }
+    }
+  }
+  *p = s - 1;
+  return 0;
+}
+
+
+// Decodes the text in [p, end) into buf. Returns the decoded length, or
+// size if it does not fit.
+static size_t _plist_decode(const char *p, const char *end, char *buf, size_t size) {
+  const char *amp;
+  size_t n = 0, k;
+  char tmp[4];
+  
+  while(p < end) {
+    if((amp = (const char *)memchr(p, '&', end - p)) == NULL) {
+      amp = end;
+    }
+    if((size_t)(amp - p) >= size - n) {
+      return size;
+    }
+    memcpy(buf + n, p, amp - p);
+    n += amp - p;
+    if((p = amp) == end) {
+      break;
+    }
+    if((k = _plist_entity(&p, end, tmp)) == 0) {
+      tmp[0] = *p++;
+      k = 1;
+    }
+    if(k >= size - n) {
+      return size;
+    }
+    memcpy(buf + n, tmp, k);
+    n += k;
+  }
+  return n;
+}
+
+
+// Whether the text in [p, end) equals key once decoded
+static int _plist_key_eq(const char *p, const char *end, const char *key, size_t keylen) {
+  char buf[256];
+  size_t n;
+  if(memchr(p, '&', end - p) == NULL) {
+    return (size_t)(end - p) == keylen && memcmp(p, key, keylen) == 0;
+  }
+  n = _plist_decode(p, end, buf, sizeof(buf));
+  return n == keylen && memcmp(buf, key, keylen) == 0;
+}
+
+
+// Find key in the first dict of a plist
+int lsreg_plist_find(const char *plist, size_t length, const char *key,
+                     const char **value, size_t *value_length)
+{
+  const char *p = plist, *end = plist + length, *gt, *text, *vstart = NULL;
+  size_t keylen = strlen(key);
+  int depth = 0, dict = -1, found = 0;
+  
+  while(p < end && (p = (const char *)memchr(p, '<', end - p)) != NULL) {
+    if((gt = _plist_markup_end(p, end)) == NULL) {
+      break;
+    }
+    if(p+1 < end && (p[1] == '?' || p[1] == '!')) {
+      // Declaration, doctype or comment
+    }
+    else if(p[1] == '/') {
+      if(--depth == dict && vstart) {
+        *value = vstart;
+        *value_length = gt - vstart;
+        return 0;
+      }
+      if(depth < dict) {
+        break; // end of the dict
+      }
+    }
+    else {
+      if(dict < 0) {
+        if(_plist_tag_is(p, gt, "dict", 4)) {
+          dict = depth+1;
+        }
+      }
+      else if(depth == dict) {
+        if(found) {
+          // The value following the key
+          if(gt[-2] == '/') {
+            *value = p;
+            *value_length = gt - p;
+            return 0;
+          }
+          vstart = p;
+        }
+        else if(_plist_tag_is(p, gt, "key", 3) && gt[-2] != '/') {
+          // Compare the text up to "</key>", which is read next
+          text = gt;
+          if((p = (const char *)memchr(text, '<', end - text)) == NULL) {
+            break;
+          }
+          found = _plist_key_eq(text, p, key, keylen);
+          depth++;
+          continue;
+        }
+      }
+      if(gt[-2] != '/') {
+        depth++;
+      }
+    }
+    p = gt;
+  }
+  return 1;
+}
+
+
+// Text of a simple value element
+char *lsreg_plist_text(const char *value, size_t length, char *buf, size_t size) {
+  const char *end = value + length, *gt, *lt;
+  size_t n;
+  
+  if(size == 0 || length < 3 || value[0] != '<' ||
+     (gt = (const char *)memchr(value, '>', length)) == NULL)
+  {
+    return NULL;
+  }
+  if(gt[-1] == '/') {
+    // "<true/>", or an empty element like "<string/>"
+    for(lt = value+1; lt < gt-1 && *lt != ' '; lt++);
+    n = lt - (value+1);
+    if(!((n == 4 && memcmp(value+1, "true", 4) == 0) ||
+         (n == 5 && memcmp(value+1, "false", 5) == 0)))
+    {
+      n = 0;
+    }
+    if(n >= size) {
+      return NULL;
+    }
+    memcpy(buf, value+1, n);
+  }
+  else {
+    // "<string>text</string>"
+    gt++;
+    if((lt = (const char *)memchr(gt, '<', end - gt)) == NULL || lt[1] != '/' ||
+       (n = _plist_decode(gt, lt, buf, size)) >= size)
+    {
+      return NULL;
+    }
+  }
+  buf[n] = '\0';
+  return buf;
+}
+
+
+// ---------------------------------------------
+#pragma mark -
+#pragma mark Fields
+
+// Field value decoders
+enum kLSRegFieldKind {
+  kLSRegFieldString = 1,  // "Foo Bar"
+  kLSRegFieldShortString, // "1.0", kept in lsreg_bundle_t.strings if it fits
+  kLSRegFieldFourCC,      // "'APPL'"
+  kLSRegFieldDate,        // "6/26/2006 2:41:56"
+  kLSRegFieldIdentifier,  // "foo.bar.SomeThing (0x8000a10b)"
+  kLSRegFieldInt,         // "-100"
+  kLSRegFieldFlags,       // "local  disk-image" or "0x0000000d"
+  kLSRegFieldMounted,     // "mounted" or "unmounted"
+  kLSRegFieldItems,       // value continues on the following lines
+  kLSRegFieldPlist,       // plist document on the following lines
+  
+  // Flag for string, identifier and items kinds: the values repeat across
+  // records and are interned when the reader has an intern table
+  kLSRegFieldInterned = 0x100
+};
+
+#define _FIELD_KIND(field) ((field)->kind & ~kLSRegFieldInterned)
+
+// Flag name
+typedef struct {
+  const char *name;
+  unsigned int value;
+} lsreg_flag_name_t;
+
+// Field descriptor
+typedef struct {
+  const char *key;
+  unsigned short keylen;
+  unsigned short kind;     // kLSRegFieldKind
+  size_t offset;           // offset of the member in the record struct
+  unsigned int mask;       // kLSRegBundleFields, kLSRegVolumeFields or kLSRegHandlerFields
+  const lsreg_flag_name_t *flag_names; // kLSRegFieldFlags only
+} lsreg_field_t;
+
+
+static const lsreg_flag_name_t _volume_flag_names[] = {
+  { "local",          kLSRegVolumeLocalFlag },
+  { "disk-image",     kLSRegVolumeDiskImageFlag },
+  { "system-device",  kLSRegVolumeSystemDeviceFlag },
+  { NULL, 0 }
+};
+
+static const lsreg_flag_name_t _handler_option_names[] = {
+  { "ignore-creator", kLSRegHandlerIgnoreCreator },
+  { NULL, 0 }
+};
+
+
+// Perfect hash of the keys of each record type, used as the index into
+// the field tables below. Adding a key means finding new constants for
+// which all keys of every table still hash to distinct slots.
+#define LSREG_FIELD_SLOTS 16
+#define _FIELD_HASH(key, keylen) \
+  (((((unsigned char)(key)[0])*23 + ((unsigned char)(key)[(keylen)-1])*50 + (keylen)) >> 3) \
+   & (LSREG_FIELD_SLOTS-1))
+
+#define _FIELD(key, kind, type, member, mask) \
+  { key, sizeof(key)-1, kind, offsetof(type, member), mask, NULL }
+#define _FIELD_FLAGS(key, type, member, mask, names) \
+  { key, sizeof(key)-1, kLSRegFieldFlags, offsetof(type, member), mask, names }
+#define _NO_FIELD { NULL, 0, 0, 0, 0, NULL }
+
+static const lsreg_field_t _bundle_fields[LSREG_FIELD_SLOTS] = {
+  /*  0 */ _FIELD("reg date",      kLSRegFieldDate,       lsreg_bundle_t, regdate,
+                  kLSRegBundleRegDateField),
+  /*  1 */ _FIELD("mod date",      kLSRegFieldDate,       lsreg_bundle_t, moddate,
+                  kLSRegBundleModDateField),
+  /*  2 */ _FIELD("properties",    kLSRegFieldPlist,      lsreg_bundle_t, properties,
+                  kLSRegBundlePropertiesField),
+  /*  3 */ _FIELD("version",       kLSRegFieldShortString, lsreg_bundle_t, version,
+                  kLSRegBundleVersionField),
+  /*  4 */ _FIELD("name",          kLSRegFieldShortString, lsreg_bundle_t, name,
+                  kLSRegBundleNameField),
+  /*  5 */ _FIELD("type code",     kLSRegFieldFourCC,     lsreg_bundle_t, type_code,
+                  kLSRegBundleTypeCodeField),
+  /*  6 */ _FIELD("library items", kLSRegFieldItems | kLSRegFieldInterned,
+                  lsreg_bundle_t, library_items, kLSRegBundleLibraryItemsField),
+  /*  7 */ _FIELD("identifier",    kLSRegFieldIdentifier, lsreg_bundle_t, identifier,
+                  kLSRegBundleIdentifierField),
+  /*  8 */ _NO_FIELD,
+  /*  9 */ _NO_FIELD,
+  /* 10 */ _FIELD("executable",    kLSRegFieldString | kLSRegFieldInterned,
+                  lsreg_bundle_t, executable, kLSRegBundleExecutableField),
+  /* 11 */ _FIELD("library",       kLSRegFieldString | kLSRegFieldInterned,
+                  lsreg_bundle_t, library, kLSRegBundleLibraryField),
+  /* 12 */ _FIELD("path",          kLSRegFieldString,     lsreg_bundle_t, path,
+                  kLSRegBundlePathField),
+  /* 13 */ _FIELD("icon",          kLSRegFieldString | kLSRegFieldInterned,
+                  lsreg_bundle_t, icon, kLSRegBundleIconField),
+  /* 14 */ _NO_FIELD,
+  /* 15 */ _FIELD("canonical id",  kLSRegFieldIdentifier, lsreg_bundle_t, canonical_identifier,
+                  kLSRegBundleCanonicalIdentifierField),
+};
+
+static const lsreg_field_t _volume_fields[LSREG_FIELD_SLOTS] = {
+  /*  0 */ _NO_FIELD,
+  /*  1 */ _NO_FIELD,
+  /*  2 */ _FIELD("state",         kLSRegFieldMounted,    lsreg_volume_t, is_mounted,
+                  kLSRegVolumeIsMountedField),
+  /*  3 */ _NO_FIELD,
+  /*  4 */ _FIELD_FLAGS("flags",   lsreg_volume_t, flags,
+                  kLSRegVolumeFlagsField, _volume_flag_names),
+  /*  5 */ _NO_FIELD,
+  /*  6 */ _NO_FIELD,
+  /*  7 */ _NO_FIELD,
+  /*  8 */ _FIELD("disk image",    kLSRegFieldString | kLSRegFieldInterned,
+                  lsreg_volume_t, disk_image, kLSRegVolumeDiskImageField),
+  /*  9 */ _NO_FIELD,
+  /* 10 */ _NO_FIELD,
+  /* 11 */ _NO_FIELD,
+  /* 12 */ _FIELD("path",          kLSRegFieldString | kLSRegFieldInterned,
+                  lsreg_volume_t, path, kLSRegVolumePathField),
+  /* 13 */ _FIELD("vrefnum",       kLSRegFieldInt,        lsreg_volume_t, vrefnum,
+                  kLSRegVolumeVRefNumField),
+  /* 14 */ _NO_FIELD,
+  /* 15 */ _NO_FIELD,
+};
+
+static const lsreg_field_t _handler_fields[LSREG_FIELD_SLOTS] = {
+  /*  0 */ _FIELD("unknown",       kLSRegFieldString | kLSRegFieldInterned,
+                  lsreg_handler_t, uri_scheme, kLSRegHandlerURISchemeField),
+  /*  1 */ _NO_FIELD,
+  /*  2 */ _NO_FIELD,
+  /*  3 */ _FIELD("extension",     kLSRegFieldString | kLSRegFieldInterned,
+                  lsreg_handler_t, extension, kLSRegHandlerExtensionField),
+  /*  4 */ _NO_FIELD,
+  /*  5 */ _FIELD("content type",  kLSRegFieldString | kLSRegFieldInterned,
+                  lsreg_handler_t, content_type, kLSRegHandlerContentTypeField),
+  /*  6 */ _FIELD("all roles",     kLSRegFieldIdentifier | kLSRegFieldInterned,
+                  lsreg_handler_t, roles, kLSRegHandlerRolesField),
+  /*  7 */ _NO_FIELD,
+  /*  8 */ _NO_FIELD,
+  /*  9 */ _NO_FIELD,
+  /* 10 */ _NO_FIELD,
+  /* 11 */ _NO_FIELD,
+  /* 12 */ _NO_FIELD,
+  /* 13 */ _NO_FIELD,
+  /* 14 */ _FIELD_FLAGS("options", lsreg_handler_t, options,
+                  kLSRegHandlerOptionsField, _handler_option_names),
+  /* 15 */ _NO_FIELD,
+};
+
+
+// Find the descriptor for key in table, or NULL if there is none
+static const lsreg_field_t *_field_lookup(const lsreg_field_t *table,
+                                          const char *key, size_t keylen)
+{
+  const lsreg_field_t *field;
+  if(keylen == 0) {
+    return NULL;
+  }
+  field = &table[_FIELD_HASH(key, keylen)];
+  if(field->keylen == keylen && memcmp(field->key, key, keylen) == 0) {
+    return field;
+  }
+  return NULL;
+}
+
+
+// Parses flag names separated by blanks, or a hexadecimal value
+static unsigned int _flags_parse(const lsreg_flag_name_t *names, const char *val, size_t vallen) {
+  const lsreg_flag_name_t *flag;
+  const char *end = val + vallen, *word;
+  unsigned int flags = 0;
+  
+  if(vallen > 2 && val[0] == '0' && val[1] == 'x') {
+    if(_x32ntoi(val+2, vallen-2, &flags) == 0) {
+      return flags;
+    }
+    flags = 0;
+  }
+  
+  while(val < end) {
+    for(; val < end && _ISBLANK(*val); val++);
+    for(word = val; val < end && !_ISBLANK(*val); val++);
+    if(val == word) {
+      break;
+    }
+    for(flag = names; flag->name; flag++) {
+      if(strlen(flag->name) == (size_t)(val-word) && memcmp(flag->name, word, val-word) == 0) {
+        flags |= flag->value;
+        break;
+      }
+    }
+  }
+  return flags;
+}
+
+
+// Packs up to 4 characters, padded with spaces, as a four-character code
+static uint32_t _fourcc_parse(const char *p, size_t len) {
+  uint32_t code = 0;
+  size_t i;
+  for(i = 0; i < 4; i++) {
+    code = (code << 8) | (unsigned char)(i < len ? p[i] : ' ');
+  }
+  return code;
+}
+
+
+// Like _strref, but stores short strings in the bundle itself
+static char *_bundle_strref(lsreg_reader_t *r, lsreg_bundle_t *b, const char *ptr, size_t len) {
+  char *s;
+  if(len >= sizeof(b->strings) - b->strings_used) {
+    return _strref(r, ptr, len);
+  }
+  s = b->strings + b->strings_used;
+  memcpy(s, ptr, len);
+  s[len] = '\0';
+  b->strings_used += (unsigned char)(len + 1);
+  return s;
+}
+
+
+// Whether p points into the inline strings of b
+#define _BUNDLE_INLINE(b, p) ((p) >= (b)->strings && (p) < (b)->strings + sizeof((b)->strings))
+
+
+// Points the inline strings of dst, a byte copy of src, at its own storage
+static void _bundle_rebase(lsreg_bundle_t *dst, const lsreg_bundle_t *src) {
+  if(_BUNDLE_INLINE(src, src->name)) {
+    dst->name = dst->strings + (src->name - src->strings);
+  }
+  if(_BUNDLE_INLINE(src, src->version)) {
+    dst->version = dst->strings + (src->version - src->strings);
+  }
+}
+
+
+// Decodes val into the member of s described by field. val must be NUL
+// terminated (the parser replaces LN with NUL).
+static int _field_decode(lsreg_reader_t *r, const lsreg_field_t *field, void *s,
+                         const char *val, size_t vallen)
+{
+  void *member = (char *)s + field->offset;
+  int intern = (field->kind & kLSRegFieldInterned) != 0;
+  
+  switch(_FIELD_KIND(field)) {
+    case kLSRegFieldString:
+      *(char **)member = intern ? _strintern(r, val, vallen) : _strref(r, val, vallen);
+      break;
+    case kLSRegFieldShortString:
+      // Only bundles have inline storage
+      *(char **)member = _bundle_strref(r, (lsreg_bundle_t *)s, val, vallen);
+      break;
+    case kLSRegFieldFourCC:
+      if(vallen > 1) {
+        *(uint32_t *)member = _fourcc_parse(val+1, vallen-2); // remove wrapping "'" chars
+      }
+      break;
+    case kLSRegFieldDate:
+      // input example: "6/26/2006 2:41:56"
+      if(_date_parse(val, vallen, (time_t *)member) != 0) {
+        log_error("Failed to parse date '%.*s'", (int)vallen, val);
+        return 1;
+      }
+      break;
+    case kLSRegFieldIdentifier:
+      return _identifier_parse(r, val, vallen, (lsreg_identifier_t *)member, intern);
+    case kLSRegFieldInt:
+      *(int *)member = atoi(val);
+      break;
+    case kLSRegFieldFlags:
+      *(unsigned int *)member = _flags_parse(field->flag_names, val, vallen);
+      break;
+    case kLSRegFieldMounted:
+      *(int *)member = (vallen == 7 && memcmp(val, "mounted", 7) == 0) ? 1 : 0;
+      break;
+    default:
+      return 1; // needs the reader (see lsreg_parse_bundle)
+  }
+  return 0;
+}
+
+
+// Set key and value on s using the field table of its type. Fields
+// outside mask are skipped without being decoded.
+static int _rec_nset(lsreg_reader_t *r, const lsreg_field_t *table,
+                     unsigned int mask, void *s,
+                     const char *key, size_t keylen,
+                     const char *val, size_t vallen)
+{
+  const lsreg_field_t *field;
+  if((field = _field_lookup(table, key, keylen)) == NULL) {
+    return 1; // no matching key
+  }
+  if((field->mask & mask) == 0) {
+    return 0;
+  }
+  return _field_decode(r, field, s, val, vallen);
+}
+
+
+// ---------------------------------------------
+#pragma mark -
+#pragma mark Filters
+
+#define LSREG_FILTER_MAX_PREDS 32
+
+enum kLSRegFilterOp {
+  kLSRegFilterEq = 1,     // =
+  kLSRegFilterNe,         // !=
+  kLSRegFilterPrefix,     // ^=
+  kLSRegFilterSuffix,     // $=
+  kLSRegFilterContains,   // *=
+  kLSRegFilterLt,         // <
+  kLSRegFilterLe,         // <=
+  kLSRegFilterGt,         // >
+  kLSRegFilterGe          // >=
+};
+
+// Operators, longest first
+static const struct {
+  const char *token;
+  enum kLSRegFilterOp op;
+} _filter_ops[] = {
+  { "!=", kLSRegFilterNe },
+  { "^=", kLSRegFilterPrefix },
+  { "$=", kLSRegFilterSuffix },
+  { "*=", kLSRegFilterContains },
+  { "<=", kLSRegFilterLe },
+  { ">=", kLSRegFilterGe },
+  { "=",  kLSRegFilterEq },
+  { "<",  kLSRegFilterLt },
+  { ">",  kLSRegFilterGt },
+  { NULL, 0 }
+};
+
+// Filter field names and the dump key of each field
+static const struct {
+  const char *name;
+  const char *key;
+} _filter_fields[] = {
+  { "identifier",           "identifier" },
+  { "canonical_identifier", "canonical id" },
+  { "path",                 "path" },
+  { "name",                 "name" },
+  { "version",              "version" },
+  { "type_code",            "type code" },
+  { "executable",           "executable" },
+  { "icon",                 "icon" },
+  { "library",              "library" },
+  { "disk_image",           "disk image" },
+  { "vrefnum",              "vrefnum" },
+  { "content_type",         "content type" },
+  { "extension",            "extension" },
+  { "uri_scheme",           "unknown" },
+  { "roles",                "all roles" },
+  { NULL, NULL }
+};
+
+typedef struct {
+  enum kLSRegFilterOp op;
+  const char *value;        // NUL terminated, in lsreg_filter.expr
+  size_t len;
+  unsigned int uid;         // value of an id predicate
+  int is_uid;
+  const lsreg_field_t *fields[4]; // descriptor for each kLSRegRecType, or NULL
+} lsreg_filter_pred_t;
+
+struct lsreg_filter {
+  char *expr;               // copy of the expression, holding the values
+  unsigned int types;       // kLSRegRecTypeMasks of records which can match
+  lsreg_filter_pred_t preds[LSREG_FILTER_MAX_PREDS];
+  size_t npreds;
+  uint32_t type_preds[4];   // field predicates of each type, as bits of preds
+  uint32_t slot_preds[4][LSREG_FIELD_SLOTS]; // ... by field table slot
+};
+
+
+static const lsreg_field_t *_field_tables[4] = {
+  NULL, _bundle_fields, _volume_fields, _handler_fields
+};
+
+
+// Compares a and b, taking runs of digits as numbers
+static int _version_cmp(const char *a, size_t alen, const char *b, size_t blen) {
+  const char *aend = a + alen, *bend = b + blen, *ad, *bd;
+  
+  while(a < aend && b < bend) {
+    if(isdigit((unsigned char)*a) && isdigit((unsigned char)*b)) {
+      for(; a < aend-1 && *a == '0' && isdigit((unsigned char)a[1]); a++);
+      for(; b < bend-1 && *b == '0' && isdigit((unsigned char)b[1]); b++);
+      for(ad = a; ad < aend && isdigit((unsigned char)*ad); ad++);
+      for(bd = b; bd < bend && isdigit((unsigned char)*bd); bd++);
+      if((ad - a) != (bd - b)) {
+        return (ad - a) < (bd - b) ? -1 : 1;
+      }
+      for(; a < ad; a++, b++) {
+        if(*a != *b) {
+          return (unsigned char)*a < (unsigned char)*b ? -1 : 1;
+        }
+      }
+    }
+    else if(*a != *b) {
+      return (unsigned char)*a < (unsigned char)*b ? -1 : 1;
+    }
+    else {
+      a++;
+      b++;
+    }
+  }
+  return (a < aend) - (b < bend);
+}
+
+
+static int _filter_test(const lsreg_filter_pred_t *p, const char *v, size_t len) {
+  switch(p->op) {
+    case kLSRegFilterEq:
+      return len == p->len && memcmp(v, p->value, len) == 0;
+    case kLSRegFilterNe:
+      return !(len == p->len && memcmp(v, p->value, len) == 0);
+    case kLSRegFilterPrefix:
+      return len >= p->len && memcmp(v, p->value, p->len) == 0;
+    case kLSRegFilterSuffix:
+      return len >= p->len && memcmp(v + len - p->len, p->value, p->len) == 0;
+    case kLSRegFilterContains:
+      return p->len == 0 || _memmem(v, len, p->value, p->len) != NULL;
+    case kLSRegFilterLt:
+      return _version_cmp(v, len, p->value, p->len) < 0;
+    case kLSRegFilterLe:
+      return _version_cmp(v, len, p->value, p->len) <= 0;
+    case kLSRegFilterGt:
+      return _version_cmp(v, len, p->value, p->len) > 0;
+    case kLSRegFilterGe:
+      return _version_cmp(v, len, p->value, p->len) >= 0;
+  }
+  return 0;
+}
+
+
+static int _filter_test_uid(const lsreg_filter_pred_t *p, unsigned int uid) {
+  switch(p->op) {
+    case kLSRegFilterEq: return uid == p->uid;
+    case kLSRegFilterNe: return uid != p->uid;
+    case kLSRegFilterLt: return uid < p->uid;
+    case kLSRegFilterLe: return uid <= p->uid;
+    case kLSRegFilterGt: return uid > p->uid;
+    case kLSRegFilterGe: return uid >= p->uid;
+    default:             return 0;
+  }
+}
+
+
+// Parses "field op value" at *pp into p. Returns 0 on success, 1 if the
+// predicate only narrows f->types, or -1 if it is invalid.
+static int _filter_parse_pred(lsreg_filter_t *f, char **pp, lsreg_filter_pred_t *p) {
+  char *s = *pp, *name, *value;
+  size_t namelen, i;
+  int type;
+  
+  for(name = s; *s == '_' || isalnum((unsigned char)*s); s++);
+  if((namelen = s - name) == 0) {
+    log_error("Expected a field name in filter at '%s'", name);
+    return -1;
+  }
+  for(i = 0; _filter_ops[i].token; i++) {
+    if(strncmp(s, _filter_ops[i].token, strlen(_filter_ops[i].token)) == 0) {
+      break;
+    }
+  }
+  if(_filter_ops[i].token == NULL) {
+    log_error("Expected an operator in filter at '%s'", s);
+    return -1;
+  }
+  memset(p, 0, sizeof(*p));
+  p->op = _filter_ops[i].op;
+  s += strlen(_filter_ops[i].token);
+  
+  // Value, quoted or up to the next blank. Either way it is terminated in
+  // place, which overwrites the blank or closing quote.
+  if(*s == '"') {
+    value = ++s;
+    if((s = strchr(s, '"')) == NULL) {
+      log_error("Unterminated quote in filter at '%s'", value-1);
+      return -1;
+    }
+  }
+  else {
+    for(value = s; *s && !isspace((unsigned char)*s); s++);
+  }
+  p->value = value;
+  p->len = s - value;
+  *pp = *s ? s+1 : s;
+  *s = '\0';
+  
+  if(namelen == 4 && strncmp(name, "type", 4) == 0) {
+    if(p->op != kLSRegFilterEq && p->op != kLSRegFilterNe) {
+      log_error("type can only be compared with = or !=");
+      return -1;
+    }
+    if(strcmp(p->value, "bundle") == 0)        type = kLSRegRecTypeBundle;
+    else if(strcmp(p->value, "volume") == 0)   type = kLSRegRecTypeVolume;
+    else if(strcmp(p->value, "handler") == 0)  type = kLSRegRecTypeHandler;
+    else {
+      log_error("Unknown record type '%s' in filter", p->value);
+      return -1;
+    }
+    f->types &= (p->op == kLSRegFilterEq) ? (1 << type) : ~(1 << type);
+    return 1; // nothing left to evaluate
+  }
+  
+  if(namelen == 2 && strncmp(name, "id", 2) == 0) {
+    char *end;
+    unsigned long uid = strtoul(p->value, &end, 10);
+    if(p->len == 0 || *end != '\0' || uid > UINT_MAX ||
+       p->op == kLSRegFilterPrefix || p->op == kLSRegFilterSuffix || p->op == kLSRegFilterContains)
+    {
+      log_error("id must be compared with a number using =, !=, <, <=, > or >=");
+      return -1;
+    }
+    p->uid = (unsigned int)uid;
+    p->is_uid = 1;
+    return 0;
+  }
+  
+  for(i = 0; _filter_fields[i].name; i++) {
+    if(strlen(_filter_fields[i].name) == namelen && strncmp(_filter_fields[i].name, name, namelen) == 0) {
+      break;
+    }
+  }
+  if(_filter_fields[i].name == NULL) {
+    log_error("Unknown field '%.*s' in filter", (int)namelen, name);
+    return -1;
+  }
+  for(type = kLSRegRecTypeBundle; type <= kLSRegRecTypeHandler; type++) {
+    p->fields[type] = _field_lookup(_field_tables[type], _filter_fields[i].key,
+                                    strlen(_filter_fields[i].key));
+    if(p->fields[type] == NULL) {
+      // Records of this type never have the field
+      f->types &= ~(1 << type);
+    }
+  }
+  return 0;
+}
+
+
+// Compile a filter expression
+lsreg_filter_t *lsreg_filter_compile(const char *expr) {
+  lsreg_filter_t *f;
+  lsreg_filter_pred_t *p;
+  char *s;
+  int type, status;
+  
+  if((f = (lsreg_filter_t *)calloc(1, sizeof(lsreg_filter_t))) == NULL ||
+     (f->expr = strdup(expr)) == NULL)
+  {
+    free(f);
+    return NULL;
+  }
+  f->types = kLSRegAllTypesMask;
+  
+  for(s = f->expr; ; ) {
+    for(; isspace((unsigned char)*s); s++);
+    if(f->npreds == LSREG_FILTER_MAX_PREDS) {
+      log_error("Too many predicates in filter (max %d)", LSREG_FILTER_MAX_PREDS);
+      goto fail;
+    }
+    p = &f->preds[f->npreds];
+    if((status = _filter_parse_pred(f, &s, p)) < 0) {
+      goto fail;
+    }
+    if(status == 0) {
+      f->npreds++;
+    }
+    for(; isspace((unsigned char)*s); s++);
+    if(*s == '\0') {
+      break;
+    }
+    if(strncasecmp(s, "and", 3) != 0 || !isspace((unsigned char)s[3])) {
+      log_error("Expected 'and' in filter at '%s'", s);
+      goto fail;
+    }
+    s += 4;
+  }
+  
+  // Index field predicates by type and by the slot of their field
+  for(p = f->preds; p < f->preds + f->npreds; p++) {
+    for(type = kLSRegRecTypeBundle; !p->is_uid && type <= kLSRegRecTypeHandler; type++) {
+      if(p->fields[type]) {
+        f->type_preds[type] |= (uint32_t)1 << (p - f->preds);
+        f->slot_preds[type][p->fields[type] - _field_tables[type]] |= (uint32_t)1 << (p - f->preds);
+      }
+    }
+  }
+  return f;
+  
+fail:
+  lsreg_filter_free(f);
+  return NULL;
+}
+
+
+void lsreg_filter_free(lsreg_filter_t *f) {
+  if(f) {
+    free(f->expr);
+    free(f);
+  }
+}
+
+
+// The text of a decoded field, for comparing it. buf must have room for
+// LSREG_FOURCC_SIZE or a formatted int.
+static const char *_filter_member(const lsreg_field_t *field, const void *s, char *buf, size_t *len) {
+  const void *member = (const char *)s + field->offset;
+  const char *v = NULL;
+  
+  switch(_FIELD_KIND(field)) {
+    case kLSRegFieldString:
+    case kLSRegFieldShortString:
+      v = *(char * const *)member;
+      break;
+    case kLSRegFieldIdentifier:
+      v = ((const lsreg_identifier_t *)member)->name;
+      break;
+    case kLSRegFieldFourCC:
+      v = lsreg_fourcc_format(*(const uint32_t *)member, buf);
+      break;
+    case kLSRegFieldInt:
+      sprintf(buf, "%d", *(const int *)member);
+      v = buf;
+      break;
+    default:
+      break;
+  }
+  if(v == NULL) {
+    v = "";
+  }
+  *len = strlen(v);
+  return v;
+}
+
+
+// Evaluates the predicates in preds on the decoded record
+static int _filter_match_preds(const lsreg_filter_t *f, const lsreg_rec_t *rec, uint32_t preds) {
+  const lsreg_filter_pred_t *p;
+  const char *v;
+  char buf[16];
+  size_t len;
+  
+  for(; preds; preds &= preds-1) {
+    p = &f->preds[__builtin_ctz(preds)];
+    v = _filter_member(p->fields[rec->type], rec->rec, buf, &len);
+    if(!_filter_test(p, v, len)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+// Whether a record of type with uid can match f, judging by type and id
+static int _filter_accepts(const lsreg_filter_t *f, enum kLSRegRecType type, unsigned int uid) {
+  const lsreg_filter_pred_t *p;
+  if(!(f->types & (1 << type))) {
+    return 0;
+  }
+  for(p = f->preds; p < f->preds + f->npreds; p++) {
+    if(p->is_uid && !_filter_test_uid(p, uid)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+// Evaluates the predicates on the field of a dump line which are still in
+// *pending, removing them. Returns 0 if one fails.
+static int _filter_line(const lsreg_filter_t *f, enum kLSRegRecType type, uint32_t *pending,
+                        const char *key, size_t keylen, const char *val, size_t vallen)
+{
+  const lsreg_field_t *field;
+  const char *idstart;
+  char fourcc[LSREG_FOURCC_SIZE];
+  uint32_t preds;
+  
+  if((field = _field_lookup(_field_tables[type], key, keylen)) == NULL ||
+     (preds = f->slot_preds[type][field - _field_tables[type]] & *pending) == 0)
+  {
+    return 1;
+  }
+  *pending &= ~preds;
+  
+  // Compare the text the field decodes to
+  switch(_FIELD_KIND(field)) {
+    case kLSRegFieldIdentifier:
+      // "foo.bar.SomeThing (0x8000702f)"
+      if((idstart = _memrchr(val+vallen, '(', vallen)) != NULL) {
+        vallen = idstart - val;
+      }
+      _memrtrim(val, &vallen);
+      break;
+    case kLSRegFieldFourCC:
+      // As formatted by lsreg_fourcc_format()
+      if(vallen > 1) {
+        val = lsreg_fourcc_format(_fourcc_parse(val+1, vallen-2), fourcc); // remove wrapping "'" chars
+        vallen = 4;
+      }
+      break;
+    default:
+      break;
+  }
+  for(; preds; preds &= preds-1) {
+    if(!_filter_test(&f->preds[__builtin_ctz(preds)], val, vallen)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+int lsreg_filter_match(const lsreg_filter_t *f, const lsreg_rec_t *rec) {
+  if(rec->type == kLSRegRecTypeUnknown || rec->rec == NULL ||
+     !_filter_accepts(f, rec->type, rec->uid))
+  {
+    return 0;
+  }
+  return _filter_match_preds(f, rec, f->type_preds[rec->type]);
+}
+
+
+// ---------------------------------------------
+#pragma mark -
+#pragma mark Bundle methods
+
+// Initialize bundle
+void lsreg_bundle_init(lsreg_bundle_t *s) {
+  s->uid = 0;
+  s->identifier.name = NULL;
+  s->identifier.hash = 0;
+  s->canonical_identifier.name = NULL;
+  s->canonical_identifier.hash = 0;
+  s->path = NULL;
+  s->name = NULL;
+  s->version = NULL;
+  s->type_code = 0;
+  s->executable = NULL;
+  s->icon = NULL;
+  s->regdate = 0;
+  s->moddate = 0;
+  s->library = NULL;
+  s->library_items = NULL;
+  s->properties = NULL;
+  s->properties_len = 0;
+  s->strings_used = 0;
+}
+
+// Free all bundle members, but not the bundle itself
+void lsreg_bundle_free_members(lsreg_bundle_t *s) {
+  if(s->identifier.name)            free(s->identifier.name);
+  if(s->canonical_identifier.name)  free(s->canonical_identifier.name);
+  if(s->path)           free(s->path);
+  if(s->name && !_BUNDLE_INLINE(s, s->name))       free(s->name);
+  if(s->version && !_BUNDLE_INLINE(s, s->version)) free(s->version);
+  if(s->executable)     free(s->executable);
+  if(s->icon)           free(s->icon);
+  if(s->library)        free(s->library);
+  if(s->properties)     free(s->properties);
+  if(s->library_items) {
+    char *p;
+    char **pp;
+    for( pp = s->library_items; (p = *pp); pp++ ) {
+      free(p);
+    }
+    free(s->library_items);
+  }
+}
+
+// Free bundle and all its members
+void lsreg_bundle_free(lsreg_bundle_t *s) {
+  if(s != NULL) {
+    lsreg_bundle_free_members(s);
+    free(s);
+  }
+}
+
+// Deep copy a bundle
+lsreg_bundle_t *lsreg_bundle_copy(const lsreg_bundle_t *s) {
+  lsreg_bundle_t *copy;
+  
+  copy = (lsreg_bundle_t *)malloc(sizeof(lsreg_bundle_t));
+  copy->uid = s->uid;
+  copy->identifier.name = _strdup_null(s->identifier.name);
+  copy->identifier.hash = s->identifier.hash;
+  copy->canonical_identifier.name = _strdup_null(s->canonical_identifier.name);
+  copy->canonical_identifier.hash = s->canonical_identifier.hash;
+  copy->path = _strdup_null(s->path);
+  copy->strings_used = s->strings_used;
+  memcpy(copy->strings, s->strings, sizeof(s->strings));
+  copy->name = _BUNDLE_INLINE(s, s->name) ? NULL : _strdup_null(s->name);
+  copy->version = _BUNDLE_INLINE(s, s->version) ? NULL : _strdup_null(s->version);
+  _bundle_rebase(copy, s);
+  copy->type_code = s->type_code;
+  copy->executable = _strdup_null(s->executable);
+  copy->icon = _strdup_null(s->icon);
+  copy->regdate = s->regdate;
+  copy->moddate = s->moddate;
+  copy->library = _strdup_null(s->library);
+  copy->library_items = NULL;
+  copy->properties = NULL;
+  copy->properties_len = s->properties_len;
+  
+  if(s->properties) {
+    copy->properties = (char *)malloc(s->properties_len+1);
+    memcpy(copy->properties, s->properties, s->properties_len);
+    copy->properties[s->properties_len] = '\0';
+  }
+  
+  if(s->library_items) {
+    size_t i, count;
+    for(count = 0; s->library_items[count]; count++);
+    copy->library_items = (char **)malloc(sizeof(char *)*(count+1));
+    for(i = 0; i < count; i++) {
+      copy->library_items[i] = strdup(s->library_items[i]);
+    }
+    copy->library_items[count] = NULL; /* sentinel */
+  }
+  
+  return copy;
+}
+
+// Dump bundle, in a human readable format, to stream
+void lsreg_bundle_dump(lsreg_bundle_t *bundle, FILE *stream) {
+  if(bundle == NULL) {
+    fprintf(stream, "<lsreg_bundle_t>NULL\n");
+  }
+  else {
+    
+    char type_code[LSREG_FOURCC_SIZE];
+    char regdate[LSREG_DATE_SIZE] = "0000-00-00 00:00:00";
+    char moddate[LSREG_DATE_SIZE] = "0000-00-00 00:00:00";
+    if(bundle->regdate) {
+      lsreg_date_format(bundle->regdate, ' ', regdate);
+    }
+    if(bundle->moddate) {
+      lsreg_date_format(bundle->moddate, ' ', moddate);
+    }
+    
+    fprintf(stream,
+            "<lsreg_bundle_t>{\n"
             "  uid                  = %u\n"
             "  identifier           = ", bundle->uid);
     lsreg_identifier_dump(&bundle->identifier, stream, "  ");
     fputs("  canonical_identifier = ", stream);
     lsreg_identifier_dump(&bundle->canonical_identifier, stream, "  ");
     
-    fprintf(stream,
-            "  path                 = \"%s\"\n"
-            "  name                 = \"%s\"\n"
-            "  version              = \"%s\"\n"
-            "  type_code            = \"%s\"\n"
-            "  executable           = \"%s\"\n"
-            "  icon                 = \"%s\"\n"
-            "  regdate              = %s\n"
-            "  moddate              = %s\n"
-            "  library              = \"%s\"\n"
-            "  library_items        = "
-            ,
-            bundle->path,
-            bundle->name,
-            bundle->version,
-            bundle->type_code,
-            bundle->executable,
-            bundle->icon,
-            regdate,
-            moddate,
-            bundle->library);
+    fprintf(stream,
+            "  path                 = \"%s\"\n"
+            "  name                 = \"%s\"\n"
+            "  version              = \"%s\"\n"
+            "  type_code            = \"%s\"\n"
+            "  executable           = \"%s\"\n"
+            "  icon                 = \"%s\"\n"
+            "  regdate              = %s\n"
+            "  moddate              = %s\n"
+            "  library              = \"%s\"\n"
+            "  library_items        = "
+            ,
+            bundle->path,
+            bundle->name,
+            bundle->version,
+            lsreg_fourcc_format(bundle->type_code, type_code),
+            bundle->executable,
+            bundle->icon,
+            regdate,
+            moddate,
+            bundle->library);
+    
+    if(bundle->library_items) {
+      fputs("[\n", stream);
+      char *item;
+      char **v;
+      for( v = bundle->library_items; (item = *v); v++ ) {
+        fprintf(stream, "    \"%s\"\n", item);
+      }
+      fputs("  ]\n", stream);
+    }
+    else {
+      fputs("NULL\n", stream);
+    }
+    
+    fputs("}\n", stream);
+  }
+}
+
+
+// Format a four-character code
+char *lsreg_fourcc_format(uint32_t code, char *buf) {
+  if(code == 0) {
+    return NULL;
+  }
+  buf[0] = (char)(code >> 24);
+  buf[1] = (char)(code >> 16);
+  buf[2] = (char)(code >> 8);
+  buf[3] = (char)code;
+  buf[4] = '\0';
+  return buf;
+}
+
+
+// Find key in the properties of bundle
+int lsreg_bundle_property(const lsreg_bundle_t *bundle, const char *key,
+                          const char **value, size_t *value_length)
+{
+  if(bundle->properties == NULL) {
+    return 1;
+  }
+  return lsreg_plist_find(bundle->properties, bundle->properties_len, key, value, value_length);
+}
+
+
+// Set key and value
+int lsreg_bundle_nset(lsreg_bundle_t *bundle, 
+                      const char *key, size_t keylen,
+                      const char *val, size_t vallen)
+{
+  return _rec_nset(NULL, _bundle_fields, LSREG_ALL_FIELDS, bundle, key, keylen, val, vallen);
+}
+
+
+// ---------------------------------------------
+#pragma mark -
+#pragma mark Volume record methods
+
+/*
+ char *path;       // Mount path. May not exist.
+ char *disk_image; // May be NULL if not a disk_image
+ int is_mounted;   // 1 or 0
+ int vrefnum;      // May be 0 if not present
+ enum kLSRegVolumeFlags flags;
+ */
+
+// Initialize volume
+void lsreg_volume_init(lsreg_volume_t *s) {
+  s->uid = 0;
+  s->path = NULL;
+  s->disk_image = NULL;
+  s->is_mounted = 0;
+  s->vrefnum = 0;
+  s->flags = 0;
+}
+
+// Free all bundle members, but not the volume itself
+void lsreg_volume_free_members(lsreg_volume_t *s) {
+  if(s->path)           free(s->path);
+  if(s->disk_image)     free(s->disk_image);
+}
+
+// Free volume and all its members
+void lsreg_volume_free(lsreg_volume_t *s) {
+  if(s != NULL) {
+    lsreg_volume_free_members(s);
+    free(s);
+  }
+}
+
+// Deep copy a volume
+lsreg_volume_t *lsreg_volume_copy(const lsreg_volume_t *s) {
+  lsreg_volume_t *copy;
+  copy = (lsreg_volume_t *)malloc(sizeof(lsreg_volume_t));
+  *copy = *s;
+  copy->path = _strdup_null(s->path);
+  copy->disk_image = _strdup_null(s->disk_image);
+  return copy;
+}
+
+// Dump bundle, in a human readable format, to stream
+void lsreg_volume_dump(lsreg_volume_t *s, FILE *stream) {
+  if(s == NULL) {
+    fprintf(stream, "<lsreg_volume_t>NULL\n");
+  }
+  else {
+    fprintf(stream,
+            "<lsreg_volume_t>{\n"
+            "  uid        = %u\n"
+            "  path       = \"%s\"\n"
+            "  disk_image = \"%s\"\n"
+            "  is_mounted = %s\n"
+            "  vrefnum    = %d\n"
+            "  flags      = 0x%x\n"
+            "}\n",
+            s->uid,
+            s->path,
+            s->disk_image,
+            s->is_mounted ? "YES" : "NO",
+            s->vrefnum,
+            s->flags);
+  }
+}
+
+
+// ---------------------------------------------
+#pragma mark -
+#pragma mark Handler record methods
+
+// Initialize volume
+void lsreg_handler_init(lsreg_handler_t *s) {
+  s->uid = 0;
+  s->content_type = NULL;
+  s->extension = NULL;
+  s->uri_scheme = NULL;
+  s->roles.name = NULL;
+  s->roles.hash = 0;
+  s->options = 0;
+  s->bundle = NULL;
+}
+
+// Free all bundle members, but not the volume itself
+void lsreg_handler_free_members(lsreg_handler_t *s) {
+  if(s->content_type) free(s->content_type);
+  if(s->extension)    free(s->extension);
+  if(s->uri_scheme)  free(s->uri_scheme);
+  if(s->roles.name)   free(s->roles.name);
+}
+
+// Free volume and all its members
+void lsreg_handler_free(lsreg_handler_t *s) {
+  if(s != NULL) {
+    lsreg_handler_free_members(s);
+    free(s);
+  }
+}
+
+// Deep copy a handler
+lsreg_handler_t *lsreg_handler_copy(const lsreg_handler_t *s) {
+  lsreg_handler_t *copy;
+  copy = (lsreg_handler_t *)malloc(sizeof(lsreg_handler_t));
+  *copy = *s;
+  copy->content_type = _strdup_null(s->content_type);
+  copy->extension = _strdup_null(s->extension);
+  copy->uri_scheme = _strdup_null(s->uri_scheme);
+  copy->roles.name = _strdup_null(s->roles.name);
+  copy->bundle = NULL; // owned by a database
+  return copy;
+}
+
+// Dump bundle, in a human readable format, to stream
+void lsreg_handler_dump(lsreg_handler_t *s, FILE *stream) {
+  fputs("<lsreg_handler_t>", stream);
+  if(s == NULL) {
+    fputs("NULL\n", stream);
+  }
+  else {
+    fprintf(stream,
+            "{\n"
+            "  uid          = %u\n"
+            "  content_type = \"%s\"\n"
+            "  extension    = \"%s\"\n"
+            "  uri_scheme   = \"%s\"\n"
+            "  roles        = ",
+            s->uid,
+            s->content_type,
+            s->extension,
+            s->uri_scheme);
+    
+    lsreg_identifier_dump(&s->roles, stream, "  ");
+    
+    fprintf(stream,
+            "  options      = 0x%x\n"
+            "}\n",
+            s->options);
+  }
+}
+
+
+// ---------------------------------------------
+#pragma mark -
+#pragma mark Parsing
+  
+int lsreg_parse_bundle(lsreg_reader_t *r,
+                       char *line, size_t linelen,
+                       char *key, size_t keylen,
+                       char *val, size_t vallen,
+                       lsreg_rec_t *record)
+{
+  lsreg_bundle_t *bundle = (lsreg_bundle_t *)record->rec;
+  const lsreg_field_t *field;
+  unsigned int mask = r->fields[kLSRegRecTypeBundle];
+  
+  if((field = _field_lookup(_bundle_fields, key, keylen)) == NULL) {
+    // Unknown key
+  }
+  // The "library items" key is special
+  else if(_FIELD_KIND(field) == kLSRegFieldItems) {
+    
+    // Copy normal identifier to canonical if same.
+    // We know "library items" always comes after canonical id,
+    // so if it's not set, we know it does not exist, thus the
+    // normal identifier IS canonical.
+    if(bundle->canonical_identifier.name == NULL && bundle->identifier.name != NULL) {
+      // The record is borrowed, so the name can be shared
+      bundle->canonical_identifier.name = bundle->identifier.name;
+      bundle->canonical_identifier.hash = bundle->identifier.hash;
+    }
+    
+    if(vallen && (field->mask & mask) == 0) {
+      // Not wanted. Skip the items without copying them.
+      while( (line = _readline(r, &linelen)) ) {
+        if(!(linelen > 16 && line[0] == '\t' && line[1] == ' ' && line[2] == ' ')) {
+          _unreadline(r);
+          break;
+        }
+        line = _memltrim(line, &linelen);
+        _fingerprint_add(&record->fingerprint, line, linelen-1);
+      }
+    }
+    else if(vallen) {
+      int intern = (field->kind & kLSRegFieldInterned) != 0;
+      size_t vlen;
+      vlen = 0;
+      
+      // Items are collected in r->items, which is kept between records,
+      // and then copied to the arena when we know how many there are.
+      if(r->itemssize == 0) {
+        r->itemssize = 16;
+        r->items = (char **)malloc(sizeof(char *)*r->itemssize);
+      }
+      
+      // Add first item
+      r->items[vlen++] = intern ? _strintern(r, val, vallen) : _strref(r, val, vallen);
+      
+      while( (line = _readline(r, &linelen)) ) {
+        // Prefix signature
+        // "\t               " 1+15
+        if(linelen > 16 && line[0] == '\t' && line[1] == ' ' && line[2] == ' ') {
+          if(vlen == r->itemssize) {
+            r->itemssize *= 2;
+            r->items = (char **)realloc(r->items, sizeof(char *)*r->itemssize);
+          }
+          line = _memltrim(line, &linelen);
+          _fingerprint_add(&record->fingerprint, line, linelen-1);
+          r->items[vlen++] = intern ? _strintern(r, line, linelen-1) : _strref(r, line, linelen-1);
+        }
+        else {
+          // we're done reading library items. This line belongs to the
+          // next key, so give it back.
+          _unreadline(r);
+          break;
+        }
+      } // end while
+      
+      if((bundle->library_items = (char **)_alloc(r, sizeof(char *)*(vlen+1)))) {
+        memcpy(bundle->library_items, r->items, sizeof(char *)*vlen);
+        bundle->library_items[vlen] = NULL; /* sentinel */
+      }
+    }
+  } // <- if library items
+  // The "properties" key is also special
+  else if(_FIELD_KIND(field) == kLSRegFieldPlist) {
+    char *plist;
+    size_t plistlen;
+    if( (line = _readline(r, &linelen)) ) {
+      _unreadline(r);
+      if(line[0] == '\t') {
+        log_error("Expected plist xml document but found new key. This is probably a bug.");
+      }
+      else {
+        if(!_read_plist(r, &plist, &plistlen)) {
+          line = NULL;
+        }
+        _fingerprint_add(&record->fingerprint, plist, plistlen);
+        if(field->mask & mask) {
+          // Only the byte range is kept. Keys are extracted on demand.
+          bundle->properties = _strref(r, plist, plistlen);
+          bundle->properties_len = plistlen;
+        }
+      }
+    }
+  }
+  else if(field->mask & mask) {
+    // Set key and value in the bundle struct
+    _field_decode(r, field, bundle, val, vallen);
+  }
+  
+  return (line == NULL) ? kLSRegParseStatusDone : kLSRegParseStatusContinue;
+}
+
+
+
+int lsreg_parse_volume(lsreg_reader_t *r,
+                       char *line, size_t linelen,
+                       char *key, size_t keylen,
+                       char *val, size_t vallen,
+                       lsreg_rec_t *record)
+{
+  _rec_nset(r, _volume_fields, r->fields[kLSRegRecTypeVolume], record->rec,
+            key, keylen, val, vallen);
+  return kLSRegParseStatusContinue;
+}
+
+
+
+int lsreg_parse_handler(lsreg_reader_t *r,
+                       char *line, size_t linelen,
+                       char *key, size_t keylen,
+                       char *val, size_t vallen,
+                       lsreg_rec_t *record)
+{
+  _rec_nset(r, _handler_fields, r->fields[kLSRegRecTypeHandler], record->rec,
+            key, keylen, val, vallen);
+  return kLSRegParseStatusContinue;
+}
+
+
+
+int lsreg_parse_record(lsreg_reader_t *r, lsreg_rec_t *rec)
+{  
+  lsreg_line_t *ln;
+  char *line, *key, *val, *idsep;
+  size_t linelen, keylen, vallen;
+  int passed_main;
+  uint32_t pending;
+  enum kLSRegRecType type;
+  enum kLSRegParseStatus status;
+  lsreg_parser_func *parser;
+  
+  // Init
+  passed_main = 0;
+  status = kLSRegParseStatusContinue;
+  rec->type = kLSRegRecTypeUnknown;
+  parser = NULL;
+  
+  // Detect record type
+  if((line = _readline(r, &linelen)) == NULL) {
+    return 1; // done!
+  }
+  type = kLSRegRecTypeUnknown;
+  if(linelen > 7 && (idsep = (char *)memchr(line, ':', linelen)) != NULL) {
+    if(memcmp(line, "bundle", 6) == 0) {
+      type = kLSRegRecTypeBundle;
+    }
+    else if(memcmp(line, "volume", 6) == 0) {
+      type = kLSRegRecTypeVolume;
+    }
+    else if(memcmp(line, "handler", 7) == 0) {
+      type = kLSRegRecTypeHandler;
+    }
+  }
+  
+  if(type != kLSRegRecTypeUnknown && !(r->types & (1 << type))) {
+    // Not wanted. rec->type is left as kLSRegRecTypeUnknown.
+    return _skip_section(r) ? kLSRegParseStatusContinue : kLSRegParseStatusDone;
+  }
+  
+  if(type != kLSRegRecTypeUnknown) {
+    // Parse id
+    rec->uid = (unsigned int)atoi(idsep+1);
+    if(r->filter && !_filter_accepts(r->filter, type, rec->uid)) {
+      // Rejected before any field is decoded
+      return _skip_section(r) ? kLSRegParseStatusContinue : kLSRegParseStatusDone;
+    }
+    rec->flags |= kLSRegRecBorrowed;
+    rec->type = type;
+    rec->fingerprint = (uint64_t)type;
+    
+    switch(type) {
+      case kLSRegRecTypeBundle:
+        rec->rec = _alloc(r, sizeof(lsreg_bundle_t));
+        lsreg_bundle_init((lsreg_bundle_t *)rec->rec);
+        ((lsreg_bundle_t *)rec->rec)->uid = rec->uid;
+        parser = lsreg_parse_bundle;
+        break;
+      case kLSRegRecTypeVolume:
+        rec->rec = _alloc(r, sizeof(lsreg_volume_t));
+        lsreg_volume_init((lsreg_volume_t *)rec->rec);
+        ((lsreg_volume_t *)rec->rec)->uid = rec->uid;
+        parser = lsreg_parse_volume;
+        break;
+      case kLSRegRecTypeHandler:
+        rec->rec = _alloc(r, sizeof(lsreg_handler_t));
+        lsreg_handler_init((lsreg_handler_t *)rec->rec);
+        ((lsreg_handler_t *)rec->rec)->uid = rec->uid;
+        parser = lsreg_parse_handler;
+        break;
+      default:
+        break;
+    }
+  }
+  
+  if(parser == NULL) {
+    log_error("Unsupported record type");
+    return kLSRegParseStatusDone;
+  }
+  
+  // Predicates of the filter which have not been evaluated yet
+  pending = r->filter ? r->filter->type_preds[type] : 0;
+  
+  while( (ln = _nextline(r)) ) {
+    line = ln->ptr;
+    linelen = ln->len;
+    
+    if(linelen == 0 || line[0] == '\n') {
+      // Skip empty line
+      continue;
+    }
+    
+    if(line[0] == '-') {
+      // End of section
+      break;
+    }
+    
+    if(passed_main) {
+      // Passed main info - read off remaining lines
+      continue;
+    }
+    
+    if(linelen > 1 && line[0] == '\t' && line[1] == '-') {
+      // End of main info
+      passed_main = 1;
+      continue;
+    }
+    
+    // Now, a line passed all checks down here is probably a key-value pair.
+    // The scanner has already located the separator and the value.
+    if(ln->colon == linelen) {
+      log_error("Unable to parse line '%.*s'", (int)linelen, line);
+      continue;
+    }
+    
+    // Find key and value
+    keylen = ln->colon;
+    val = line + ln->val;
+    vallen = linelen - ln->val - 1; // -1 is for LN
+    val[vallen] = '\0'; // replace LN with \0
+    key = _memltrim(line, &keylen);
+    
+    if(pending && !_filter_line(r->filter, type, &pending, key, keylen, val, vallen)) {
+      // Abandon the record and the rest of its section
+      rec->type = kLSRegRecTypeUnknown;
+      rec->rec = NULL;
+      return _skip_section(r) ? kLSRegParseStatusContinue : kLSRegParseStatusDone;
+    }
+    
+    _fingerprint_add(&rec->fingerprint, key, keylen);
+    _fingerprint_add(&rec->fingerprint, val, vallen);
+    
+    // Handle key-value assignment record type-wise...
+    status = parser(r,
+                    line, linelen,
+                    key, keylen,
+                    val, vallen,
+                    rec);
+    
+    // If not continue, stop and return
+    if(status != kLSRegParseStatusContinue) {
+      break;
+    }
+  }
+  
+  rec->fingerprint = _fingerprint_final(rec->fingerprint);
+  
+  // Fields which were not listed compare as empty
+  if(pending && !_filter_match_preds(r->filter, rec, pending)) {
+    rec->type = kLSRegRecTypeUnknown;
+    rec->rec = NULL;
+  }
+  if(status != kLSRegParseStatusContinue) {
+    return status;
+  }
+  return (line == NULL) ? kLSRegParseStatusDone : kLSRegParseStatusContinue;
+}
+
+
+void lsreg_parse(lsreg_reader_t *r) {
+  lsreg_rec_t record;
+  
+  // Parse sections
+  for(;;) {
+    lsreg_rec_init(&record);
+    if(!lsreg_reader_next(r, &record)) {
+      break;
+    }
+    lsreg_rec_dump(&record, stdout);
+    lsreg_rec_free_members(&record);
+  }
+}
+
+
+// Open registry dump
+FILE *lsreg_regdump_open() {
+  FILE *f;
+  if((f = popen(kLSRegisterCmd, "r")) == NULL) {
+    int errnum = ferror(f);
+    if(errnum) {
+      log_error("Failed to open regdump: %s", strerror(errnum));
+    } else {
+      log_error("Failed to open regdump");
+    }
+  }
+  return f;
+}
+
+
+// Close registry dump
+void lsreg_regdump_close(FILE *f) {
+  pclose(f);
+}
+
+
+// Open a reader on the output of kLSRegisterCmd
+lsreg_reader_t *lsreg_reader_open_regdump() {
+  lsreg_reader_t *r;
+  FILE *f;
+  if((f = lsreg_regdump_open()) == NULL) {
+    return NULL;
+  }
+  if((r = _reader_create_block(_reader_fill_fd)) == NULL) {
+    lsreg_regdump_close(f);
+    return NULL;
+  }
+  // Read the pipe directly, bypassing stdio buffering
+  r->pipe = f;
+  r->fd = fileno(f);
+  return r;
+}
+
+
+// Open a reader on a previously captured dump file
+lsreg_reader_t *lsreg_reader_open_file(const char *path) {
+  lsreg_reader_t *r;
+  int fd;
+  if((fd = open(path, O_RDONLY)) == -1) {
+    log_error("Failed to open %s: %s", path, strerror(errno));
+    return NULL;
+  }
+  if((r = _reader_create_block(_reader_fill_fd)) == NULL) {
+    close(fd);
+    return NULL;
+  }
+  r->fd = fd;
+  return r;
+}
+
+
+// Open a reader on a file descriptor
+lsreg_reader_t *lsreg_reader_open_fd(int fd) {
+  lsreg_reader_t *r;
+  int fd2;
+  // Read from a duplicate so that closing the reader leaves fd open
+  if((fd2 = dup(fd)) == -1) {
+    log_error("Failed to dup fd %d: %s", fd, strerror(errno));
+    return NULL;
+  }
+  if((r = _reader_create_block(_reader_fill_fd)) == NULL) {
+    close(fd2);
+    return NULL;
+  }
+  r->fd = fd2;
+  return r;
+}
+
+
+// Open a reader on an in-memory dump
+lsreg_reader_t *lsreg_reader_open_buffer(const void *ptr, size_t length) {
+  lsreg_reader_t *r;
+  if((r = _reader_create_block(_reader_fill_buffer)) == NULL) {
+    return NULL;
+  }
+  r->src = (const char *)ptr;
+  r->srcend = r->src + length;
+  return r;
+}
+
+
+// Map the file at path privately so that it can be terminated in place.
+// The mapping always ends with LN.
+static int _reader_map(lsreg_reader_t *r, const char *path) {
+  int fd;
+  struct stat st;
+  size_t pagesize;
+  
+  if((fd = open(path, O_RDONLY)) == -1) {
+    log_error("Failed to open %s: %s", path, strerror(errno));
+    return -1;
+  }
+  if(fstat(fd, &st) == -1) {
+    log_error("Failed to stat %s: %s", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  
+  r->maplen = (size_t)st.st_size;
+  pagesize = (size_t)getpagesize();
+  
+  // Reserve room for at least one more byte, should a LN be missing. The
+  // file is mapped over the start of the reservation, and what is beyond
+  // the end of the file stays anonymous memory which is ours to write to.
+  r->mapsize = (r->maplen / pagesize + 1) * pagesize;
+  r->map = (char *)mmap(NULL, r->mapsize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+  if(r->map == MAP_FAILED) {
+    log_error("Failed to map %s: %s", path, strerror(errno));
+    r->map = NULL;
+    close(fd);
+    return -1;
+  }
+  if(r->maplen &&
+     mmap(r->map, r->maplen, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, fd, 0) == MAP_FAILED)
+  {
+    log_error("Failed to map %s: %s", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  
+  if(r->maplen && r->map[r->maplen-1] != '\n') {
+    r->map[r->maplen++] = '\n';
+  }
+  r->pos = r->map;
+  r->end = r->map + r->maplen;
+  r->eof = 1;
+  r->zerocopy = 1;
+  return 0;
+}
+
+
+// Open a zero-copy reader on a memory-mapped dump file
+lsreg_reader_t *lsreg_reader_open_mmap(const char *path) {
+  lsreg_reader_t *r;
+  if((r = _reader_create()) == NULL) {
+    return NULL;
+  }
+  if(_reader_map(r, path) != 0) {
+    lsreg_reader_close(r);
+    return NULL;
+  }
+  return r;
+}
+
+
+// Close a reader and free its resources
+void lsreg_reader_close(lsreg_reader_t *r) {
+  if(r != NULL) {
+    if(r->pipe) {
+      lsreg_regdump_close(r->pipe);
+    }
+    else if(r->fd != -1) {
+      close(r->fd);
+    }
+    if(r->buf) {
+      free(r->buf);
+    }
+    _arena_free(&r->arena);
+    if(r->items) {
+      free(r->items);
+    }
+    if(r->map) {
+      if(r->map_is_heap) {
+        free(r->map);
+      }
+      else {
+        munmap(r->map, r->mapsize);
+      }
+    }
+    free(r);
+  }
+}
+
+
+// Only decode the fields selected by fields
+void lsreg_reader_set_fields(lsreg_reader_t *r, const lsreg_fields_t *fields) {
+  r->fields[kLSRegRecTypeUnknown] = 0;
+  if(fields == NULL) {
+    r->fields[kLSRegRecTypeBundle] = LSREG_ALL_FIELDS;
+    r->fields[kLSRegRecTypeVolume] = LSREG_ALL_FIELDS;
+    r->fields[kLSRegRecTypeHandler] = LSREG_ALL_FIELDS;
+    return;
+  }
+  r->fields[kLSRegRecTypeBundle] = fields->bundle;
+  r->fields[kLSRegRecTypeVolume] = fields->volume;
+  r->fields[kLSRegRecTypeHandler] = fields->handler;
+  // The canonical identifier is derived from the identifier when the dump
+  // does not list one
+  if(fields->bundle & kLSRegBundleCanonicalIdentifierField) {
+    r->fields[kLSRegRecTypeBundle] |= kLSRegBundleIdentifierField;
+  }
+}
+
+
+static int _snapshot_next(lsreg_reader_t *r, lsreg_rec_t *rec);
+
+// Only produce records of the types in types
+void lsreg_reader_set_types(lsreg_reader_t *r, unsigned int types) {
+  r->types = types;
+}
+
+
+void lsreg_reader_set_intern(lsreg_reader_t *r, lsreg_intern_t *t) {
+  r->intern = t;
+}
+
+
+// Only produce records which satisfy f
+void lsreg_reader_set_filter(lsreg_reader_t *r, const lsreg_filter_t *f) {
+  r->filter = f;
+}
+
+
+// Read the next record
+int lsreg_reader_next(lsreg_reader_t *r, lsreg_rec_t *rec) {
+  enum kLSRegParseStatus status;
+  size_t linelen;
+  
+  if(r->done) {
+    return 0;
+  }
+  if(r->snap) {
+    // Snapshot records are only matched once they are decoded, which is
+    // done in place
+    while(_snapshot_next(r, rec)) {
+      if(r->filter == NULL || lsreg_filter_match(r->filter, rec)) {
+        return 1;
+      }
+    }
+    return 0;
+  }
+  
+  while(r->skip_lines) {
+    r->skip_lines--;
+    if(_readline(r, &linelen) == NULL) {
+      // error occured
+      r->done = 1;
+      return 0;
+    }
+  }
+  
+  do {
+    // Memory used by the previous record is reused
+    if(!r->keep_records) {
+      _arena_reset(&r->arena);
+    }
+    
+    status = lsreg_parse_record(r, rec);
+    if(status != kLSRegParseStatusContinue) {
+      r->done = 1;
+      break;
+    }
+    // Sections filtered out by r->types leave rec->type unknown
+  } while(rec->type == kLSRegRecTypeUnknown);
+  
+  return (rec->type != kLSRegRecTypeUnknown);
+}
+
+
+// Iterate records read from r, calling factory_cb and handler_cb for each record.
+void lsreg_iterate_reader(lsreg_reader_t *r,
+                          lsreg_rec_factory_cb *factory_cb,
+                          lsreg_rec_handler_cb *handler_cb,
+                          void *something)
+{
+  lsreg_rec_t rec, *record;
+  
+  // Parse sections. A record is only requested from the factory once
+  // there is one to hand over, as the handler owns it.
+  for(;;) {
+    lsreg_rec_init(&rec);
+    if(!lsreg_reader_next(r, &rec)) {
+      break;
+    }
+    record = factory_cb(something);
+    *record = rec;
+    if(handler_cb(record, something)) {
+      break;
+    }
+  }
+}
+
+
+// Iterate records, calling factory_cb and handler_cb for each record.
+int lsreg_iterate(lsreg_rec_factory_cb *factory_cb,
+                  lsreg_rec_handler_cb *handler_cb,
+                  void *something)
+{
+  lsreg_reader_t *r;
+  if((r = lsreg_reader_open_regdump()) == NULL) {
+    return -1;
+  }
+  lsreg_iterate_reader(r, factory_cb, handler_cb, something);
+  lsreg_reader_close(r);
+  return 0;
+}
+
+
+// Iterate records, decoding only the fields selected by fields
+int lsreg_iterate_fields(const lsreg_fields_t *fields,
+                         lsreg_rec_factory_cb *factory_cb,
+                         lsreg_rec_handler_cb *handler_cb,
+                         void *something)
+{
+  lsreg_reader_t *r;
+  if((r = lsreg_reader_open_regdump()) == NULL) {
+    return -1;
+  }
+  lsreg_reader_set_fields(r, fields);
+  lsreg_iterate_reader(r, factory_cb, handler_cb, something);
+  lsreg_reader_close(r);
+  return 0;
+}
+
+
+// Iterate records of the types in types
+int lsreg_iterate_types(unsigned int types,
+                        lsreg_rec_factory_cb *factory_cb,
+                        lsreg_rec_handler_cb *handler_cb,
+                        void *something)
+{
+  lsreg_reader_t *r;
+  if((r = lsreg_reader_open_regdump()) == NULL) {
+    return -1;
+  }
+  lsreg_reader_set_types(r, types);
+  lsreg_iterate_reader(r, factory_cb, handler_cb, something);
+  lsreg_reader_close(r);
+  return 0;
+}
+
+
+// Iterate records of a captured dump file
+int lsreg_iterate_file(const char *path,
+                       lsreg_rec_factory_cb *factory_cb,
+                       lsreg_rec_handler_cb *handler_cb,
+                       void *something)
+{
+  lsreg_reader_t *r;
+  if((r = lsreg_reader_open_file(path)) == NULL) {
+    return -1;
+  }
+  lsreg_iterate_reader(r, factory_cb, handler_cb, something);
+  lsreg_reader_close(r);
+  return 0;
+}
+
+
+// Iterate records of a memory-mapped dump file without copying strings
+int lsreg_iterate_mmap(const char *path,
+                       lsreg_rec_factory_cb *factory_cb,
+                       lsreg_rec_handler_cb *handler_cb,
+                       void *something)
+{
+  lsreg_reader_t *r;
+  if((r = lsreg_reader_open_mmap(path)) == NULL) {
+    return -1;
+  }
+  lsreg_iterate_reader(r, factory_cb, handler_cb, something);
+  lsreg_reader_close(r);
+  return 0;
+}
+
+
+// Iterate records of a dump read from a file descriptor
+int lsreg_iterate_fd(int fd,
+                     lsreg_rec_factory_cb *factory_cb,
+                     lsreg_rec_handler_cb *handler_cb,
+                     void *something)
+{
+  lsreg_reader_t *r;
+  if((r = lsreg_reader_open_fd(fd)) == NULL) {
+    return -1;
+  }
+  lsreg_iterate_reader(r, factory_cb, handler_cb, something);
+  lsreg_reader_close(r);
+  return 0;
+}
+
+
+// Iterate records of an in-memory dump
+int lsreg_iterate_buffer(const void *ptr, size_t length,
+                         lsreg_rec_factory_cb *factory_cb,
+                         lsreg_rec_handler_cb *handler_cb,
+                         void *something)
+{
+  lsreg_reader_t *r;
+  if((r = lsreg_reader_open_buffer(ptr, length)) == NULL) {
+    return -1;
+  }
+  lsreg_iterate_reader(r, factory_cb, handler_cb, something);
+  lsreg_reader_close(r);
+  return 0;
+}
+
+
+// ---------------------------------------------
+#pragma mark -
+#pragma mark Parallel iteration
+
+// Reads the remaining input of a block reader into memory, turning it
+// into a zero-copy reader like those returned by lsreg_reader_open_mmap().
+static int _reader_load(lsreg_reader_t *r) {
+  size_t len, size;
+  ssize_t n;
+  char *p;
+  
+  if(r->map || r->fill == NULL) {
+    return 0; // already in memory
+  }
+  
+  len = r->end - r->pos;
+  size = len > LSREG_BLOCK_SIZE ? len * 2 : LSREG_BLOCK_SIZE;
+  if((p = (char *)malloc(size)) == NULL) {
+    return -1;
+  }
+  memcpy(p, r->pos, len);
+  
+  while(!r->eof) {
+    if(len + 1 >= size) {
+      char *p2;
+      if((p2 = (char *)realloc(p, size * 2)) == NULL) {
+        free(p);
+        return -1;
+      }
+      p = p2;
+      size *= 2;
+    }
+    if((n = r->fill(r, p + len, size - len - 1)) <= 0) {
+      if(n == -1) {
+        log_error("Error while reading: %s", strerror(errno));
+      }
+      r->eof = 1;
+      break;
+    }
+    len += (size_t)n;
+  }
+  
+  // There is always room for a trailing LN
+  if(len && p[len-1] != '\n') {
+    p[len++] = '\n';
+  }
+  r->map = p;
+  r->maplen = len;
+  r->map_is_heap = 1;
+  r->pos = r->map;
+  r->end = r->map + len;
+  r->nlines = r->iline = 0;
+  r->zerocopy = 1;
+  return 0;
+}
+
+
+// Returns the start of the first section following p, i.e. the byte after
+// the next line starting with "-", or end if there is none.
+static char *_next_section(char *p, char *end) {
+  char *nl;
+  while(p < end && (nl = (char *)memchr(p, '\n', end - p)) != NULL) {
+    p = nl + 1;
+    if(p < end && *p == '-') {
+      if((nl = (char *)memchr(p, '\n', end - p)) == NULL) {
+        break;
+      }
+      return nl + 1;
+    }
+  }
+  return end;
+}
+
+
+// State shared by the threads of a parallel iteration
+typedef struct {
+  lsreg_reader_t *r;
+  char **chunks;            // chunk i is [chunks[i], chunks[i+1])
+  size_t nchunks;
+  size_t next_chunk;        // next chunk to parse (atomic)
+  size_t next_delivery;     // next chunk to deliver, if ordered
+  int ordered;
+  int stop;                 // set when handler_cb asks to stop
+  pthread_mutex_t lock;     // serializes callbacks
+  pthread_cond_t delivered;
+  lsreg_rec_factory_cb *factory_cb;
+  lsreg_rec_handler_cb *handler_cb;
+  void *something;
+} lsreg_parallel_t;
+
+
+// Parses chunks until there are none left, delivering the records of each
+// chunk in one go
+static void *_parallel_worker(void *arg) {
+  lsreg_parallel_t *p = (lsreg_parallel_t *)arg;
+  lsreg_reader_t *cr;
+  lsreg_rec_t *recs = NULL, *rec;
+  size_t nrecs, recssize = 0, i, k;
+  
+  if((cr = _reader_create()) == NULL) {
+    return NULL;
+  }
+  memcpy(cr->fields, p->r->fields, sizeof(cr->fields));
+  cr->types = p->r->types;
+  cr->intern = p->r->intern;
+  cr->filter = p->r->filter;
+  cr->keep_records = 1;
+  cr->zerocopy = 1;
+  
+  while(!__atomic_load_n(&p->stop, __ATOMIC_RELAXED)) {
+    if((i = __atomic_fetch_add(&p->next_chunk, 1, __ATOMIC_RELAXED)) >= p->nchunks) {
+      break;
+    }
+    
+    // Point the reader at the chunk. Only the first chunk has a header.
+    _arena_reset(&cr->arena);
+    cr->pos = p->chunks[i];
+    cr->end = p->chunks[i+1];
+    cr->nlines = cr->iline = 0;
+    cr->eof = 1;
+    cr->done = 0;
+    cr->skip_lines = (i == 0) ? p->r->skip_lines : 0;
+    
+    for(nrecs = 0; ; nrecs++) {
+      if(nrecs == recssize) {
+        lsreg_rec_t *recs2;
+        recssize = recssize ? recssize * 2 : 256;
+        if((recs2 = (lsreg_rec_t *)realloc(recs, sizeof(lsreg_rec_t)*recssize)) == NULL) {
+          log_error("Failed to allocate memory for %lu records", (unsigned long)recssize);
+          __atomic_store_n(&p->stop, 1, __ATOMIC_RELAXED);
+          break;
+        }
+        recs = recs2;
+      }
+      lsreg_rec_init(&recs[nrecs]);
+      if(!lsreg_reader_next(cr, &recs[nrecs])) {
+        break;
+      }
+    }
+    
+    pthread_mutex_lock(&p->lock);
+    if(p->ordered) {
+      while(p->next_delivery != i && !p->stop) {
+        pthread_cond_wait(&p->delivered, &p->lock);
+      }
+    }
+    for(k = 0; k < nrecs && !p->stop; k++) {
+      rec = p->factory_cb(p->something);
+      *rec = recs[k];
+      if(p->handler_cb(rec, p->something)) {
+        __atomic_store_n(&p->stop, 1, __ATOMIC_RELAXED);
+      }
+    }
+    if(p->ordered) {
+      p->next_delivery++;
+      pthread_cond_broadcast(&p->delivered);
+    }
+    pthread_mutex_unlock(&p->lock);
+  }
+  
+  if(p->ordered) {
+    // Wake threads waiting for a chunk this thread will not deliver
+    pthread_mutex_lock(&p->lock);
+    pthread_cond_broadcast(&p->delivered);
+    pthread_mutex_unlock(&p->lock);
+  }
+  
+  if(recs) {
+    free(recs);
+  }
+  lsreg_reader_close(cr);
+  return NULL;
+}
+
+
+// Iterate records read from r using nthreads threads
+int lsreg_iterate_reader_parallel(lsreg_reader_t *r, int nthreads, int flags,
+                                  lsreg_rec_factory_cb *factory_cb,
+                                  lsreg_rec_handler_cb *handler_cb,
+                                  void *something)
+{
+  lsreg_parallel_t p;
+  pthread_t *threads;
+  size_t len, chunksize, maxchunks;
+  char *pos;
+  int i, nstarted;
+  
+  if(r->done) {
+    return 0;
+  }
+  if(r->snap) {
+    // Snapshots are read in place, there is nothing to parse
+    lsreg_iterate_reader(r, factory_cb, handler_cb, something);
+    return 0;
+  }
+  if(nthreads <= 0) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = ncpu > 0 ? (int)ncpu : 1;
+  }
+  
+  // Lines already indexed by the reader are given back, as the input is
+  // split up anew
+  if(r->iline < r->nlines) {
+    r->pos = r->lines[r->iline].ptr;
+  }
+  r->nlines = r->iline = 0;
+  
+  if(_reader_load(r) != 0) {
+    log_error("Failed to load dump into memory");
+    return -1;
+  }
+  
+  // Split the input at section delimiters
+  len = r->end - r->pos;
+  chunksize = len / ((size_t)nthreads * 8);
+  if(chunksize < LSREG_PARALLEL_MIN_CHUNK) {
+    chunksize = LSREG_PARALLEL_MIN_CHUNK;
+  }
+  maxchunks = len / chunksize + 1;
+  if((p.chunks = (char **)malloc(sizeof(char *)*(maxchunks+1))) == NULL) {
+    return -1;
+  }
+  p.nchunks = 0;
+  p.chunks[0] = pos = r->pos;
+  while(pos < r->end && p.nchunks < maxchunks) {
+    if((size_t)(r->end - pos) <= chunksize) {
+      pos = r->end;
+    }
+    else {
+      pos = _next_section(pos + chunksize - 1, r->end);
+    }
+    p.chunks[++p.nchunks] = pos;
+  }
+  if(pos < r->end) {
+    p.chunks[p.nchunks] = r->end;
+  }
+  
+  p.r = r;
+  p.next_chunk = 0;
+  p.next_delivery = 0;
+  p.ordered = (flags & kLSRegParallelOrdered) ? 1 : 0;
+  p.stop = 0;
+  p.factory_cb = factory_cb;
+  p.handler_cb = handler_cb;
+  p.something = something;
+  pthread_mutex_init(&p.lock, NULL);
+  pthread_cond_init(&p.delivered, NULL);
+  
+  // The calling thread is one of the workers
+  nstarted = 0;
+  if(nthreads > 1 && (threads = (pthread_t *)malloc(sizeof(pthread_t)*(nthreads-1)))) {
+    for(i = 0; i < nthreads-1; i++) {
+      if(pthread_create(&threads[i], NULL, _parallel_worker, &p) != 0) {
+        break;
+      }
+      nstarted++;
+    }
+  }
+  else {
+    threads = NULL;
+  }
+  _parallel_worker(&p);
+  for(i = 0; i < nstarted; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  
+  if(threads) {
+    free(threads);
+  }
+  free(p.chunks);
+  pthread_cond_destroy(&p.delivered);
+  pthread_mutex_destroy(&p.lock);
+  
+  r->pos = r->end;
+  r->skip_lines = 0;
+  r->done = 1;
+  return 0;
+}
+
+
+// Iterate records of a memory-mapped dump file using nthreads threads
+int lsreg_iterate_parallel(const char *path, int nthreads, int flags,
+                           lsreg_rec_factory_cb *factory_cb,
+                           lsreg_rec_handler_cb *handler_cb,
+                           void *something)
+{
+  lsreg_reader_t *r;
+  int status;
+  if((r = lsreg_reader_open_mmap(path)) == NULL) {
+    return -1;
+  }
+  status = lsreg_iterate_reader_parallel(r, nthreads, flags, factory_cb, handler_cb, something);
+  lsreg_reader_close(r);
+  return status;
+}
+
+
+// Iterate records of an in-memory dump using nthreads threads
+int lsreg_iterate_buffer_parallel(const void *ptr, size_t length,
+                                  int nthreads, int flags,
+                                  lsreg_rec_factory_cb *factory_cb,
+                                  lsreg_rec_handler_cb *handler_cb,
+                                  void *something)
+{
+  lsreg_reader_t *r;
+  int status;
+  if((r = lsreg_reader_open_buffer(ptr, length)) == NULL) {
+    return -1;
+  }
+  status = lsreg_iterate_reader_parallel(r, nthreads, flags, factory_cb, handler_cb, something);
+  lsreg_reader_close(r);
+  return status;
+}
+
+
+// ---------------------------------------------
+#pragma mark -
+#pragma mark Pipelined iteration
+
+// Lock-free ring buffer with a single producer and a single consumer
+typedef struct {
+  void *slots[LSREG_RING_SIZE];
+  size_t head;              // next slot to pop (written by the consumer)
+  size_t tail;              // next slot to push (written by the producer)
+} lsreg_ring_t;
+
+
+static void _ring_init(lsreg_ring_t *ring) {
+  ring->head = 0;
+  ring->tail = 0;
+}
+
+
+// Returns 0 if the ring is full
+static int _ring_push(lsreg_ring_t *ring, void *item) {
+  size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  if(tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == LSREG_RING_SIZE) {
+    return 0;
+  }
+  ring->slots[tail & (LSREG_RING_SIZE-1)] = item;
+  __atomic_store_n(&ring->tail, tail+1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+
+// Returns NULL if the ring is empty
+static void *_ring_pop(lsreg_ring_t *ring) {
+  size_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  void *item;
+  if(head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  item = ring->slots[head & (LSREG_RING_SIZE-1)];
+  __atomic_store_n(&ring->head, head+1, __ATOMIC_RELEASE);
+  return item;
+}
+
+
+// Called while waiting on a ring. Yields at first, then sleeps, so that a
+// stage waiting on a slow lsregister does not keep a CPU busy.
+static void _ring_wait(unsigned int *spins) {
+  if(++(*spins) < 64) {
+    sched_yield();
+  }
+  else {
+    usleep(200);
+  }
+}
+
+
+// A block of input read by the reader stage. len is 0 at end of input.
+typedef struct {
+  size_t len;
+  size_t pos;               // bytes consumed by the parser stage
+  char data[LSREG_BLOCK_SIZE];
+} lsreg_pipeline_block_t;
+
+// Records parsed by the parser stage, with the memory they borrow
+typedef struct {
+  lsreg_arena_t arena;
+  size_t nrecs;
+  int last;                 // 1 if no batches follow
+  lsreg_rec_t recs[LSREG_PIPELINE_BATCH_SIZE];
+} lsreg_pipeline_batch_t;
+
+// State shared by the stages of a pipelined iteration
+typedef struct {
+  lsreg_reader_t *r;        // source, drained by the reader stage
+  lsreg_reader_t *pr;       // parser stage reader
+  lsreg_ring_t free_blocks; // parser -> reader
+  lsreg_ring_t full_blocks; // reader -> parser
+  lsreg_ring_t free_batches;// handler -> parser
+  lsreg_ring_t full_batches;// parser -> handler
+  lsreg_pipeline_block_t *block; // block being consumed by the parser
+  int stop;                 // set when handler_cb asks to stop
+} lsreg_pipeline_t;
+
+
+// Pops an item, waiting for one. Returns NULL if the pipeline was stopped.
+static void *_pipeline_pop(lsreg_pipeline_t *p, lsreg_ring_t *ring) {
+  unsigned int spins = 0;
+  void *item;
+  while((item = _ring_pop(ring)) == NULL) {
+    if(__atomic_load_n(&p->stop, __ATOMIC_RELAXED)) {
+      return NULL;
+    }
+    _ring_wait(&spins);
+  }
+  return item;
+}
+
+
+// Pushes an item, waiting for room. Returns 0 if the pipeline was stopped.
+static int _pipeline_push(lsreg_pipeline_t *p, lsreg_ring_t *ring, void *item) {
+  unsigned int spins = 0;
+  while(!_ring_push(ring, item)) {
+    if(__atomic_load_n(&p->stop, __ATOMIC_RELAXED)) {
+      return 0;
+    }
+    _ring_wait(&spins);
+  }
+  return 1;
+}
+
+
+// Reader stage: drains the source into blocks
+static void *_pipeline_reader(void *arg) {
+  lsreg_pipeline_t *p = (lsreg_pipeline_t *)arg;
+  lsreg_reader_t *r = p->r;
+  lsreg_pipeline_block_t *block;
+  ssize_t n;
+  size_t len;
+  
+  for(;;) {
+    if((block = (lsreg_pipeline_block_t *)_pipeline_pop(p, &p->free_blocks)) == NULL) {
+      break;
+    }
+    block->pos = 0;
+    block->len = 0;
+    
+    // Data already read into the source's buffer goes first
+    if(r->pos < r->end) {
+      len = r->end - r->pos;
+      if(len > LSREG_BLOCK_SIZE) {
+        len = LSREG_BLOCK_SIZE;
+      }
+      memcpy(block->data, r->pos, len);
+      r->pos += len;
+      block->len = len;
+    }
+    else if(!r->eof && r->fill) {
+      if((n = r->fill(r, block->data, LSREG_BLOCK_SIZE)) > 0) {
+        block->len = (size_t)n;
+      }
+      else {
+        if(n == -1) {
+          log_error("Error while reading: %s", strerror(errno));
+        }
+        r->eof = 1;
+      }
+    }
+    
+    if(!_pipeline_push(p, &p->full_blocks, block) || block->len == 0) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+
+// Fill function of the parser stage reader
+static ssize_t _reader_fill_pipeline(lsreg_reader_t *r, char *dst, size_t size) {
+  lsreg_pipeline_t *p = (lsreg_pipeline_t *)r->pipeline;
+  size_t n;
+  
+  if(p->block && p->block->pos == p->block->len) {
+    _pipeline_push(p, &p->free_blocks, p->block);
+    p->block = NULL;
+  }
+  if(p->block == NULL) {
+    if((p->block = (lsreg_pipeline_block_t *)_pipeline_pop(p, &p->full_blocks)) == NULL) {
+      return 0; // stopped
+    }
+    if(p->block->len == 0) {
+      return 0;
+    }
+  }
+  
+  n = p->block->len - p->block->pos;
+  if(n > size) {
+    n = size;
+  }
+  memcpy(dst, p->block->data + p->block->pos, n);
+  p->block->pos += n;
+  return (ssize_t)n;
+}
+
+
+// Parser stage: builds batches of records
+static void *_pipeline_parser(void *arg) {
+  lsreg_pipeline_t *p = (lsreg_pipeline_t *)arg;
+  lsreg_reader_t *pr = p->pr;
+  lsreg_pipeline_batch_t *batch;
+  lsreg_arena_t arena;
+  int last = 0;
+  
+  while(!last) {
+    if((batch = (lsreg_pipeline_batch_t *)_pipeline_pop(p, &p->free_batches)) == NULL) {
+      break;
+    }
+    
+    // Records of the batch are allocated from the batch's arena
+    _arena_reset(&batch->arena);
+    arena = pr->arena;
+    pr->arena = batch->arena;
+    
+    for(batch->nrecs = 0; batch->nrecs < LSREG_PIPELINE_BATCH_SIZE; batch->nrecs++) {
+      lsreg_rec_init(&batch->recs[batch->nrecs]);
+      if(!lsreg_reader_next(pr, &batch->recs[batch->nrecs])) {
+        last = 1;
+        break;
+      }
+    }
+    
+    batch->arena = pr->arena;
+    pr->arena = arena;
+    batch->last = last;
+    
+    if(!_pipeline_push(p, &p->full_batches, batch)) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+
+// Iterate records read from r in three stages running concurrently
+int lsreg_iterate_reader_pipelined(lsreg_reader_t *r,
+                                   lsreg_rec_factory_cb *factory_cb,
+                                   lsreg_rec_handler_cb *handler_cb,
+                                   void *something)
+{
+  lsreg_pipeline_t p;
+  lsreg_pipeline_block_t *blocks;
+  lsreg_pipeline_batch_t *batches, *batch;
+  pthread_t reader_thread, parser_thread;
+  lsreg_rec_t *rec;
+  size_t i;
+  
+  if(r->done) {
+    return 0;
+  }
+  if(r->snap) {
+    lsreg_iterate_reader(r, factory_cb, handler_cb, something);
+    return 0;
+  }
+  
+  blocks = (lsreg_pipeline_block_t *)malloc(sizeof(lsreg_pipeline_block_t)*LSREG_PIPELINE_BLOCKS);
+  batches = (lsreg_pipeline_batch_t *)malloc(sizeof(lsreg_pipeline_batch_t)*LSREG_PIPELINE_BATCHES);
+  if(blocks == NULL || batches == NULL) {
+    goto sequential;
+  }
+  if((p.pr = _reader_create_block(_reader_fill_pipeline)) == NULL) {
+    goto sequential;
+  }
+  
+  // Lines already indexed by r are given back and parsed again by the
+  // parser stage, which takes over the settings of r
+  if(r->iline < r->nlines) {
+    r->pos = r->lines[r->iline].ptr;
+  }
+  r->nlines = r->iline = 0;
+  memcpy(p.pr->fields, r->fields, sizeof(p.pr->fields));
+  p.pr->types = r->types;
+  p.pr->intern = r->intern;
+  p.pr->filter = r->filter;
+  p.pr->skip_lines = r->skip_lines;
+  p.pr->keep_records = 1;
+  p.pr->pipeline = &p;
+  
+  p.r = r;
+  p.block = NULL;
+  p.stop = 0;
+  _ring_init(&p.free_blocks);
+  _ring_init(&p.full_blocks);
+  _ring_init(&p.free_batches);
+  _ring_init(&p.full_batches);
+  for(i = 0; i < LSREG_PIPELINE_BLOCKS; i++) {
+    _ring_push(&p.free_blocks, &blocks[i]);
+  }
+  for(i = 0; i < LSREG_PIPELINE_BATCHES; i++) {
+    _arena_init(&batches[i].arena);
+    _ring_push(&p.free_batches, &batches[i]);
+  }
+  
+  if(pthread_create(&reader_thread, NULL, _pipeline_reader, &p) != 0) {
+    lsreg_reader_close(p.pr);
+    goto sequential;
+  }
+  if(pthread_create(&parser_thread, NULL, _pipeline_parser, &p) != 0) {
+    __atomic_store_n(&p.stop, 1, __ATOMIC_RELAXED);
+    pthread_join(reader_thread, NULL);
+    lsreg_reader_close(p.pr);
+    goto sequential;
+  }
+  
+  // Handler stage, on the calling thread
+  while( (batch = (lsreg_pipeline_batch_t *)_pipeline_pop(&p, &p.full_batches)) ) {
+    for(i = 0; i < batch->nrecs; i++) {
+      rec = factory_cb(something);
+      *rec = batch->recs[i];
+      if(handler_cb(rec, something)) {
+        __atomic_store_n(&p.stop, 1, __ATOMIC_RELAXED);
+        break;
+      }
+    }
+    if(batch->last || p.stop) {
+      break;
+    }
+    _pipeline_push(&p, &p.free_batches, batch);
+  }
+  
+  // Also stops the reader stage when the parser stage finished early
+  pthread_join(parser_thread, NULL);
+  __atomic_store_n(&p.stop, 1, __ATOMIC_RELAXED);
+  pthread_join(reader_thread, NULL);
+  
+  for(i = 0; i < LSREG_PIPELINE_BATCHES; i++) {
+    _arena_free(&batches[i].arena);
+  }
+  free(batches);
+  free(blocks);
+  lsreg_reader_close(p.pr);
+  r->eof = 1;
+  r->pos = r->end;
+  r->skip_lines = 0;
+  r->done = 1;
+  return 0;
+  
+sequential:
+  // Not enough resources to run stages concurrently
+  if(blocks) {
+    free(blocks);
+  }
+  if(batches) {
+    free(batches);
+  }
+  lsreg_iterate_reader(r, factory_cb, handler_cb, something);
+  return 0;
+}
+
+
+// Iterate records of the registry dump in three concurrent stages
+int lsreg_iterate_pipelined(lsreg_rec_factory_cb *factory_cb,
+                            lsreg_rec_handler_cb *handler_cb,
+                            void *something)
+{
+  lsreg_reader_t *r;
+  int status;
+  if((r = lsreg_reader_open_regdump()) == NULL) {
+    return -1;
+  }
+  status = lsreg_iterate_reader_pipelined(r, factory_cb, handler_cb, something);
+  lsreg_reader_close(r);
+  return status;
+}
+
+
+// ---------------------------------------------
+#pragma mark -
+#pragma mark Snapshots
+
+// A snapshot file is laid out as:
+// 
+//   header
+//   record table     uint32_t per record in dump order: type << 30 | index
+//   fingerprints     uint64_t per record, in the order of the record table
+//   bundle table     lsreg_snapshot_bundle_t[nbundles]
+//   volume table     lsreg_snapshot_volume_t[nvolumes]
+//   handler table    lsreg_snapshot_handler_t[nhandlers]
+//   item table       uint32_t[nitems], string offsets of library items
+//   string table     NUL terminated strings
+// 
+// Tables start at 8 byte boundaries. Strings are referred to by their
+// offset in the string table, where offset 0 means NULL. Integers are in
+// the byte order of the writer, which is checked when opening.
+
+typedef struct lsreg_snapshot_header {
+  char magic[8];            // LSREG_SNAPSHOT_MAGIC
+  uint32_t version;         // LSREG_SNAPSHOT_VERSION
+  uint32_t byte_order;      // 0x01020304
+  uint32_t nrecords;
+  uint32_t nbundles;
+  uint32_t nvolumes;
+  uint32_t nhandlers;
+  uint32_t nitems;
+  uint32_t strings_size;
+  uint64_t records_offset;
+  uint64_t bundles_offset;
+  uint64_t volumes_offset;
+  uint64_t handlers_offset;
+  uint64_t items_offset;
+  uint64_t strings_offset;
+  uint64_t fingerprints_offset;
+} lsreg_snapshot_header_t;
+
+typedef struct {
+  uint32_t uid;
+  uint32_t identifier;
+  uint32_t identifier_hash;
+  uint32_t canonical_identifier;
+  uint32_t canonical_identifier_hash;
+  uint32_t path;
+  uint32_t name;
+  uint32_t version;
+  uint32_t type_code;       // four-character code, not a string
+  uint32_t executable;
+  uint32_t icon;
+  uint32_t library;
+  uint32_t library_items;   // first entry in the item table
+  uint32_t nlibrary_items;  // 0 if library_items is NULL
+  int64_t regdate;          // seconds since the epoch, or LSREG_SNAPSHOT_NO_DATE
+  int64_t moddate;
+} lsreg_snapshot_bundle_t;
+
+typedef struct {
+  uint32_t uid;
+  uint32_t path;
+  uint32_t disk_image;
+  int32_t is_mounted;
+  int32_t vrefnum;
+  uint32_t flags;
+} lsreg_snapshot_volume_t;
+
+typedef struct {
+  uint32_t uid;
+  uint32_t content_type;
+  uint32_t extension;
+  uint32_t uri_scheme;
+  uint32_t roles;
+  uint32_t roles_hash;
+  uint32_t options;
+  uint32_t reserved;
+} lsreg_snapshot_handler_t;
+
+#define LSREG_SNAPSHOT_NO_DATE INT64_MIN
+#define LSREG_SNAPSHOT_BYTE_ORDER 0x01020304
+#define _SNAPSHOT_REC(type, index) (((uint32_t)(type) << 30) | (uint32_t)(index))
+#define _SNAPSHOT_ALIGN(n) (((n) + 7) & ~(uint64_t)7)
+
+
+// Snapshot being built
+typedef struct {
+  char *strings;
+  size_t strings_size;
+  size_t strings_cap;
+  uint32_t *strhash;        // open addressing table of string offsets
+  size_t strhash_cap;
+  size_t strhash_count;
+  uint32_t *records;
+  size_t nrecords, records_cap;
+  uint64_t *fingerprints;
+  size_t fingerprints_cap;
+  lsreg_snapshot_bundle_t *bundles;
+  size_t nbundles, bundles_cap;
+  lsreg_snapshot_volume_t *volumes;
+  size_t nvolumes, volumes_cap;
+  lsreg_snapshot_handler_t *handlers;
+  size_t nhandlers, handlers_cap;
+  uint32_t *items;
+  size_t nitems, items_cap;
+  int failed;
+} lsreg_snapshot_writer_t;
+
+
+// Makes room for one more element in a growing array
+static int _snapshot_reserve(lsreg_snapshot_writer_t *w, void **ptr, size_t count,
+                             size_t *cap, size_t elsize)
+{
+  void *p;
+  size_t newcap;
+  if(count < *cap) {
+    return 0;
+  }
+  newcap = *cap ? *cap * 2 : 256;
+  if((p = realloc(*ptr, newcap * elsize)) == NULL) {
+    w->failed = 1;
+    return -1;
+  }
+  *ptr = p;
+  *cap = newcap;
+  return 0;
+}
+
+
+// Adds s to the string table, unless it is already there, and returns its
+// offset. Returns 0 for NULL.
+static uint32_t _snapshot_str(lsreg_snapshot_writer_t *w, const char *s) {
+  size_t len, i, mask;
+  uint32_t off;
+  
+  if(s == NULL || w->failed) {
+    return 0;
+  }
+  len = strlen(s);
+  
+  // Grow the hash table at 50% load
+  if((w->strhash_count+1)*2 > w->strhash_cap) {
+    size_t newcap = w->strhash_cap ? w->strhash_cap * 2 : 4096;
+    uint32_t *newhash;
+    if((newhash = (uint32_t *)calloc(newcap, sizeof(uint32_t))) == NULL) {
+      w->failed = 1;
+      return 0;
+    }
+    for(i = 0; i < w->strhash_cap; i++) {
+      if((off = w->strhash[i])) {
+        size_t j = _strhash(w->strings+off, strlen(w->strings+off)) & (newcap-1);
+        while(newhash[j]) {
+          j = (j+1) & (newcap-1);
+        }
+        newhash[j] = off;
+      }
+    }
+    free(w->strhash);
+    w->strhash = newhash;
+    w->strhash_cap = newcap;
+  }
+  
+  mask = w->strhash_cap-1;
+  for(i = _strhash(s, len) & mask; (off = w->strhash[i]); i = (i+1) & mask) {
+    if(memcmp(w->strings+off, s, len+1) == 0) {
+      return off;
+    }
+  }
+  
+  while(w->strings_size + len + 1 > w->strings_cap) {
+    char *p;
+    size_t newcap = w->strings_cap * 2;
+    if((p = (char *)realloc(w->strings, newcap)) == NULL) {
+      w->failed = 1;
+      return 0;
+    }
+    w->strings = p;
+    w->strings_cap = newcap;
+  }
+  if(w->strings_size + len + 1 > UINT32_MAX) {
+    w->failed = 1;
+    return 0;
+  }
+  off = (uint32_t)w->strings_size;
+  memcpy(w->strings+off, s, len+1);
+  w->strings_size += len+1;
+  w->strhash[i] = off;
+  w->strhash_count++;
+  return off;
+}
+
+
+static int64_t _snapshot_date(time_t date) {
+  return date ? (int64_t)date : LSREG_SNAPSHOT_NO_DATE;
+}
+
+
+static void _snapshot_add(lsreg_snapshot_writer_t *w, lsreg_rec_t *rec) {
+  size_t index;
+  
+  switch(rec->type) {
+    case kLSRegRecTypeBundle: {
+      lsreg_bundle_t *b = (lsreg_bundle_t *)rec->rec;
+      lsreg_snapshot_bundle_t *sb;
+      if(_snapshot_reserve(w, (void **)&w->bundles, w->nbundles, &w->bundles_cap, sizeof(*sb)) != 0) {
+        return;
+      }
+      index = w->nbundles++;
+      sb = &w->bundles[index];
+      memset(sb, 0, sizeof(*sb));
+      sb->uid = b->uid;
+      sb->identifier = _snapshot_str(w, b->identifier.name);
+      sb->identifier_hash = b->identifier.hash;
+      sb->canonical_identifier = _snapshot_str(w, b->canonical_identifier.name);
+      sb->canonical_identifier_hash = b->canonical_identifier.hash;
+      sb->path = _snapshot_str(w, b->path);
+      sb->name = _snapshot_str(w, b->name);
+      sb->version = _snapshot_str(w, b->version);
+      sb->type_code = b->type_code;
+      sb->executable = _snapshot_str(w, b->executable);
+      sb->icon = _snapshot_str(w, b->icon);
+      sb->library = _snapshot_str(w, b->library);
+      sb->regdate = _snapshot_date(b->regdate);
+      sb->moddate = _snapshot_date(b->moddate);
+      if(b->library_items) {
+        char **item;
+        sb->library_items = (uint32_t)w->nitems;
+        for(item = b->library_items; *item; item++) {
+          if(_snapshot_reserve(w, (void **)&w->items, w->nitems, &w->items_cap, sizeof(uint32_t)) != 0) {
+            return;
+          }
+          w->items[w->nitems++] = _snapshot_str(w, *item);
+          sb->nlibrary_items++;
+        }
+      }
+      break;
+    }
+    case kLSRegRecTypeVolume: {
+      lsreg_volume_t *v = (lsreg_volume_t *)rec->rec;
+      lsreg_snapshot_volume_t *sv;
+      if(_snapshot_reserve(w, (void **)&w->volumes, w->nvolumes, &w->volumes_cap, sizeof(*sv)) != 0) {
+        return;
+      }
+      index = w->nvolumes++;
+      sv = &w->volumes[index];
+      sv->uid = v->uid;
+      sv->path = _snapshot_str(w, v->path);
+      sv->disk_image = _snapshot_str(w, v->disk_image);
+      sv->is_mounted = v->is_mounted;
+      sv->vrefnum = v->vrefnum;
+      sv->flags = v->flags;
+      break;
+    }
+    case kLSRegRecTypeHandler: {
+      lsreg_handler_t *h = (lsreg_handler_t *)rec->rec;
+      lsreg_snapshot_handler_t *sh;
+      if(_snapshot_reserve(w, (void **)&w->handlers, w->nhandlers, &w->handlers_cap, sizeof(*sh)) != 0) {
+        return;
+      }
+      index = w->nhandlers++;
+      sh = &w->handlers[index];
+      sh->uid = h->uid;
+      sh->content_type = _snapshot_str(w, h->content_type);
+      sh->extension = _snapshot_str(w, h->extension);
+      sh->uri_scheme = _snapshot_str(w, h->uri_scheme);
+      sh->roles = _snapshot_str(w, h->roles.name);
+      sh->roles_hash = h->roles.hash;
+      sh->options = h->options;
+      sh->reserved = 0;
+      break;
+    }
+    default:
+      return;
+  }
+  
+  if(_snapshot_reserve(w, (void **)&w->records, w->nrecords, &w->records_cap, sizeof(uint32_t)) == 0 &&
+     _snapshot_reserve(w, (void **)&w->fingerprints, w->nrecords, &w->fingerprints_cap, sizeof(uint64_t)) == 0)
+  {
+    w->fingerprints[w->nrecords] = rec->fingerprint;
+    w->records[w->nrecords++] = _SNAPSHOT_REC(rec->type, index);
+  }
+}
+
+
+// Writes size bytes of ptr followed by zeros up to the next 8 byte boundary
+static int _snapshot_fwrite(FILE *f, const void *ptr, size_t size) {
+  static const char zeros[8] = {0};
+  if(size && fwrite(ptr, 1, size, f) != size) {
+    return -1;
+  }
+  if(_SNAPSHOT_ALIGN(size) != size &&
+     fwrite(zeros, 1, _SNAPSHOT_ALIGN(size) - size, f) != _SNAPSHOT_ALIGN(size) - size)
+  {
+    return -1;
+  }
+  return 0;
+}
+
+
+static int _snapshot_save(lsreg_snapshot_writer_t *w, const char *path) {
+  lsreg_snapshot_header_t h;
+  char *tmppath;
+  FILE *f;
+  int status = -1;
+  
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, LSREG_SNAPSHOT_MAGIC, sizeof(h.magic));
+  h.version = LSREG_SNAPSHOT_VERSION;
+  h.byte_order = LSREG_SNAPSHOT_BYTE_ORDER;
+  h.nrecords = (uint32_t)w->nrecords;
+  h.nbundles = (uint32_t)w->nbundles;
+  h.nvolumes = (uint32_t)w->nvolumes;
+  h.nhandlers = (uint32_t)w->nhandlers;
+  h.nitems = (uint32_t)w->nitems;
+  h.strings_size = (uint32_t)w->strings_size;
+  h.records_offset = _SNAPSHOT_ALIGN(sizeof(h));
+  h.fingerprints_offset = h.records_offset + _SNAPSHOT_ALIGN(sizeof(uint32_t)*w->nrecords);
+  h.bundles_offset = h.fingerprints_offset + sizeof(uint64_t)*w->nrecords;
+  h.volumes_offset = h.bundles_offset + _SNAPSHOT_ALIGN(sizeof(lsreg_snapshot_bundle_t)*w->nbundles);
+  h.handlers_offset = h.volumes_offset + _SNAPSHOT_ALIGN(sizeof(lsreg_snapshot_volume_t)*w->nvolumes);
+  h.items_offset = h.handlers_offset + _SNAPSHOT_ALIGN(sizeof(lsreg_snapshot_handler_t)*w->nhandlers);
+  h.strings_offset = h.items_offset + _SNAPSHOT_ALIGN(sizeof(uint32_t)*w->nitems);
+  
+  // Write to a temporary file which replaces path when complete, so that
+  // readers never see a partial snapshot
+  if((tmppath = (char *)malloc(strlen(path)+5)) == NULL) {
+    return -1;
+  }
+  sprintf(tmppath, "%s.tmp", path);
+  if((f = fopen(tmppath, "wb")) == NULL) {
+    log_error("Failed to open %s: %s", tmppath, strerror(errno));
+    free(tmppath);
+    return -1;
+  }
+  if(_snapshot_fwrite(f, &h, sizeof(h)) == 0 &&
+     _snapshot_fwrite(f, w->records, sizeof(uint32_t)*w->nrecords) == 0 &&
+     _snapshot_fwrite(f, w->fingerprints, sizeof(uint64_t)*w->nrecords) == 0 &&
+     _snapshot_fwrite(f, w->bundles, sizeof(lsreg_snapshot_bundle_t)*w->nbundles) == 0 &&
+     _snapshot_fwrite(f, w->volumes, sizeof(lsreg_snapshot_volume_t)*w->nvolumes) == 0 &&
+     _snapshot_fwrite(f, w->handlers, sizeof(lsreg_snapshot_handler_t)*w->nhandlers) == 0 &&
+     _snapshot_fwrite(f, w->items, sizeof(uint32_t)*w->nitems) == 0 &&
+     _snapshot_fwrite(f, w->strings, w->strings_size) == 0)
+  {
+    status = 0;
+  }
+  if(fclose(f) != 0) {
+    status = -1;
+  }
+  if(status == 0 && rename(tmppath, path) != 0) {
+    status = -1;
+  }
+  if(status != 0) {
+    log_error("Failed to write %s: %s", path, strerror(errno));
+    unlink(tmppath);
+  }
+  free(tmppath);
+  return status;
+}
+
+
+// Write a snapshot of the records read from r
+int lsreg_snapshot_write(lsreg_reader_t *r, const char *path) {
+  lsreg_snapshot_writer_t w;
+  lsreg_reader_t *r2 = NULL;
+  lsreg_rec_t rec;
+  int status = -1;
+  
+  if(r == NULL && (r = r2 = lsreg_reader_open_regdump()) == NULL) {
+    return -1;
+  }
+  
+  memset(&w, 0, sizeof(w));
+  w.strings_cap = 64*1024;
+  if((w.strings = (char *)malloc(w.strings_cap)) != NULL) {
+    w.strings[0] = '\0'; // offset 0 is NULL
+    w.strings_size = 1;
     
-    free(regdate);
-    free(moddate);
+    lsreg_rec_init(&rec);
+    while(!w.failed && lsreg_reader_next(r, &rec)) {
+      _snapshot_add(&w, &rec);
+      lsreg_rec_init(&rec);
+    }
     
-    if(bundle->library_items) {
-      fputs("[\n", stream);
-      char *item;
-      char **v;
-      for( v = bundle->library_items; (item = *v); v++ ) {
-        fprintf(stream, "    \"%s\"\n", item);
+    if(w.failed || w.nrecords >= (1 << 30)) {
+      log_error("Failed to build snapshot: out of memory");
+    }
+    else {
+      status = _snapshot_save(&w, path);
+    }
+  }
+  
+  free(w.strings);
+  free(w.strhash);
+  free(w.records);
+  free(w.fingerprints);
+  free(w.bundles);
+  free(w.volumes);
+  free(w.handlers);
+  free(w.items);
+  if(r2) {
+    lsreg_reader_close(r2);
+  }
+  return status;
+}
+
+
+// Checks that a table of count elements of elsize bytes at offset lies
+// within a file of size bytes
+static int _snapshot_table_ok(uint64_t offset, uint64_t count, uint64_t elsize, uint64_t size) {
+  return offset <= size && count * elsize <= size - offset && (offset & 7) == 0;
+}
+
+
+// Open a reader on a snapshot
+lsreg_reader_t *lsreg_snapshot_open(const char *path) {
+  lsreg_reader_t *r;
+  const lsreg_snapshot_header_t *h;
+  struct stat st;
+  int fd;
+  void *map;
+  
+  if((fd = open(path, O_RDONLY)) == -1) {
+    log_error("Failed to open %s: %s", path, strerror(errno));
+    return NULL;
+  }
+  if(fstat(fd, &st) == -1) {
+    log_error("Failed to stat %s: %s", path, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+  if((size_t)st.st_size < sizeof(lsreg_snapshot_header_t)) {
+    log_error("%s is not a snapshot", path);
+    close(fd);
+    return NULL;
+  }
+  // Private and writable, as records are handed out as char*
+  map = mmap(NULL, (size_t)st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) {
+    log_error("Failed to map %s: %s", path, strerror(errno));
+    return NULL;
+  }
+  
+  h = (const lsreg_snapshot_header_t *)map;
+  if(memcmp(h->magic, LSREG_SNAPSHOT_MAGIC, sizeof(h->magic)) != 0 ||
+     h->byte_order != LSREG_SNAPSHOT_BYTE_ORDER)
+  {
+    log_error("%s is not a snapshot", path);
+    munmap(map, (size_t)st.st_size);
+    return NULL;
+  }
+  if(h->version != LSREG_SNAPSHOT_VERSION) {
+    log_error("%s: unsupported snapshot version %u", path, h->version);
+    munmap(map, (size_t)st.st_size);
+    return NULL;
+  }
+  if(!_snapshot_table_ok(h->records_offset, h->nrecords, sizeof(uint32_t), st.st_size) ||
+     !_snapshot_table_ok(h->fingerprints_offset, h->nrecords, sizeof(uint64_t), st.st_size) ||
+     !_snapshot_table_ok(h->bundles_offset, h->nbundles, sizeof(lsreg_snapshot_bundle_t), st.st_size) ||
+     !_snapshot_table_ok(h->volumes_offset, h->nvolumes, sizeof(lsreg_snapshot_volume_t), st.st_size) ||
+     !_snapshot_table_ok(h->handlers_offset, h->nhandlers, sizeof(lsreg_snapshot_handler_t), st.st_size) ||
+     !_snapshot_table_ok(h->items_offset, h->nitems, sizeof(uint32_t), st.st_size) ||
+     !_snapshot_table_ok(h->strings_offset, h->strings_size, 1, st.st_size) ||
+     h->strings_size == 0 ||
+     ((const char *)map)[h->strings_offset + h->strings_size - 1] != '\0')
+  {
+    log_error("%s: snapshot is corrupt", path);
+    munmap(map, (size_t)st.st_size);
+    return NULL;
+  }
+  
+  if((r = _reader_create()) == NULL) {
+    munmap(map, (size_t)st.st_size);
+    return NULL;
+  }
+  r->map = (char *)map;
+  r->maplen = r->mapsize = (size_t)st.st_size;
+  r->eof = 1;
+  r->zerocopy = 1;
+  r->skip_lines = 0;
+  r->snap = h;
+  return r;
+}
+
+
+// Returns the string at offset off of the string table
+static char *_snapshot_strref(lsreg_reader_t *r, uint32_t off) {
+  if(off == 0 || off >= r->snap->strings_size) {
+    return NULL;
+  }
+  return r->map + r->snap->strings_offset + off;
+}
+
+
+static time_t _snapshot_time(int64_t date) {
+  return (date == LSREG_SNAPSHOT_NO_DATE) ? 0 : (time_t)date;
+}
+
+
+// Reads the next record of a snapshot
+static int _snapshot_next(lsreg_reader_t *r, lsreg_rec_t *rec) {
+  const lsreg_snapshot_header_t *h = r->snap;
+  uint32_t entry, index;
+  enum kLSRegRecType type;
+  unsigned int mask;
+  
+  if(!r->keep_records) {
+    _arena_reset(&r->arena);
+  }
+  
+  for(;;) {
+    if(r->snap_next >= h->nrecords) {
+      r->done = 1;
+      return 0;
+    }
+    entry = ((const uint32_t *)(r->map + h->records_offset))[r->snap_next++];
+    type = (enum kLSRegRecType)(entry >> 30);
+    index = entry & ((1 << 30)-1);
+    if((r->types & (1 << type)) && (r->filter == NULL || (r->filter->types & (1 << type)))) {
+      break;
+    }
+  }
+  
+  rec->type = type;
+  rec->flags |= kLSRegRecBorrowed;
+  rec->fingerprint = ((const uint64_t *)(r->map + h->fingerprints_offset))[r->snap_next-1];
+  mask = r->fields[type];
+  
+  switch(type) {
+    case kLSRegRecTypeBundle: {
+      const lsreg_snapshot_bundle_t *sb;
+      lsreg_bundle_t *b;
+      if(index >= h->nbundles) {
+        break;
       }
-      fputs("  ]\n", stream);
+      sb = &((const lsreg_snapshot_bundle_t *)(r->map + h->bundles_offset))[index];
+      if((b = (lsreg_bundle_t *)_alloc(r, sizeof(lsreg_bundle_t))) == NULL) {
+        break;
+      }
+      lsreg_bundle_init(b);
+      rec->rec = b;
+      rec->uid = b->uid = sb->uid;
+      if(mask & kLSRegBundleIdentifierField) {
+        b->identifier.name = _snapshot_strref(r, sb->identifier);
+        b->identifier.hash = sb->identifier_hash;
+      }
+      if(mask & kLSRegBundleCanonicalIdentifierField) {
+        b->canonical_identifier.name = _snapshot_strref(r, sb->canonical_identifier);
+        b->canonical_identifier.hash = sb->canonical_identifier_hash;
+      }
+      if(mask & kLSRegBundlePathField)        b->path = _snapshot_strref(r, sb->path);
+      if(mask & kLSRegBundleNameField)        b->name = _snapshot_strref(r, sb->name);
+      if(mask & kLSRegBundleVersionField)     b->version = _snapshot_strref(r, sb->version);
+      if(mask & kLSRegBundleTypeCodeField)    b->type_code = sb->type_code;
+      if(mask & kLSRegBundleExecutableField)  b->executable = _snapshot_strref(r, sb->executable);
+      if(mask & kLSRegBundleIconField)        b->icon = _snapshot_strref(r, sb->icon);
+      if(mask & kLSRegBundleLibraryField)     b->library = _snapshot_strref(r, sb->library);
+      if(mask & kLSRegBundleRegDateField)     b->regdate = _snapshot_time(sb->regdate);
+      if(mask & kLSRegBundleModDateField)     b->moddate = _snapshot_time(sb->moddate);
+      if((mask & kLSRegBundleLibraryItemsField) && sb->nlibrary_items &&
+         sb->library_items <= h->nitems && sb->nlibrary_items <= h->nitems - sb->library_items)
+      {
+        const uint32_t *items = (const uint32_t *)(r->map + h->items_offset) + sb->library_items;
+        uint32_t i;
+        if((b->library_items = (char **)_alloc(r, sizeof(char *)*(sb->nlibrary_items+1)))) {
+          for(i = 0; i < sb->nlibrary_items; i++) {
+            b->library_items[i] = _snapshot_strref(r, items[i]);
+          }
+          b->library_items[i] = NULL; /* sentinel */
+        }
+      }
+      return 1;
+    }
+    case kLSRegRecTypeVolume: {
+      const lsreg_snapshot_volume_t *sv;
+      lsreg_volume_t *v;
+      if(index >= h->nvolumes) {
+        break;
+      }
+      sv = &((const lsreg_snapshot_volume_t *)(r->map + h->volumes_offset))[index];
+      if((v = (lsreg_volume_t *)_alloc(r, sizeof(lsreg_volume_t))) == NULL) {
+        break;
+      }
+      lsreg_volume_init(v);
+      rec->rec = v;
+      rec->uid = v->uid = sv->uid;
+      if(mask & kLSRegVolumePathField)        v->path = _snapshot_strref(r, sv->path);
+      if(mask & kLSRegVolumeDiskImageField)   v->disk_image = _snapshot_strref(r, sv->disk_image);
+      if(mask & kLSRegVolumeIsMountedField)   v->is_mounted = sv->is_mounted;
+      if(mask & kLSRegVolumeVRefNumField)     v->vrefnum = sv->vrefnum;
+      if(mask & kLSRegVolumeFlagsField)       v->flags = (enum kLSRegVolumeFlags)sv->flags;
+      return 1;
+    }
+    case kLSRegRecTypeHandler: {
+      const lsreg_snapshot_handler_t *sh;
+      lsreg_handler_t *hd;
+      if(index >= h->nhandlers) {
+        break;
+      }
+      sh = &((const lsreg_snapshot_handler_t *)(r->map + h->handlers_offset))[index];
+      if((hd = (lsreg_handler_t *)_alloc(r, sizeof(lsreg_handler_t))) == NULL) {
+        break;
+      }
+      lsreg_handler_init(hd);
+      rec->rec = hd;
+      rec->uid = hd->uid = sh->uid;
+      if(mask & kLSRegHandlerContentTypeField) hd->content_type = _snapshot_strref(r, sh->content_type);
+      if(mask & kLSRegHandlerExtensionField)  hd->extension = _snapshot_strref(r, sh->extension);
+      if(mask & kLSRegHandlerURISchemeField)  hd->uri_scheme = _snapshot_strref(r, sh->uri_scheme);
+      if(mask & kLSRegHandlerRolesField) {
+        hd->roles.name = _snapshot_strref(r, sh->roles);
+        hd->roles.hash = sh->roles_hash;
+      }
+      if(mask & kLSRegHandlerOptionsField)    hd->options = (enum kLSRegHandlerOptions)sh->options;
+      return 1;
+    }
+    default:
+      break;
+  }
+  
+  log_error("Snapshot record %lu is corrupt", (unsigned long)r->snap_next-1);
+  rec->type = kLSRegRecTypeUnknown;
+  r->done = 1;
+  return 0;
+}
+
+
+// ---------------------------------------------
+#pragma mark -
+#pragma mark Database
+
+// Hash index over the records of one type. Records are referred to by
+// their position in the db's array for that type, plus one.
+typedef struct {
+  uint32_t *slots;          // first record of each distinct key, 0 if empty
+  uint32_t *next;           // next record with the same key, 0 if last
+  size_t mask;              // number of slots - 1
+} lsreg_db_index_t;
+
+// Entry of the prefix index: a case-folded identifier
+typedef struct {
+  const char *folded;
+  size_t len;
+  lsreg_bundle_t *bundle;
+} lsreg_db_prefix_t;
+
+struct lsreg_db {
+  lsreg_reader_t *r;        // owns the memory of all records
+  lsreg_bundle_t *bundles;
+  size_t nbundles;
+  lsreg_volume_t *volumes;
+  size_t nvolumes;
+  lsreg_handler_t *handlers;
+  size_t nhandlers;
+  lsreg_db_index_t indexes[kLSRegDBKeyCount];
+  lsreg_db_prefix_t *prefix;    // prefix index, built on first use
+  lsreg_bundle_t **prefix_bundles; // bundles in prefix index order
+  size_t nprefix;
+  char *prefix_strings;         // case-folded identifiers
+};
+
+// Key descriptor
+typedef struct {
+  enum kLSRegRecType type;
+  int is_string;
+  size_t offset;            // offset of the key in the record struct
+} lsreg_db_key_t;
+
+static const lsreg_db_key_t _db_keys[kLSRegDBKeyCount] = {
+  { kLSRegRecTypeBundle,  0, offsetof(lsreg_bundle_t, uid) },
+  { kLSRegRecTypeBundle,  0, offsetof(lsreg_bundle_t, identifier.hash) },
+  { kLSRegRecTypeBundle,  1, offsetof(lsreg_bundle_t, canonical_identifier.name) },
+  { kLSRegRecTypeBundle,  1, offsetof(lsreg_bundle_t, path) },
+  { kLSRegRecTypeBundle,  0, offsetof(lsreg_bundle_t, canonical_identifier.hash) },
+  { kLSRegRecTypeHandler, 1, offsetof(lsreg_handler_t, extension) },
+  { kLSRegRecTypeHandler, 1, offsetof(lsreg_handler_t, content_type) },
+  { kLSRegRecTypeHandler, 1, offsetof(lsreg_handler_t, uri_scheme) },
+};
+
+
+// Returns the record at position pos (0-based) of key's record type
+static void *_db_rec(lsreg_db_t *db, enum kLSRegDBKey key, size_t pos) {
+  if(_db_keys[key].type == kLSRegRecTypeBundle) {
+    return &db->bundles[pos];
+  }
+  return &db->handlers[pos];
+}
+
+
+// Returns the position (0-based) of rec, which must be of key's type
+static size_t _db_pos(lsreg_db_t *db, enum kLSRegDBKey key, const void *rec) {
+  if(_db_keys[key].type == kLSRegRecTypeBundle) {
+    return (const lsreg_bundle_t *)rec - db->bundles;
+  }
+  return (const lsreg_handler_t *)rec - db->handlers;
+}
+
+
+// Hashes the key of rec. Returns 0 if rec has no such key.
+static int _db_rec_hash(const lsreg_db_key_t *k, const void *rec, uint32_t *hash) {
+  const char *member = (const char *)rec + k->offset;
+  if(k->is_string) {
+    const char *s = *(const char * const *)member;
+    if(s == NULL) {
+      return 0;
     }
-    else {
-      fputs("NULL\n", stream);
+    *hash = _strhash(s, strlen(s));
+  }
+  else {
+    unsigned int n = *(const unsigned int *)member;
+    if(n == 0) {
+      return 0;
     }
-    
-    fputs("}\n", stream);
+    *hash = (uint32_t)n * 0x9e3779b1U;
   }
+  return 1;
 }
 
 
-// Set key and value
-int lsreg_bundle_nset(lsreg_bundle_t *bundle, 
-                      const char *key, size_t keylen,
-                      const char *val, size_t vallen)
-{
-  int status;
-  
-  status = 0;
+// Returns 1 if the keys of records a and b are equal
+static int _db_rec_keyeq(const lsreg_db_key_t *k, const void *a, const void *b) {
+  const char *ma = (const char *)a + k->offset, *mb = (const char *)b + k->offset;
+  if(k->is_string) {
+    return strcmp(*(const char * const *)ma, *(const char * const *)mb) == 0;
+  }
+  return *(const unsigned int *)ma == *(const unsigned int *)mb;
+}
+
+
+static int _db_index_build(lsreg_db_t *db, enum kLSRegDBKey key) {
+  const lsreg_db_key_t *k = &_db_keys[key];
+  lsreg_db_index_t *index = &db->indexes[key];
+  size_t n = (k->type == kLSRegRecTypeBundle) ? db->nbundles : db->nhandlers;
+  size_t nslots = 16, pos, i;
+  uint32_t hash;
+  void *rec;
   
-  if( (keylen == 4) && (memcmp(key, "path", keylen) == 0) ) {
-    bundle->path = strdup(val);
+  while(nslots < n*2) {
+    nslots *= 2;
   }
-  else if( (keylen == 4) && (memcmp(key, "name", keylen) == 0) ) {
-    bundle->name = strdup(val);
+  index->slots = (uint32_t *)calloc(nslots, sizeof(uint32_t));
+  index->next = (uint32_t *)calloc(n ? n : 1, sizeof(uint32_t));
+  index->mask = nslots-1;
+  if(index->slots == NULL || index->next == NULL) {
+    return -1;
   }
-  else if( (keylen == 7) && (memcmp(key, "version", keylen) == 0) ) {
-    bundle->version = strdup(val);
+  
+  // Records are added last to first, so that each chain of records with
+  // the same key ends up in dump order
+  for(pos = n; pos--; ) {
+    rec = _db_rec(db, key, pos);
+    if(!_db_rec_hash(k, rec, &hash)) {
+      continue;
+    }
+    for(i = hash & index->mask; index->slots[i]; i = (i+1) & index->mask) {
+      if(_db_rec_keyeq(k, _db_rec(db, key, index->slots[i]-1), rec)) {
+        break;
+      }
+    }
+    index->next[pos] = index->slots[i];
+    index->slots[i] = (uint32_t)pos+1;
   }
-  else if( (keylen == 9) && (memcmp(key, "type code", keylen) == 0) ) {
-    STRCREATE(bundle->type_code, val+1, vallen-2); // remove wrapping "'" chars
+  return 0;
+}
+
+
+// Returns the first record with the given key, or NULL
+static void *_db_find(lsreg_db_t *db, enum kLSRegDBKey key, const char *s, unsigned int n) {
+  const lsreg_db_key_t *k = &_db_keys[key];
+  lsreg_db_index_t *index = &db->indexes[key];
+  const char *member;
+  uint32_t hash;
+  size_t i;
+  void *rec;
+  
+  if(k->is_string) {
+    if(s == NULL) {
+      return NULL;
+    }
+    hash = _strhash(s, strlen(s));
   }
-  else if( (keylen == 10) && (memcmp(key, "executable", keylen) == 0) ) {
-    bundle->executable = strdup(val);
+  else {
+    if(n == 0) {
+      return NULL;
+    }
+    hash = (uint32_t)n * 0x9e3779b1U;
   }
-  else if( (keylen == 4) && (memcmp(key, "icon", keylen) == 0) ) {
-    bundle->icon = strdup(val);
+  
+  for(i = hash & index->mask; index->slots[i]; i = (i+1) & index->mask) {
+    rec = _db_rec(db, key, index->slots[i]-1);
+    member = (const char *)rec + k->offset;
+    if(k->is_string ? (strcmp(*(const char * const *)member, s) == 0)
+                    : (*(const unsigned int *)member == n))
+    {
+      return rec;
+    }
   }
-  else if( (keylen == 8) && (memcmp(key, "mod date", keylen) == 0) ) {
-    // input example: "6/26/2006 2:41:56"
-    bundle->moddate = (struct tm *)malloc(sizeof(struct tm));
-    if(strptime(val, "%m/%d/%Y %T", bundle->moddate) == NULL) {
-      free(bundle->moddate);
-      bundle->moddate = NULL;
-      log_error("Failed to parse date '%s'", val);
+  return NULL;
+}
+
+
+// Returns the record following rec with the same key, or NULL
+static void *_db_next(lsreg_db_t *db, enum kLSRegDBKey key, const void *rec) {
+  uint32_t next = db->indexes[key].next[_db_pos(db, key, rec)];
+  return next ? _db_rec(db, key, next-1) : NULL;
+}
+
+
+// Appends a copy of the record struct rec points to
+static int _db_append(void **array, size_t *count, size_t *cap, const void *rec, size_t size) {
+  if(*count == *cap) {
+    void *p;
+    size_t newcap = *cap ? *cap * 2 : 1024;
+    if((p = realloc(*array, newcap * size)) == NULL) {
+      return -1;
     }
+    *array = p;
+    *cap = newcap;
   }
-  else if( (keylen == 8) && (memcmp(key, "reg date", keylen) == 0) ) {
-    bundle->regdate = (struct tm *)malloc(sizeof(struct tm));
-    if(strptime(val, "%m/%d/%Y %T", bundle->regdate) == NULL) {
-      free(bundle->regdate);
-      bundle->regdate = NULL;
-      log_error("Failed to parse date '%s'", val);
+  memcpy((char *)*array + (*count)++ * size, rec, size);
+  return 0;
+}
+
+
+// Points the inline strings of the first count bundles back at their own
+// storage after the array moved from the address old
+static void _db_rebase_bundles(lsreg_db_t *db, uintptr_t old, size_t count) {
+  lsreg_bundle_t *b;
+  uintptr_t strings;
+  size_t i;
+  
+  for(i = 0; i < count; i++) {
+    b = &db->bundles[i];
+    strings = old + i*sizeof(lsreg_bundle_t) + offsetof(lsreg_bundle_t, strings);
+    if(b->name && (uintptr_t)b->name - strings < sizeof(b->strings)) {
+      b->name = b->strings + ((uintptr_t)b->name - strings);
+    }
+    if(b->version && (uintptr_t)b->version - strings < sizeof(b->strings)) {
+      b->version = b->strings + ((uintptr_t)b->version - strings);
     }
   }
-  else if(((keylen == 10) && (memcmp(key, "identifier", keylen) == 0)) ||
-          ((keylen == 12) && (memcmp(key, "canonical id", keylen) == 0)) ){
-    
-    lsreg_identifier_parse(val, vallen, (keylen == 10) ? &bundle->identifier : &bundle->canonical_identifier);
+}
+
+
+// Links each handler to the bundle of its role. Of the bundles with the
+// role's hash, the first one which canonical identifier also matches by
+// name is used, if both names are known.
+static void _db_join_handlers(lsreg_db_t *db) {
+  lsreg_handler_t *h;
+  lsreg_bundle_t *b;
+  size_t i;
+  
+  for(i = 0; i < db->nhandlers; i++) {
+    h = &db->handlers[i];
+    b = (lsreg_bundle_t *)_db_find(db, kLSRegDBBundleCanonicalIdentifierHash, NULL, h->roles.hash);
+    for(; b; b = (lsreg_bundle_t *)_db_next(db, kLSRegDBBundleCanonicalIdentifierHash, b)) {
+      if(h->roles.name == NULL || b->canonical_identifier.name == NULL ||
+         strcasecmp(h->roles.name, b->canonical_identifier.name) == 0)
+      {
+        break;
+      }
+    }
+    h->bundle = b;
   }
-  else {
-    status = 1; // no matching key
+}
+
+
+// Load all records of r into a new database
+lsreg_db_t *lsreg_db_open(lsreg_reader_t *r) {
+  lsreg_db_t *db;
+  lsreg_rec_t rec;
+  size_t bundles_cap = 0, volumes_cap = 0, handlers_cap = 0;
+  uintptr_t moved;
+  int key, status = 0;
+  
+  if(r == NULL && (r = lsreg_reader_open_regdump()) == NULL) {
+    return NULL;
+  }
+  if((db = (lsreg_db_t *)calloc(1, sizeof(lsreg_db_t))) == NULL) {
+    lsreg_reader_close(r);
+    return NULL;
   }
+  db->r = r;
   
-  return status;
+  // Record members stay in the reader's arena (or mapping) until the db
+  // is closed
+  r->keep_records = 1;
+  _arena_reset(&r->arena);
+  
+  lsreg_rec_init(&rec);
+  while(status == 0 && lsreg_reader_next(r, &rec)) {
+    switch(rec.type) {
+      case kLSRegRecTypeBundle:
+        moved = (uintptr_t)db->bundles;
+        status = _db_append((void **)&db->bundles, &db->nbundles, &bundles_cap,
+                            rec.rec, sizeof(lsreg_bundle_t));
+        if(status == 0) {
+          if(moved && (uintptr_t)db->bundles != moved) {
+            _db_rebase_bundles(db, moved, db->nbundles-1);
+          }
+          _bundle_rebase(&db->bundles[db->nbundles-1], (const lsreg_bundle_t *)rec.rec);
+        }
+        break;
+      case kLSRegRecTypeVolume:
+        status = _db_append((void **)&db->volumes, &db->nvolumes, &volumes_cap,
+                            rec.rec, sizeof(lsreg_volume_t));
+        break;
+      case kLSRegRecTypeHandler:
+        status = _db_append((void **)&db->handlers, &db->nhandlers, &handlers_cap,
+                            rec.rec, sizeof(lsreg_handler_t));
+        break;
+      default:
+        break;
+    }
+    lsreg_rec_init(&rec);
+  }
+  
+  for(key = 0; status == 0 && key < kLSRegDBKeyCount; key++) {
+    status = _db_index_build(db, (enum kLSRegDBKey)key);
+  }
+  if(status != 0) {
+    log_error("Failed to load database: out of memory");
+    lsreg_db_close(db);
+    return NULL;
+  }
+  _db_join_handlers(db);
+  return db;
 }
 
 
-// ---------------------------------------------
-#pragma mark -
-#pragma mark Volume record methods
+// Close a database and free all of its records
+void lsreg_db_close(lsreg_db_t *db) {
+  int key;
+  if(db == NULL) {
+    return;
+  }
+  for(key = 0; key < kLSRegDBKeyCount; key++) {
+    free(db->indexes[key].slots);
+    free(db->indexes[key].next);
+  }
+  free(db->bundles);
+  free(db->volumes);
+  free(db->handlers);
+  free(db->prefix);
+  free(db->prefix_bundles);
+  free(db->prefix_strings);
+  lsreg_reader_close(db->r);
+  free(db);
+}
 
-/*
- char *path;       // Mount path. May not exist.
- char *disk_image; // May be NULL if not a disk_image
- int is_mounted;   // 1 or 0
- int vrefnum;      // May be 0 if not present
- enum kLSRegVolumeFlags flags;
- */
 
-// Initialize volume
-void lsreg_volume_init(lsreg_volume_t *s) {
-  s->uid = 0;
-  s->path = NULL;
-  s->disk_image = NULL;
-  s->is_mounted = 0;
-  s->vrefnum = 0;
-  s->flags = 0;
+// All records of a type, in dump order
+lsreg_bundle_t *lsreg_db_bundles(lsreg_db_t *db, size_t *count) {
+  *count = db->nbundles;
+  return db->bundles;
 }
 
-// Free all bundle members, but not the volume itself
-void lsreg_volume_free_members(lsreg_volume_t *s) {
-  if(s->path)           free(s->path);
-  if(s->disk_image)     free(s->disk_image);
+lsreg_volume_t *lsreg_db_volumes(lsreg_db_t *db, size_t *count) {
+  *count = db->nvolumes;
+  return db->volumes;
 }
 
-// Free volume and all its members
-void lsreg_volume_free(lsreg_volume_t *s) {
-  if(s != NULL) {
-    lsreg_volume_free_members(s);
-    free(s);
-  }
+lsreg_handler_t *lsreg_db_handlers(lsreg_db_t *db, size_t *count) {
+  *count = db->nhandlers;
+  return db->handlers;
 }
 
-// Dump bundle, in a human readable format, to stream
-void lsreg_volume_dump(lsreg_volume_t *s, FILE *stream) {
-  if(s == NULL) {
-    fprintf(stream, "<lsreg_volume_t>NULL\n");
-  }
-  else {
-    fprintf(stream,
-            "<lsreg_volume_t>{\n"
-            "  uid        = %u\n"
-            "  path       = \"%s\"\n"
-            "  disk_image = \"%s\"\n"
-            "  is_mounted = %s\n"
-            "  vrefnum    = %d\n"
-            "  flags      = 0x%x\n"
-            "}\n",
-            s->uid,
-            s->path,
-            s->disk_image,
-            s->is_mounted ? "YES" : "NO",
-            s->vrefnum,
-            s->flags);
+
+// Bundle lookups
+lsreg_bundle_t *lsreg_db_bundle_by_uid(lsreg_db_t *db, unsigned int uid) {
+  return (lsreg_bundle_t *)_db_find(db, kLSRegDBBundleUID, NULL, uid);
+}
+
+lsreg_bundle_t *lsreg_db_bundle_by_identifier_hash(lsreg_db_t *db, unsigned int hash) {
+  return (lsreg_bundle_t *)_db_find(db, kLSRegDBBundleIdentifierHash, NULL, hash);
+}
+
+lsreg_bundle_t *lsreg_db_bundle_by_canonical_identifier(lsreg_db_t *db, const char *name) {
+  return (lsreg_bundle_t *)_db_find(db, kLSRegDBBundleCanonicalIdentifier, name, 0);
+}
+
+lsreg_bundle_t *lsreg_db_bundle_by_path(lsreg_db_t *db, const char *path) {
+  return (lsreg_bundle_t *)_db_find(db, kLSRegDBBundlePath, path, 0);
+}
+
+lsreg_bundle_t *lsreg_db_bundle_by_canonical_identifier_hash(lsreg_db_t *db, unsigned int hash) {
+  return (lsreg_bundle_t *)_db_find(db, kLSRegDBBundleCanonicalIdentifierHash, NULL, hash);
+}
+
+lsreg_bundle_t *lsreg_db_bundle_next(lsreg_db_t *db, const lsreg_bundle_t *bundle, enum kLSRegDBKey key) {
+  if(_db_keys[key].type != kLSRegRecTypeBundle) {
+    return NULL;
   }
+  return (lsreg_bundle_t *)_db_next(db, key, bundle);
 }
 
 
-// ---------------------------------------------
-#pragma mark -
-#pragma mark Handler record methods
+// Handler lookups
+lsreg_handler_t *lsreg_db_handler_by_extension(lsreg_db_t *db, const char *extension) {
+  return (lsreg_handler_t *)_db_find(db, kLSRegDBHandlerExtension, extension, 0);
+}
 
-// Initialize volume
-void lsreg_handler_init(lsreg_handler_t *s) {
-  s->uid = 0;
-  s->content_type = NULL;
-  s->extension = NULL;
-  s->uri_scheme = NULL;
-  s->roles.name = NULL;
-  s->roles.hash = 0;
-  s->options = 0;
+lsreg_handler_t *lsreg_db_handler_by_content_type(lsreg_db_t *db, const char *content_type) {
+  return (lsreg_handler_t *)_db_find(db, kLSRegDBHandlerContentType, content_type, 0);
 }
 
-// Free all bundle members, but not the volume itself
-void lsreg_handler_free_members(lsreg_handler_t *s) {
-  if(s->content_type) free(s->content_type);
-  if(s->extension)    free(s->extension);
-  if(s->uri_scheme)  free(s->uri_scheme);
-  if(s->roles.name)   free(s->roles.name);
+lsreg_handler_t *lsreg_db_handler_by_uri_scheme(lsreg_db_t *db, const char *uri_scheme) {
+  return (lsreg_handler_t *)_db_find(db, kLSRegDBHandlerURIScheme, uri_scheme, 0);
 }
 
-// Free volume and all its members
-void lsreg_handler_free(lsreg_handler_t *s) {
-  if(s != NULL) {
-    lsreg_handler_free_members(s);
-    free(s);
+lsreg_handler_t *lsreg_db_handler_next(lsreg_db_t *db, const lsreg_handler_t *handler, enum kLSRegDBKey key) {
+  if(_db_keys[key].type != kLSRegRecTypeHandler) {
+    return NULL;
   }
+  return (lsreg_handler_t *)_db_next(db, key, handler);
 }
 
-// Dump bundle, in a human readable format, to stream
-void lsreg_handler_dump(lsreg_handler_t *s, FILE *stream) {
-  fputs("<lsreg_handler_t>", stream);
-  if(s == NULL) {
-    fputs("NULL\n", stream);
+
+// Copies len bytes of src to dst, converting ASCII letters to lower case
+static void _fold_ascii(char *dst, const char *src, size_t len) {
+  size_t i = 0;
+#if LSREG_SSE2
+  const __m128i va = _mm_set1_epi8('A'-1);
+  const __m128i vz = _mm_set1_epi8('Z'+1);
+  const __m128i vcase = _mm_set1_epi8(0x20);
+  for(; i + 16 <= len; i += 16) {
+    // Bytes >= 0x80 are negative and thus never in range
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, va), _mm_cmplt_epi8(v, vz));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_add_epi8(v, _mm_and_si128(upper, vcase)));
   }
-  else {
-    fprintf(stream,
-            "{\n"
-            "  uid          = %u\n"
-            "  content_type = \"%s\"\n"
-            "  extension    = \"%s\"\n"
-            "  uri_scheme   = \"%s\"\n"
-            "  roles        = ",
-            s->uid,
-            s->content_type,
-            s->extension,
-            s->uri_scheme);
-    
-    lsreg_identifier_dump(&s->roles, stream, "  ");
-    
-    fprintf(stream,
-            "  options      = 0x%x\n"
-            "}\n",
-            s->options);
+#endif
+  for(; i < len; i++) {
+    char c = src[i];
+    dst[i] = (c >= 'A' && c <= 'Z') ? c + 0x20 : c;
   }
 }
 
 
-// ---------------------------------------------
-#pragma mark -
-#pragma mark Parsing
-  
-int lsreg_parse_bundle(FILE *f,
-                       char *linebuf, size_t linebufsize,
-                       char *line, size_t linelen,
-                       char *key, size_t keylen,
-                       char *val, size_t vallen,
-                       lsreg_rec_t *record)
-{
-  char *s;
-  lsreg_bundle_t *bundle = (lsreg_bundle_t *)record->rec;
+// Compares the first len bytes of a and b, where a shorter string sorts
+// first. Both are case-folded, so this is a plain memcmp.
+static int _prefix_cmp(const char *a, size_t alen, const char *b, size_t blen) {
+  int d = memcmp(a, b, alen < blen ? alen : blen);
+  if(d != 0) {
+    return d;
+  }
+  return (alen > blen) - (alen < blen);
+}
+
+
+// Sorts the prefix index. Ties keep dump order.
+static int _prefix_sort_cmp(const void *a, const void *b) {
+  const lsreg_db_prefix_t *ea = (const lsreg_db_prefix_t *)a, *eb = (const lsreg_db_prefix_t *)b;
+  int d = _prefix_cmp(ea->folded, ea->len, eb->folded, eb->len);
+  if(d != 0) {
+    return d;
+  }
+  return (ea->bundle > eb->bundle) - (ea->bundle < eb->bundle);
+}
+
+
+// Builds the prefix index: identifiers of all bundles, case-folded and
+// sorted
+static int _db_prefix_build(lsreg_db_t *db) {
+  size_t i, n = 0, size = 0, len;
+  char *p;
   
-  // The "library items" key is special
-  if( (keylen == 13) && (memcmp(key, "library items", keylen) == 0) ) {
-    
-    // Copy normal identifier to canonical if same.
-    // We know "library items" always comes after canonical id,
-    // so if it's not set, we know it does not exist, thus the
-    // normal identifier IS canonical.
-    if(bundle->canonical_identifier.name == NULL && bundle->identifier.name != NULL) {
-      bundle->canonical_identifier.name = strdup(bundle->identifier.name);
-      bundle->canonical_identifier.hash = bundle->identifier.hash;
-    }
-    
-    if(vallen) {
-      size_t vsize, vlen;
-      vsize = 2;
-      vlen = 0;
-      
-      bundle->library_items = (char **)malloc(sizeof(char *)*vsize);
-      
-      // Add first item
-      bundle->library_items[vlen++] = strdup(val);
-      
-      while( (line = _readline(linebuf, linebufsize, f)) ) {
-        linelen = strlen(line);
-        // Prefix signature
-        // "\t               " 1+15
-        if(linelen > 16 && line[0] == '\t' && line[1] == ' ' && line[2] == ' ') {
-          if(vlen == vsize) {
-            vsize *= 2;
-            bundle->library_items = (char **)realloc(bundle->library_items, sizeof(char *)*vsize);
-          }
-          line = _memltrim(line, &linelen);
-          STRCREATE(s, line, linelen-1);
-          bundle->library_items[vlen++] = s;
-        }
-        else {
-          // we're done reading library items. Realloc and save.
-          bundle->library_items = (char **)realloc(bundle->library_items, sizeof(char *)*(vlen+1));
-          bundle->library_items[vlen] = NULL; /* sentinel */
-          break;
-        }
-      } // end while
+  for(i = 0; i < db->nbundles; i++) {
+    if(db->bundles[i].identifier.name) {
+      size += strlen(db->bundles[i].identifier.name) + 1;
+      n++;
     }
-  } // <- if library items
-  // The "properties" key is also special
-  else if( (keylen == 10) && (memcmp(key, "properties", keylen) == 0) ) {
-    int known_to_be_plist = 0;
-    while( (line = _readline(linebuf, linebufsize, f)) ) {
-      linelen = strlen(line);
-      if(!known_to_be_plist) {
-        if(line[0] == '\t') {
-          log_error("Expected plist xml document but found new key. This is probably a bug.");
-          break;
-        }
-        known_to_be_plist = 1;
-      }
-      if( (linelen > 7) && (memcmp(line, "</plist>", 8) == 0) ) {
-        // We have now passed the properties chunk
-        break;
-      }
+  }
+  
+  db->prefix = (lsreg_db_prefix_t *)malloc(sizeof(lsreg_db_prefix_t)*(n ? n : 1));
+  db->prefix_bundles = (lsreg_bundle_t **)malloc(sizeof(lsreg_bundle_t *)*(n ? n : 1));
+  db->prefix_strings = (char *)malloc(size ? size : 1);
+  if(db->prefix == NULL || db->prefix_bundles == NULL || db->prefix_strings == NULL) {
+    free(db->prefix);
+    free(db->prefix_bundles);
+    free(db->prefix_strings);
+    db->prefix = NULL;
+    db->prefix_bundles = NULL;
+    db->prefix_strings = NULL;
+    return -1;
+  }
+  
+  p = db->prefix_strings;
+  for(i = 0, n = 0; i < db->nbundles; i++) {
+    const char *name = db->bundles[i].identifier.name;
+    if(name) {
+      len = strlen(name);
+      _fold_ascii(p, name, len+1);
+      db->prefix[n].folded = p;
+      db->prefix[n].len = len;
+      db->prefix[n].bundle = &db->bundles[i];
+      n++;
+      p += len+1;
     }
   }
-  else {
-    // Set key and value in the bundle struct
-    lsreg_bundle_nset(bundle, key, keylen, val, vallen);
+  qsort(db->prefix, n, sizeof(lsreg_db_prefix_t), _prefix_sort_cmp);
+  for(i = 0; i < n; i++) {
+    db->prefix_bundles[i] = db->prefix[i].bundle;
   }
-  
-  return (line == NULL) ? kLSRegParseStatusDone : kLSRegParseStatusContinue;
+  db->nprefix = n;
+  return 0;
 }
 
 
+// Returns the first entry of the prefix index which is not less than
+// prefix, comparing at most plen bytes. With strict, returns the first
+// entry greater than prefix instead.
+static size_t _db_prefix_bound(lsreg_db_t *db, const char *prefix, size_t plen, int strict) {
+  size_t lo = 0, hi = db->nprefix, mid;
+  const lsreg_db_prefix_t *e;
+  int d;
+  while(lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    e = &db->prefix[mid];
+    d = _prefix_cmp(e->folded, e->len < plen ? e->len : plen, prefix, plen);
+    if(d < 0 || (strict && d == 0)) {
+      lo = mid+1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
 
-int lsreg_parse_volume(FILE *f,
-                       char *linebuf, size_t linebufsize,
-                       char *line, size_t linelen,
-                       char *key, size_t keylen,
-                       char *val, size_t vallen,
-                       lsreg_rec_t *record)
-{
-  /*
-   char *path;       // Mount path. May not exist.
-   char *disk_image; // May be NULL if not a disk_image
-   int is_mounted;   // 1 or 0
-   int vrefnum;      // May be 0 if not present
-   enum kLSRegVolumeFlags flags;
-   */
+
+// Find bundles which identifier starts with prefix, ignoring case
+lsreg_bundle_t **lsreg_db_find_prefix(lsreg_db_t *db, const char *prefix, size_t *count) {
+  char buf[256], *folded;
+  size_t plen, first, last;
   
-  lsreg_volume_t *vol = (lsreg_volume_t *)record->rec;
+  *count = 0;
+  if(db->prefix == NULL && _db_prefix_build(db) != 0) {
+    log_error("Failed to build prefix index: out of memory");
+    return NULL;
+  }
   
-  if( (keylen == 4) && (memcmp(key, "path", keylen) == 0) ) {
-    vol->path = strdup(val);
+  plen = strlen(prefix);
+  if(plen < sizeof(buf)) {
+    folded = buf;
   }
-  else if( (keylen == 10) && (memcmp(key, "disk image", keylen) == 0) ) {
-    vol->disk_image = strdup(val);
+  else if((folded = (char *)malloc(plen)) == NULL) {
+    return NULL;
   }
-  else if( (keylen == 5) && (memcmp(key, "state", keylen) == 0) ) {
-    vol->is_mounted = (vallen == 7) ? 1 : 0;
+  _fold_ascii(folded, prefix, plen);
+  
+  first = _db_prefix_bound(db, folded, plen, 0);
+  last = _db_prefix_bound(db, folded, plen, 1);
+  
+  if(folded != buf) {
+    free(folded);
   }
-  else if( (keylen == 7) && (memcmp(key, "vrefnum", keylen) == 0) ) {
-    vol->vrefnum = atoi(val);
+  *count = last - first;
+  return db->prefix_bundles + first;
+}
+
+
+// ---------------------------------------------
+#pragma mark -
+#pragma mark Diff
+
+static int _diff_str(const char *a, const char *b) {
+  if(a == NULL || b == NULL) {
+    return a != b;
   }
-  else if( (keylen == 5) && (memcmp(key, "flags", keylen) == 0) ) {
-    //vol->flags = atoi(val);
+  return strcmp(a, b) != 0;
+}
+
+
+static int _diff_items(char * const *a, char * const *b) {
+  if(a == NULL || b == NULL) {
+    return a != b;
   }
-  
-  return kLSRegParseStatusContinue;
+  for(; *a && *b; a++, b++) {
+    if(strcmp(*a, *b) != 0) {
+      return 1;
+    }
+  }
+  return *a != *b;
 }
 
 
+// Returns 1 if the field described by field differs between a and b
+static int _diff_field(const lsreg_field_t *field, const void *a, const void *b) {
+  const char *ma = (const char *)a + field->offset, *mb = (const char *)b + field->offset;
+  switch(_FIELD_KIND(field)) {
+    case kLSRegFieldString:
+    case kLSRegFieldShortString:
+      return _diff_str(*(char * const *)ma, *(char * const *)mb);
+    case kLSRegFieldFourCC:
+      return *(const uint32_t *)ma != *(const uint32_t *)mb;
+    case kLSRegFieldDate:
+      return *(const time_t *)ma != *(const time_t *)mb;
+    case kLSRegFieldIdentifier:
+      return ((const lsreg_identifier_t *)ma)->hash != ((const lsreg_identifier_t *)mb)->hash ||
+             _diff_str(((const lsreg_identifier_t *)ma)->name, ((const lsreg_identifier_t *)mb)->name);
+    case kLSRegFieldInt:
+    case kLSRegFieldMounted:
+      return *(const int *)ma != *(const int *)mb;
+    case kLSRegFieldFlags:
+      return *(const unsigned int *)ma != *(const unsigned int *)mb;
+    case kLSRegFieldItems:
+      return _diff_items(*(char * const * const *)ma, *(char * const * const *)mb);
+    default:
+      return 0; // not kept in records
+  }
+}
 
-int lsreg_parse_handler(FILE *f,
-                       char *linebuf, size_t linebufsize,
-                       char *line, size_t linelen,
-                       char *key, size_t keylen,
-                       char *val, size_t vallen,
-                       lsreg_rec_t *record)
+
+// Compares two records of the same type. Returns the mask of the fields
+// which differ and stores their names (dump keys) in names, in mask bit
+// order, terminated by NULL.
+static unsigned int _diff_rec(const lsreg_rec_t *a, const lsreg_rec_t *b,
+                              const char *names[LSREG_FIELD_SLOTS+1])
 {
-  /*
-   char *content_type; // "com.apple.binhex-archive"
-   char *extension;    // "html"
-   char *uri_scheme;  // "http"
-   lsreg_identifier_t roles;        // Canonical identifier, i.e. "com.apple.ical (0x2ab0080)"
-   enum kLSRegHandlerOptions options;
-   */
-  
-  lsreg_handler_t *s = (lsreg_handler_t *)record->rec;
+  const lsreg_field_t *table, *field;
+  unsigned int changed = 0, bit;
+  size_t i, n = 0;
   
-  if( (keylen == 12) && (memcmp(key, "content type", keylen) == 0) ) {
-    s->content_type = strdup(val);
+  switch(a->type) {
+    case kLSRegRecTypeBundle:  table = _bundle_fields; break;
+    case kLSRegRecTypeVolume:  table = _volume_fields; break;
+    case kLSRegRecTypeHandler: table = _handler_fields; break;
+    default:
+      names[0] = NULL;
+      return 0;
   }
-  else if( (keylen == 9) && (memcmp(key, "extension", keylen) == 0) ) {
-    s->extension = strdup(val);
+  
+  for(i = 0; i < LSREG_FIELD_SLOTS; i++) {
+    field = &table[i];
+    if(field->key && field->mask && _diff_field(field, a->rec, b->rec)) {
+      changed |= field->mask;
+    }
   }
-  else if( (keylen == 7) && (memcmp(key, "unknown", keylen) == 0) ) {
-    s->uri_scheme = strdup(val);
+  for(bit = 1; bit && bit <= changed; bit <<= 1) {
+    if(changed & bit) {
+      for(i = 0; i < LSREG_FIELD_SLOTS; i++) {
+        if(table[i].mask == bit) {
+          names[n++] = table[i].key;
+          break;
+        }
+      }
+    }
   }
-  else if( (keylen == 9) && (memcmp(key, "all roles", keylen) == 0) ) {
-    lsreg_identifier_parse(val, vallen, &s->roles);
+  names[n] = NULL;
+  return changed;
+}
+
+
+// Orders records by uid, then type
+static int _diff_keycmp(const lsreg_rec_t *a, const lsreg_rec_t *b) {
+  if(a->uid != b->uid) {
+    return a->uid < b->uid ? -1 : 1;
   }
-  else if( (keylen == 7) && (memcmp(key, "options", keylen) == 0) ) {
-    //vol->options = ...
+  if(a->type != b->type) {
+    return a->type < b->type ? -1 : 1;
   }
-  
-  return kLSRegParseStatusContinue;
+  return 0;
 }
 
 
+// Reads the next record of r into rec, checking that records come in
+// ascending order. Returns 1 if a record was read.
+static int _diff_next(lsreg_reader_t *r, lsreg_rec_t *rec, int *status) {
+  unsigned int uid = rec->uid;
+  enum kLSRegRecType type = rec->type;
+  lsreg_rec_init(rec);
+  if(!lsreg_reader_next(r, rec)) {
+    rec->type = kLSRegRecTypeUnknown;
+    return 0;
+  }
+  if(type != kLSRegRecTypeUnknown && (rec->uid < uid || (rec->uid == uid && rec->type <= type))) {
+    log_error("Records are not in ascending uid order (%u after %u)", rec->uid, uid);
+    *status = -1;
+    return 0;
+  }
+  return 1;
+}
 
-int lsreg_parse_record(FILE *f,
-                       char *linebuf, size_t linebufsize,
-                       lsreg_rec_t *rec)
-{  
-  char *line, *keyend, *key, *val;
-  size_t linelen, keylen, vallen;
-  int passed_main;
-  enum kLSRegParseStatus status;
-  lsreg_parser_func *parser;
+
+// Diff the records of two readers
+int lsreg_diff(lsreg_reader_t *a, lsreg_reader_t *b, lsreg_diff_cb *cb, void *something) {
+  lsreg_rec_t ra, rb;
+  const char *names[LSREG_FIELD_SLOTS+1];
+  unsigned int changed;
+  int has_a, has_b, d, status = 0;
   
-  // Init
-  passed_main = 0;
-  status = kLSRegParseStatusContinue;
-  rec->type = kLSRegRecTypeUnknown;
-  parser = NULL;
+  lsreg_rec_init(&ra);
+  lsreg_rec_init(&rb);
+  has_a = _diff_next(a, &ra, &status);
+  has_b = _diff_next(b, &rb, &status);
   
-  // Detect record type
-  if((line = _readline(linebuf, linebufsize, f)) == NULL) {
-    return 1; // done!
-  }
-  linelen = strlen(line);
-  if(linelen > 7) {
-    // Parse id
-    rec->uid = (unsigned int)atoi(strchr(line, ':')+1);
+  while(status == 0 && (has_a || has_b)) {
+    if(!has_b) {
+      d = -1;
+    }
+    else if(!has_a) {
+      d = 1;
+    }
+    else {
+      d = _diff_keycmp(&ra, &rb);
+    }
     
-    if(memcmp(line, "bundle", 6) == 0) {
-      rec->type = kLSRegRecTypeBundle;
-      rec->rec = malloc(sizeof(lsreg_bundle_t));
-      lsreg_bundle_init((lsreg_bundle_t *)rec->rec);
-      ((lsreg_bundle_t *)rec->rec)->uid = rec->uid;
-      parser = lsreg_parse_bundle;
+    if(d < 0) {
+      names[0] = NULL;
+      if(cb(kLSRegDiffRemoved, &ra, NULL, 0, names, something)) {
+        break;
+      }
+      has_a = _diff_next(a, &ra, &status);
     }
-    else if(memcmp(line, "volume", 6) == 0) {
-      rec->type = kLSRegRecTypeVolume;
-      rec->rec = malloc(sizeof(lsreg_volume_t));
-      lsreg_volume_init((lsreg_volume_t *)rec->rec);
-      ((lsreg_volume_t *)rec->rec)->uid = rec->uid;
-      parser = lsreg_parse_volume;
+    else if(d > 0) {
+      names[0] = NULL;
+      if(cb(kLSRegDiffAdded, NULL, &rb, 0, names, something)) {
+        break;
+      }
+      has_b = _diff_next(b, &rb, &status);
     }
-    else if(memcmp(line, "handler", 7) == 0) {
-      rec->type = kLSRegRecTypeHandler;
-      rec->rec = malloc(sizeof(lsreg_handler_t));
-      lsreg_handler_init((lsreg_handler_t *)rec->rec);
-      ((lsreg_handler_t *)rec->rec)->uid = rec->uid;
-      parser = lsreg_parse_handler;
+    else {
+      // Equal fingerprints mean equal content, without comparing fields
+      if((ra.fingerprint == 0 || ra.fingerprint != rb.fingerprint) &&
+         (changed = _diff_rec(&ra, &rb, names)) &&
+         cb(kLSRegDiffChanged, &ra, &rb, changed, names, something))
+      {
+        break;
+      }
+      has_a = _diff_next(a, &ra, &status);
+      has_b = _diff_next(b, &rb, &status);
     }
   }
+  return status;
+}
+
+
+// ---------------------------------------------
+#pragma mark -
+#pragma mark Column export
+
+// See lsreg_columns_header_t for the layout of a column file
+
+#define LSREG_COLUMNS_MAGIC "lsregcol"
+#define LSREG_COLUMNS_VERSION 1
+
+enum {
+  _COL_BUNDLE_UID = 0,
+  _COL_BUNDLE_FINGERPRINT,
+  _COL_BUNDLE_IDENTIFIER,
+  _COL_BUNDLE_IDENTIFIER_HASH,
+  _COL_BUNDLE_CANONICAL_IDENTIFIER,
+  _COL_BUNDLE_CANONICAL_IDENTIFIER_HASH,
+  _COL_BUNDLE_PATH,
+  _COL_BUNDLE_NAME,
+  _COL_BUNDLE_VERSION,
+  _COL_BUNDLE_TYPE_CODE,
+  _COL_BUNDLE_EXECUTABLE,
+  _COL_BUNDLE_ICON,
+  _COL_BUNDLE_LIBRARY,
+  _COL_BUNDLE_REGDATE,
+  _COL_BUNDLE_MODDATE,
+  _COL_BUNDLE_LIBRARY_ITEMS,
+  _COL_BUNDLE_LIBRARY_ITEM,
+  _COL_VOLUME_UID,
+  _COL_VOLUME_FINGERPRINT,
+  _COL_VOLUME_PATH,
+  _COL_VOLUME_DISK_IMAGE,
+  _COL_VOLUME_MOUNTED,
+  _COL_VOLUME_VREFNUM,
+  _COL_VOLUME_FLAGS,
+  _COL_HANDLER_UID,
+  _COL_HANDLER_FINGERPRINT,
+  _COL_HANDLER_CONTENT_TYPE,
+  _COL_HANDLER_EXTENSION,
+  _COL_HANDLER_URI_SCHEME,
+  _COL_HANDLER_ROLES,
+  _COL_HANDLER_ROLES_HASH,
+  _COL_HANDLER_OPTIONS,
+  _COL_COUNT
+};
+
+// Name, encoding and integer width of each column. String columns become
+// kLSRegColumnDictionary when that is smaller.
+static const struct {
+  const char *name;
+  uint8_t encoding;
+  uint8_t width;
+} _columns[_COL_COUNT] = {
+  [_COL_BUNDLE_UID]                       = { "bundle.uid",                       kLSRegColumnUInt,   4 },
+  [_COL_BUNDLE_FINGERPRINT]               = { "bundle.fingerprint",               kLSRegColumnUInt,   8 },
+  [_COL_BUNDLE_IDENTIFIER]                = { "bundle.identifier",                kLSRegColumnString, 0 },
+  [_COL_BUNDLE_IDENTIFIER_HASH]           = { "bundle.identifier_hash",           kLSRegColumnUInt,   4 },
+  [_COL_BUNDLE_CANONICAL_IDENTIFIER]      = { "bundle.canonical_identifier",      kLSRegColumnString, 0 },
+  [_COL_BUNDLE_CANONICAL_IDENTIFIER_HASH] = { "bundle.canonical_identifier_hash", kLSRegColumnUInt,   4 },
+  [_COL_BUNDLE_PATH]                      = { "bundle.path",                      kLSRegColumnString, 0 },
+  [_COL_BUNDLE_NAME]                      = { "bundle.name",                      kLSRegColumnString, 0 },
+  [_COL_BUNDLE_VERSION]                   = { "bundle.version",                   kLSRegColumnString, 0 },
+  [_COL_BUNDLE_TYPE_CODE]                 = { "bundle.type_code",                 kLSRegColumnUInt,   4 },
+  [_COL_BUNDLE_EXECUTABLE]                = { "bundle.executable",                kLSRegColumnString, 0 },
+  [_COL_BUNDLE_ICON]                      = { "bundle.icon",                      kLSRegColumnString, 0 },
+  [_COL_BUNDLE_LIBRARY]                   = { "bundle.library",                   kLSRegColumnString, 0 },
+  [_COL_BUNDLE_REGDATE]                   = { "bundle.regdate",                   kLSRegColumnInt,    8 },
+  [_COL_BUNDLE_MODDATE]                   = { "bundle.moddate",                   kLSRegColumnInt,    8 },
+  [_COL_BUNDLE_LIBRARY_ITEMS]             = { "bundle.library_items",             kLSRegColumnList,   4 },
+  [_COL_BUNDLE_LIBRARY_ITEM]              = { "bundle.library_items.item",        kLSRegColumnString, 0 },
+  [_COL_VOLUME_UID]                       = { "volume.uid",                       kLSRegColumnUInt,   4 },
+  [_COL_VOLUME_FINGERPRINT]               = { "volume.fingerprint",               kLSRegColumnUInt,   8 },
+  [_COL_VOLUME_PATH]                      = { "volume.path",                      kLSRegColumnString, 0 },
+  [_COL_VOLUME_DISK_IMAGE]                = { "volume.disk_image",                kLSRegColumnString, 0 },
+  [_COL_VOLUME_MOUNTED]                   = { "volume.mounted",                   kLSRegColumnUInt,   1 },
+  [_COL_VOLUME_VREFNUM]                   = { "volume.vrefnum",                   kLSRegColumnInt,    4 },
+  [_COL_VOLUME_FLAGS]                     = { "volume.flags",                     kLSRegColumnUInt,   4 },
+  [_COL_HANDLER_UID]                      = { "handler.uid",                      kLSRegColumnUInt,   4 },
+  [_COL_HANDLER_FINGERPRINT]              = { "handler.fingerprint",              kLSRegColumnUInt,   8 },
+  [_COL_HANDLER_CONTENT_TYPE]             = { "handler.content_type",             kLSRegColumnString, 0 },
+  [_COL_HANDLER_EXTENSION]                = { "handler.extension",                kLSRegColumnString, 0 },
+  [_COL_HANDLER_URI_SCHEME]               = { "handler.uri_scheme",               kLSRegColumnString, 0 },
+  [_COL_HANDLER_ROLES]                    = { "handler.roles",                    kLSRegColumnString, 0 },
+  [_COL_HANDLER_ROLES_HASH]               = { "handler.roles_hash",               kLSRegColumnUInt,   4 },
+  [_COL_HANDLER_OPTIONS]                  = { "handler.options",                  kLSRegColumnUInt,   4 },
+};
+
+
+// Column being built. The values of a string column are always collected
+// as a dictionary of distinct strings and a uint32_t code per row, and
+// expanded to plain strings when written if that is smaller.
+typedef struct {
+  size_t rows;
+  char *data;               // integers, list offsets or string codes
+  size_t data_size, data_cap;
+  char *bytes;              // distinct strings, back to back
+  size_t bytes_size, bytes_cap;
+  uint32_t *offsets;        // nvalues+1 offsets into bytes
+  size_t nvalues, offsets_cap;
+  uint32_t *hash;           // open addressing table of value index + 1
+  size_t hash_cap;
+  uint64_t strings_size;    // bytes of the strings of all rows
+} lsreg_columns_col_t;
+
+typedef struct {
+  lsreg_columns_col_t cols[_COL_COUNT];
+  int failed;
+} lsreg_columns_writer_t;
+
+
+// Grows *ptr to hold at least size bytes
+static int _columns_reserve(lsreg_columns_writer_t *w, void **ptr, size_t size, size_t *cap) {
+  void *p;
+  size_t newcap;
+  if(size <= *cap) {
+    return 0;
+  }
+  for(newcap = *cap ? *cap * 2 : 1024; newcap < size; newcap *= 2) {}
+  if((p = realloc(*ptr, newcap)) == NULL) {
+    w->failed = 1;
+    return -1;
+  }
+  *ptr = p;
+  *cap = newcap;
+  return 0;
+}
+
+
+static void _columns_append(lsreg_columns_writer_t *w, lsreg_columns_col_t *col,
+                            const void *ptr, size_t size)
+{
+  if(_columns_reserve(w, (void **)&col->data, col->data_size + size, &col->data_cap) == 0) {
+    memcpy(col->data + col->data_size, ptr, size);
+    col->data_size += size;
+  }
+}
+
+
+// Adds an integer row, truncated to the width of the column
+static void _columns_int(lsreg_columns_writer_t *w, int column, uint64_t v) {
+  lsreg_columns_col_t *col = &w->cols[column];
+  uint8_t v8 = (uint8_t)v;
+  uint16_t v16 = (uint16_t)v;
+  uint32_t v32 = (uint32_t)v;
   
-  if(parser == NULL) {
-    log_error("Unsupported record type");
-    return kLSRegParseStatusDone;
+  switch(_columns[column].width) {
+    case 1: _columns_append(w, col, &v8, 1); break;
+    case 2: _columns_append(w, col, &v16, 2); break;
+    case 4: _columns_append(w, col, &v32, 4); break;
+    default: _columns_append(w, col, &v, 8); break;
   }
+  col->rows++;
+}
+
+
+// Adds a string row. NULL is stored as an empty string.
+static void _columns_str(lsreg_columns_writer_t *w, int column, const char *s) {
+  lsreg_columns_col_t *col = &w->cols[column];
+  size_t len, i, mask;
+  uint32_t index;
   
-  while( (line = _readline(linebuf, linebufsize, f)) ) {
-    linelen = strlen(line);
-    
-    if(linelen == 0) {
-      // Skip empty line
-      continue;
+  if(w->failed) {
+    return;
+  }
+  if(s == NULL) {
+    s = "";
+  }
+  len = strlen(s);
+  
+  // Grow the hash table at 50% load
+  if((col->nvalues+1)*2 > col->hash_cap) {
+    size_t newcap = col->hash_cap ? col->hash_cap * 2 : 256;
+    uint32_t *newhash;
+    if((newhash = (uint32_t *)calloc(newcap, sizeof(uint32_t))) == NULL) {
+      w->failed = 1;
+      return;
     }
-    
-    if(line[0] == '-') {
-      // End of section
+    for(index = 0; index < col->nvalues; index++) {
+      i = _strhash(col->bytes + col->offsets[index],
+                   col->offsets[index+1] - col->offsets[index]) & (newcap-1);
+      while(newhash[i]) {
+        i = (i+1) & (newcap-1);
+      }
+      newhash[i] = index+1;
+    }
+    free(col->hash);
+    col->hash = newhash;
+    col->hash_cap = newcap;
+  }
+  
+  mask = col->hash_cap-1;
+  for(i = _strhash(s, len) & mask; (index = col->hash[i]); i = (i+1) & mask) {
+    index--;
+    if(col->offsets[index+1] - col->offsets[index] == len &&
+       memcmp(col->bytes + col->offsets[index], s, len) == 0)
+    {
       break;
     }
-    
-    if(passed_main) {
-      // Passed main info - read off remaining lines
-      continue;
+  }
+  
+  if(col->hash[i] == 0) {
+    // New value
+    if(col->bytes_size + len > UINT32_MAX ||
+       _columns_reserve(w, (void **)&col->bytes, col->bytes_size + len, &col->bytes_cap) != 0 ||
+       _columns_reserve(w, (void **)&col->offsets, (col->nvalues+2)*sizeof(uint32_t),
+                        &col->offsets_cap) != 0)
+    {
+      w->failed = 1;
+      return;
     }
-    
-    if(linelen > 1 && line[0] == '\t' && line[1] == '-') {
-      // End of main info
-      passed_main = 1;
-      continue;
+    if(len) {
+      memcpy(col->bytes + col->bytes_size, s, len);
     }
-    
-    // Now, a line passed all checks down here is probably a key-value pair.
-    if((keyend = (char *)memchr(line, ':', linelen)) == NULL) {
-      log_error("Unable to parse line '%s'", line);
-      continue;
+    col->offsets[0] = 0;
+    col->bytes_size += len;
+    index = (uint32_t)col->nvalues++;
+    col->offsets[col->nvalues] = (uint32_t)col->bytes_size;
+    col->hash[i] = index+1;
+  }
+  
+  _columns_append(w, col, &index, sizeof(index));
+  col->strings_size += len;
+  col->rows++;
+}
+
+
+static void _columns_add(lsreg_columns_writer_t *w, lsreg_rec_t *rec) {
+  switch(rec->type) {
+    case kLSRegRecTypeBundle: {
+      lsreg_bundle_t *b = (lsreg_bundle_t *)rec->rec;
+      lsreg_columns_col_t *items = &w->cols[_COL_BUNDLE_LIBRARY_ITEM];
+      uint32_t end;
+      char **item;
+      _columns_int(w, _COL_BUNDLE_UID, b->uid);
+      _columns_int(w, _COL_BUNDLE_FINGERPRINT, rec->fingerprint);
+      _columns_str(w, _COL_BUNDLE_IDENTIFIER, b->identifier.name);
+      _columns_int(w, _COL_BUNDLE_IDENTIFIER_HASH, b->identifier.hash);
+      _columns_str(w, _COL_BUNDLE_CANONICAL_IDENTIFIER, b->canonical_identifier.name);
+      _columns_int(w, _COL_BUNDLE_CANONICAL_IDENTIFIER_HASH, b->canonical_identifier.hash);
+      _columns_str(w, _COL_BUNDLE_PATH, b->path);
+      _columns_str(w, _COL_BUNDLE_NAME, b->name);
+      _columns_str(w, _COL_BUNDLE_VERSION, b->version);
+      _columns_int(w, _COL_BUNDLE_TYPE_CODE, b->type_code);
+      _columns_str(w, _COL_BUNDLE_EXECUTABLE, b->executable);
+      _columns_str(w, _COL_BUNDLE_ICON, b->icon);
+      _columns_str(w, _COL_BUNDLE_LIBRARY, b->library);
+      _columns_int(w, _COL_BUNDLE_REGDATE, (uint64_t)(int64_t)b->regdate);
+      _columns_int(w, _COL_BUNDLE_MODDATE, (uint64_t)(int64_t)b->moddate);
+      for(item = b->library_items; item && *item; item++) {
+        _columns_str(w, _COL_BUNDLE_LIBRARY_ITEM, *item);
+      }
+      end = (uint32_t)items->rows;
+      _columns_append(w, &w->cols[_COL_BUNDLE_LIBRARY_ITEMS], &end, sizeof(end));
+      w->cols[_COL_BUNDLE_LIBRARY_ITEMS].rows++;
+      break;
     }
-    
-    // Find key and value
-    keylen = keyend-line;
-    vallen = linelen-keylen-1; // -1 is for ':'
-    val = line;
-    val += keylen+1;
-    val = _memltrim(val, &vallen);
-    if(vallen) {
-      vallen--; // Remove LN and...
-      val[vallen] = '\0'; // ...replace it with \0
+    case kLSRegRecTypeVolume: {
+      lsreg_volume_t *v = (lsreg_volume_t *)rec->rec;
+      _columns_int(w, _COL_VOLUME_UID, v->uid);
+      _columns_int(w, _COL_VOLUME_FINGERPRINT, rec->fingerprint);
+      _columns_str(w, _COL_VOLUME_PATH, v->path);
+      _columns_str(w, _COL_VOLUME_DISK_IMAGE, v->disk_image);
+      _columns_int(w, _COL_VOLUME_MOUNTED, v->is_mounted ? 1 : 0);
+      _columns_int(w, _COL_VOLUME_VREFNUM, (uint64_t)(int64_t)v->vrefnum);
+      _columns_int(w, _COL_VOLUME_FLAGS, v->flags);
+      break;
     }
-    key = _memltrim(line, &keylen);
-    
-    // Handle key-value assignment record type-wise...
-    status = parser(f, linebuf, linebufsize,
-                    line, linelen,
-                    key, keylen,
-                    val, vallen,
-                    rec);
-    
-    // If not continue, stop and return
-    if(status != kLSRegParseStatusContinue) {
-      return status;
+    case kLSRegRecTypeHandler: {
+      lsreg_handler_t *h = (lsreg_handler_t *)rec->rec;
+      _columns_int(w, _COL_HANDLER_UID, h->uid);
+      _columns_int(w, _COL_HANDLER_FINGERPRINT, rec->fingerprint);
+      _columns_str(w, _COL_HANDLER_CONTENT_TYPE, h->content_type);
+      _columns_str(w, _COL_HANDLER_EXTENSION, h->extension);
+      _columns_str(w, _COL_HANDLER_URI_SCHEME, h->uri_scheme);
+      _columns_str(w, _COL_HANDLER_ROLES, h->roles.name);
+      _columns_int(w, _COL_HANDLER_ROLES_HASH, h->roles.hash);
+      _columns_int(w, _COL_HANDLER_OPTIONS, h->options);
+      break;
     }
+    default:
+      break;
   }
-  
-  return (line == NULL) ? kLSRegParseStatusDone : kLSRegParseStatusContinue;
 }
 
 
-void lsreg_parse(FILE *f) {
-  size_t skip_lines;
-  enum kLSRegParseStatus status;
-  char *linebuf;
-  const size_t linebufsize = 1024;
+// Decides how a column is written and returns the size of its data block
+static uint64_t _columns_layout(lsreg_columns_col_t *col, int column, lsreg_column_t *c) {
+  uint64_t plain, dict;
   
-  linebuf = (char *)malloc(sizeof(char)*linebufsize+1);
-  skip_lines = 3;
+  memset(c, 0, sizeof(*c));
+  strncpy(c->name, _columns[column].name, sizeof(c->name)-1);
+  c->rows = (uint32_t)col->rows;
+  c->encoding = _columns[column].encoding;
+  c->width = _columns[column].width;
   
-  while(skip_lines--) {
-    if(_readline(linebuf, linebufsize, f) == NULL) {
-      // error occured
-      free(linebuf);
-      return;
-    }
+  if(c->encoding == kLSRegColumnList) {
+    return sizeof(uint32_t) * (col->rows + 1);
   }
-  
-  // Parse sections
-  do {
-    
-    lsreg_rec_t record;
-    lsreg_rec_init(&record);
-    status = lsreg_parse_record(f, linebuf, linebufsize, &record);
-    lsreg_rec_dump(&record, stdout);
-    lsreg_rec_free_members(&record);
-    
-    /*
-        
-    lsreg_bundle_t bundle;
-    lsreg_bundle_init(&bundle);
-    done = lsreg_parse_bundle_section(f, linebuf, linebufsize, &bundle);
-    //if(bundle.library_items)
-    lsreg_bundle_dump(&bundle, stdout);*/
-    
-  } while(status == kLSRegParseStatusContinue);
-  
-  free(linebuf);
+  if(c->encoding != kLSRegColumnString) {
+    return col->data_size;
+  }
+  c->width = col->nvalues <= 0x100 ? 1 : col->nvalues <= 0x10000 ? 2 : 4;
+  plain = sizeof(uint32_t) * (col->rows + 1) + col->strings_size;
+  dict = sizeof(uint32_t) * (col->nvalues + 2) + (uint64_t)c->width * col->rows + col->bytes_size;
+  if(dict < plain) {
+    c->encoding = kLSRegColumnDictionary;
+    return dict;
+  }
+  c->width = 0;
+  return plain;
 }
 
 
-// Open registry dump
-FILE *lsreg_regdump_open() {
-  FILE *f;
-  if((f = popen(kLSRegisterCmd, "r")) == NULL) {
-    int errnum = ferror(f);
-    if(errnum) {
-      log_error("Failed to open regdump: %s", strerror(errnum));
-    } else {
-      log_error("Failed to open regdump");
+// Writes a string column's codes as c->width byte integers (dictionary)
+// or its strings with their offsets (plain)
+static int _columns_fwrite_strings(lsreg_columns_col_t *col, lsreg_column_t *c, FILE *f) {
+  const uint32_t *codes = (const uint32_t *)col->data;
+  uint32_t chunk[1024];
+  uint32_t nvalues = (uint32_t)col->nvalues;
+  uint32_t empty = 0;
+  uint64_t off = 0;
+  size_t i, n, k;
+  
+  if(c->encoding == kLSRegColumnDictionary) {
+    if(fwrite(&nvalues, sizeof(nvalues), 1, f) != 1 ||
+       fwrite(nvalues ? col->offsets : &empty, sizeof(uint32_t), nvalues + 1, f) != nvalues + 1)
+    {
+      return -1;
+    }
+    for(i = 0; i < col->rows; i += n) {
+      n = col->rows - i < 1024 ? col->rows - i : 1024;
+      for(k = 0; k < n; k++) {
+        switch(c->width) {
+          case 1: ((uint8_t *)chunk)[k] = (uint8_t)codes[i+k]; break;
+          case 2: ((uint16_t *)chunk)[k] = (uint16_t)codes[i+k]; break;
+          default: chunk[k] = codes[i+k]; break;
+        }
+      }
+      if(fwrite(chunk, c->width, n, f) != n) {
+        return -1;
+      }
     }
+    return (col->bytes_size && fwrite(col->bytes, 1, col->bytes_size, f) != col->bytes_size) ? -1 : 0;
   }
-  return f;
+  
+  if(col->strings_size > UINT32_MAX) {
+    errno = EFBIG;
+    return -1;
+  }
+  for(i = 0; i <= col->rows; i += n) {
+    n = col->rows + 1 - i < 1024 ? col->rows + 1 - i : 1024;
+    for(k = 0; k < n; k++) {
+      chunk[k] = (uint32_t)off;
+      if(i+k < col->rows) {
+        off += col->offsets[codes[i+k]+1] - col->offsets[codes[i+k]];
+      }
+    }
+    if(fwrite(chunk, sizeof(uint32_t), n, f) != n) {
+      return -1;
+    }
+  }
+  for(i = 0; i < col->rows; i++) {
+    n = col->offsets[codes[i]+1] - col->offsets[codes[i]];
+    if(n && fwrite(col->bytes + col->offsets[codes[i]], 1, n, f) != n) {
+      return -1;
+    }
+  }
+  return 0;
 }
 
 
-// Close registry dump
-void lsreg_regdump_close(FILE *f) {
-  pclose(f);
+static int _columns_save(lsreg_columns_writer_t *w, FILE *f) {
+  static const char zeros[8] = {0};
+  lsreg_columns_header_t h;
+  lsreg_column_t table[_COL_COUNT];
+  uint64_t sizes[_COL_COUNT];
+  uint64_t offset;
+  uint32_t zero = 0;
+  int i, status = 0;
+  
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, LSREG_COLUMNS_MAGIC, sizeof(h.magic));
+  h.version = LSREG_COLUMNS_VERSION;
+  h.byte_order = LSREG_SNAPSHOT_BYTE_ORDER;
+  h.ncolumns = _COL_COUNT;
+  
+  offset = _SNAPSHOT_ALIGN(sizeof(h) + sizeof(table));
+  for(i = 0; i < _COL_COUNT; i++) {
+    sizes[i] = _columns_layout(&w->cols[i], i, &table[i]);
+    table[i].offset = offset;
+    table[i].size = sizes[i];
+    offset += _SNAPSHOT_ALIGN(sizes[i]);
+  }
+  
+  if(_snapshot_fwrite(f, &h, sizeof(h)) != 0 ||
+     _snapshot_fwrite(f, table, sizeof(table)) != 0)
+  {
+    status = -1;
+  }
+  for(i = 0; status == 0 && i < _COL_COUNT; i++) {
+    lsreg_columns_col_t *col = &w->cols[i];
+    switch(table[i].encoding) {
+      case kLSRegColumnString:
+      case kLSRegColumnDictionary:
+        status = _columns_fwrite_strings(col, &table[i], f);
+        break;
+      case kLSRegColumnList:
+        // The first offset is always 0
+        if(fwrite(&zero, sizeof(zero), 1, f) != 1) {
+          status = -1;
+        }
+        // fall through
+      default:
+        if(col->data_size && fwrite(col->data, 1, col->data_size, f) != col->data_size) {
+          status = -1;
+        }
+        break;
+    }
+    if(status == 0 && _SNAPSHOT_ALIGN(sizes[i]) != sizes[i] &&
+       fwrite(zeros, 1, _SNAPSHOT_ALIGN(sizes[i]) - sizes[i], f) != _SNAPSHOT_ALIGN(sizes[i]) - sizes[i])
+    {
+      status = -1;
+    }
+  }
+  if(status == 0 && fflush(f) != 0) {
+    status = -1;
+  }
+  if(status != 0) {
+    log_error("Failed to write columns: %s", strerror(errno));
+  }
+  return status;
 }
 
 
-// Iterate records, calling factory_cb and handler_cb for each record.
-void lsreg_iterate(lsreg_rec_factory_cb *factory_cb,
-                   lsreg_rec_handler_cb *handler_cb,
-                   void *something)
-{
-  FILE *f;
-  size_t skip_lines;
-  enum kLSRegParseStatus status;
-  char *linebuf;
-  const size_t linebufsize = 1024;
+// Write the records read from r to f as a column file
+int lsreg_columns_write(lsreg_reader_t *r, FILE *f) {
+  lsreg_columns_writer_t w;
+  lsreg_reader_t *r2 = NULL;
+  lsreg_rec_t rec;
+  int status = -1;
+  int i;
   
-  if((f = lsreg_regdump_open()) == NULL) {
-    return;
+  if(r == NULL && (r = r2 = lsreg_reader_open_regdump()) == NULL) {
+    return -1;
   }
-  linebuf = (char *)malloc(sizeof(char)*linebufsize+1);
-  skip_lines = 3;
   
-  while(skip_lines--) {
-    if(_readline(linebuf, linebufsize, f) == NULL) {
-      // error occured
-      free(linebuf);
-      return;
-    }
+  memset(&w, 0, sizeof(w));
+  lsreg_rec_init(&rec);
+  while(!w.failed && lsreg_reader_next(r, &rec)) {
+    _columns_add(&w, &rec);
+    lsreg_rec_init(&rec);
   }
   
-  // Parse sections
-  do {
-    lsreg_rec_t *record = factory_cb(something);
-    lsreg_rec_init(record);
-    status = lsreg_parse_record(f, linebuf, linebufsize, record);
-    //lsreg_rec_dump(&record, stdout);
-    if(handler_cb(record, something)) {
-      break;
-    }
-  } while(status == kLSRegParseStatusContinue);
+  if(w.failed || w.cols[_COL_BUNDLE_LIBRARY_ITEM].rows > UINT32_MAX) {
+    log_error("Failed to build columns: out of memory");
+  }
+  else {
+    status = _columns_save(&w, f);
+  }
   
-  free(linebuf);
-  lsreg_regdump_close(f);
+  for(i = 0; i < _COL_COUNT; i++) {
+    free(w.cols[i].data);
+    free(w.cols[i].bytes);
+    free(w.cols[i].offsets);
+    free(w.cols[i].hash);
+  }
+  if(r2) {
+    lsreg_reader_close(r2);
+  }
+  return status;
 }
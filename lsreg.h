@@ -30,6 +30,8 @@
 #define LIBLSREG_VERSION "0.1.0"
 
 #include <stdio.h>
+#include <stdint.h>
+#include <time.h>
 
 #pragma mark -
 #pragma mark Constants
@@ -45,6 +47,14 @@ enum kLSRegRecType {
   kLSRegRecTypeHandler
 };
 
+// Record type masks, for use with lsreg_reader_set_types()
+enum kLSRegRecTypeMasks {
+  kLSRegBundleTypeMask  = 1 << kLSRegRecTypeBundle,
+  kLSRegVolumeTypeMask  = 1 << kLSRegRecTypeVolume,
+  kLSRegHandlerTypeMask = 1 << kLSRegRecTypeHandler,
+  kLSRegAllTypesMask    = kLSRegBundleTypeMask | kLSRegVolumeTypeMask | kLSRegHandlerTypeMask
+};
+
 // Parser status
 enum kLSRegParseStatus {
   kLSRegParseStatusContinue = 0,
@@ -58,11 +68,56 @@ enum kLSRegVolumeFlags {
   kLSRegVolumeSystemDeviceFlag = 4
 };
 
+// Record flags
+enum kLSRegRecFlags {
+  // Members are owned by the reader which produced the record and are only
+  // valid until the next record is read. Use lsreg_rec_copy() to own them.
+  kLSRegRecBorrowed = 1
+};
+
 // Handler record options
 enum kLSRegHandlerOptions {
   kLSRegHandlerIgnoreCreator = 1
 };
 
+// Bundle fields, for use in lsreg_fields_t
+enum kLSRegBundleFields {
+  kLSRegBundleIdentifierField            = 1 << 0,
+  kLSRegBundleCanonicalIdentifierField   = 1 << 1,
+  kLSRegBundlePathField                  = 1 << 2,
+  kLSRegBundleNameField                  = 1 << 3,
+  kLSRegBundleVersionField               = 1 << 4,
+  kLSRegBundleTypeCodeField              = 1 << 5,
+  kLSRegBundleExecutableField            = 1 << 6,
+  kLSRegBundleIconField                  = 1 << 7,
+  kLSRegBundleRegDateField               = 1 << 8,
+  kLSRegBundleModDateField               = 1 << 9,
+  kLSRegBundleLibraryField               = 1 << 10,
+  kLSRegBundleLibraryItemsField          = 1 << 11,
+  kLSRegBundlePropertiesField            = 1 << 12
+};
+
+// Volume fields, for use in lsreg_fields_t
+enum kLSRegVolumeFields {
+  kLSRegVolumePathField                  = 1 << 0,
+  kLSRegVolumeDiskImageField             = 1 << 1,
+  kLSRegVolumeIsMountedField             = 1 << 2,
+  kLSRegVolumeVRefNumField               = 1 << 3,
+  kLSRegVolumeFlagsField                 = 1 << 4
+};
+
+// Handler fields, for use in lsreg_fields_t
+enum kLSRegHandlerFields {
+  kLSRegHandlerContentTypeField          = 1 << 0,
+  kLSRegHandlerExtensionField            = 1 << 1,
+  kLSRegHandlerURISchemeField            = 1 << 2,
+  kLSRegHandlerRolesField                = 1 << 3,
+  kLSRegHandlerOptionsField              = 1 << 4
+};
+
+// Selects every field of a record type
+#define LSREG_ALL_FIELDS 0xffffffffU
+
 #pragma mark -
 #pragma mark Types
 
@@ -70,6 +125,8 @@ enum kLSRegHandlerOptions {
 typedef struct {
   unsigned int uid; // registry database unique id
   enum kLSRegRecType type;
+  int flags;        // kLSRegRecFlags
+  uint64_t fingerprint; // hash of the record's content (see below), or 0
   void *rec;
 } lsreg_rec_t;
 
@@ -79,21 +136,31 @@ typedef struct {
   unsigned int hash; // 0x8000a10b
 } lsreg_identifier_t;
 
+// Bytes of inline storage for short strings in lsreg_bundle_t
+#define LSREG_BUNDLE_INLINE_SIZE 31
+
 // Bundle record
+// 
+// name and version point into the bundle's own strings when they are
+// short enough, so a bundle must be copied with lsreg_bundle_copy().
 typedef struct {
   unsigned int uid;       // registry database unique id
+  uint32_t type_code;     // 'APPL' as a four-character code, 0 if unknown
   lsreg_identifier_t identifier;           // "foo.bar.SomeThing", 0x8000a10b
   lsreg_identifier_t canonical_identifier; // "foo.bar.something", 0x8000e20a
   char *path;            // /Applications/Foo Bar.app
   char *name;            // "Foo Bar"
   char *version;         // Might be "123", "1.2.3" (or anything, really)
-  char *type_code;       // "APPL"
   char *executable;      // "Contents/MacOS/Slides"
   char *icon;            // "Contents/Resources/PPIcon.icns"
-  struct tm *regdate;    // registration time
-  struct tm *moddate;    // modification time
+  time_t regdate;        // registration time, 0 if unknown
+  time_t moddate;        // modification time, 0 if unknown
   char *library;         // "Contents/Library/"
   char **library_items;  // NULL terminated list of "library items". NULL if no items.
+  char *properties;      // Info.plist XML document. NULL if none. (see lsreg_bundle_property())
+  size_t properties_len;
+  unsigned char strings_used;                  // bytes used of strings
+  char strings[LSREG_BUNDLE_INLINE_SIZE];      // inline storage for name and version
 } lsreg_bundle_t;
 
 // Volume record
@@ -114,8 +181,28 @@ typedef struct {
   char *uri_scheme;  // "http"
   lsreg_identifier_t roles;        // Canonical identifier, i.e. "com.apple.ical (0x2ab0080)"
   enum kLSRegHandlerOptions options;
+  lsreg_bundle_t *bundle; // Bundle of roles, resolved by lsreg_db_open(). NULL otherwise.
 } lsreg_handler_t;
 
+// Field projection. Each member is a mask of the fields to decode for
+// records of that type (kLSRegBundleFields, kLSRegVolumeFields and
+// kLSRegHandlerFields respectively). Fields outside the mask are skipped
+// and left NULL or 0. uid is always set.
+// 
+// See: lsreg_reader_set_fields(), lsreg_iterate_fields()
+typedef struct {
+  unsigned int bundle;
+  unsigned int volume;
+  unsigned int handler;
+} lsreg_fields_t;
+
+// Registry dump reader. A reader produces records from one source: the
+// output of kLSRegisterCmd, a captured dump file, a file descriptor or an
+// in-memory buffer.
+// 
+// See: lsreg_reader_open_regdump(), lsreg_iterate_reader()
+typedef struct lsreg_reader lsreg_reader_t;
+
 // Record factory callback.
 // If an old record is reused, make sure to call lsreg_rec_free_members()
 // on it, before returning it using this callback.
@@ -126,7 +213,9 @@ typedef lsreg_rec_t *lsreg_rec_factory_cb(void *something);
 // Record handler callback.
 // Iteration ends on non-zero return.
 // You are responsible for freeing the record, whis is the one which 
-// was previously returned/created by lsreg_rec_factory_cb()
+// was previously returned/created by lsreg_rec_factory_cb(). Its members
+// are borrowed from the iteration and are only valid until the callback
+// returns -- use lsreg_rec_copy() to keep them.
 // 
 // See: lsreg_iterate()
 typedef int lsreg_rec_handler_cb(lsreg_rec_t *record, void *something);
@@ -147,6 +236,10 @@ void lsreg_rec_free_members(lsreg_rec_t *s);
 // Free record and all it's members
 void lsreg_rec_free(lsreg_rec_t *s);
 
+// Deep copy src into dst. dst owns all of its members, even if src was
+// borrowed, and should be freed using lsreg_rec_free_members().
+int lsreg_rec_copy(lsreg_rec_t *dst, const lsreg_rec_t *src);
+
 
 #pragma mark -
 #pragma mark Identifier methods
@@ -157,6 +250,44 @@ int lsreg_identifier_parse(const char *ptr, size_t length, lsreg_identifier_t *s
 void lsreg_identifier_dump(lsreg_identifier_t *s, FILE *stream, const char *indent);
 
 
+#pragma mark -
+#pragma mark Date methods
+
+// Size of the buffer passed to lsreg_date_format()
+#define LSREG_DATE_SIZE 20
+
+// Parse a registry date like "6/26/2006 2:41:56", which is taken to be
+// UTC, into seconds since the epoch. Returns 0 on success.
+int lsreg_date_parse(const char *ptr, size_t length, time_t *date);
+
+// Format date as "YYYY-MM-DD HH:MM:SS" (UTC) into buf, which must hold
+// LSREG_DATE_SIZE bytes. sep is put between the date and the time, i.e.
+// ' ' or 'T'. Returns buf.
+char *lsreg_date_format(time_t date, char sep, char *buf);
+
+// Break date down into tm (UTC). Returns NULL if date is 0 (unknown).
+struct tm *lsreg_date_tm(time_t date, struct tm *tm);
+
+
+#pragma mark -
+#pragma mark Property lists
+
+// Find key in the first dict of an XML property list, which may be a
+// whole document or a "<dict>" element. The document is scanned in place
+// without being parsed into a tree. On success, *value and *value_length
+// delimit the value element, e.g. "<string>10.5</string>" or
+// "<array>...</array>", which can be searched again if it is a dict.
+// Returns 0 if key was found, or 1 if not.
+int lsreg_plist_find(const char *plist, size_t length, const char *key,
+                     const char **value, size_t *value_length);
+
+// Copy the text of a simple value element, like "<string>a &amp; b</string>"
+// or "<integer>3</integer>", into buf with entities decoded. For "<true/>"
+// and "<false/>" the text is "true" or "false". Returns buf, or NULL if
+// the value is an array or dict or does not fit in size bytes.
+char *lsreg_plist_text(const char *value, size_t length, char *buf, size_t size);
+
+
 #pragma mark -
 #pragma mark Bundle record methods
 
@@ -169,9 +300,25 @@ void lsreg_bundle_free_members(lsreg_bundle_t *s);
 // Free bundle and all its members
 void lsreg_bundle_free(lsreg_bundle_t *s);
 
+// Deep copy a bundle
+lsreg_bundle_t *lsreg_bundle_copy(const lsreg_bundle_t *s);
+
 // Dump bundle, in a human readable format, to stream
 void lsreg_bundle_dump(lsreg_bundle_t *bundle, FILE *stream);
 
+// Find key in the properties of bundle (see lsreg_plist_find()).
+// Returns 1 if the bundle has no properties or key is not among them.
+int lsreg_bundle_property(const lsreg_bundle_t *bundle, const char *key,
+                          const char **value, size_t *value_length);
+
+// Size of the buffer passed to lsreg_fourcc_format()
+#define LSREG_FOURCC_SIZE 5
+
+// Format a four-character code like type_code as a string, i.e. "APPL",
+// into buf which must hold LSREG_FOURCC_SIZE bytes. Returns buf, or NULL
+// if code is 0.
+char *lsreg_fourcc_format(uint32_t code, char *buf);
+
 // Set value for key on a bundle.
 // This effectively parses the value into the internal format.
 // For example, if key is "identifier" the value should be in the
@@ -195,6 +342,9 @@ void lsreg_volume_free_members(lsreg_volume_t *s);
 // Free volume and all its members
 void lsreg_volume_free(lsreg_volume_t *s);
 
+// Deep copy a volume
+lsreg_volume_t *lsreg_volume_copy(const lsreg_volume_t *s);
+
 // Dump volume, in a human readable format, to stream
 void lsreg_volume_dump(lsreg_volume_t *s, FILE *stream);
 
@@ -211,6 +361,9 @@ void lsreg_handler_free_members(lsreg_handler_t *s);
 // Free handler and all its members
 void lsreg_handler_free(lsreg_handler_t *s);
 
+// Deep copy a handler
+lsreg_handler_t *lsreg_handler_copy(const lsreg_handler_t *s);
+
 // Dump handler, in a human readable format, to stream
 void lsreg_handler_dump(lsreg_handler_t *s, FILE *stream);
 
@@ -219,28 +372,31 @@ void lsreg_handler_dump(lsreg_handler_t *s, FILE *stream);
 #pragma mark Parsing
 
 // Parse a line of bundle record data
-int lsreg_parse_bundle(FILE *f,
-                       char *linebuf, size_t linebufsize,
+int lsreg_parse_bundle(lsreg_reader_t *r,
                        char *line, size_t linelen,
                        char *key, size_t keylen,
                        char *val, size_t vallen,
                        lsreg_rec_t *record);
 
 // Parse a line of volume record data
-int lsreg_parse_volume(FILE *f,
-                       char *linebuf, size_t linebufsize,
+int lsreg_parse_volume(lsreg_reader_t *r,
                        char *line, size_t linelen,
                        char *key, size_t keylen,
                        char *val, size_t vallen,
                        lsreg_rec_t *record);
 
+// Parse a line of handler record data
+int lsreg_parse_handler(lsreg_reader_t *r,
+                        char *line, size_t linelen,
+                        char *key, size_t keylen,
+                        char *val, size_t vallen,
+                        lsreg_rec_t *record);
+
 // Parse a record beginning on the current line
-int lsreg_parse_record(FILE *f,
-                       char *linebuf, size_t linebufsize,
-                       lsreg_rec_t *rec);
+int lsreg_parse_record(lsreg_reader_t *r, lsreg_rec_t *rec);
 
-// Parse lsregistry output
-void lsreg_parse(FILE *f);
+// Parse records from r and dump them to stdout
+void lsreg_parse(lsreg_reader_t *r);
 
 // Open registry dump
 FILE *lsreg_regdump_open();
@@ -248,12 +404,384 @@ FILE *lsreg_regdump_open();
 // Close registry dump
 void lsreg_regdump_close(FILE *f);
 
+
+#pragma mark -
+#pragma mark String interning
+
+// Table of unique, immutable strings. Content types, library paths, role
+// identifiers and such repeat thousands of times in a registry. When a
+// reader is given a table (see lsreg_reader_set_intern()) those fields
+// share one copy per distinct value, and can be compared by pointer.
+// A table is safe to share between readers and threads.
+typedef struct lsreg_intern lsreg_intern_t;
+
+// Create an empty table
+lsreg_intern_t *lsreg_intern_create();
+
+// Free a table and all of its strings
+void lsreg_intern_free(lsreg_intern_t *t);
+
+// Return the unique copy of the length bytes at ptr, adding it if needed.
+// Returns NULL if out of memory.
+const char *lsreg_intern(lsreg_intern_t *t, const char *ptr, size_t length);
+
+
+#pragma mark -
+#pragma mark Filters
+
+// Compiled record filter. A filter is a list of predicates joined by "and",
+// all of which a record must satisfy:
+// 
+//   type=bundle and identifier^=com.apple. and version<10
+// 
+// Each predicate is a field name, an operator and a value. Fields are
+// named as in the XML and JSON dumps: id, type, identifier,
+// canonical_identifier, path, name, version, type_code, executable, icon,
+// library, disk_image, vrefnum, content_type, extension, uri_scheme and
+// roles. type is one of bundle, volume or handler.
+// 
+// Operators are = and != (equal), ^= (starts with), $= (ends with),
+// *= (contains), and <, <=, > and >=, which compare runs of digits as
+// numbers, so "9.2" < "10.1". A value may be quoted with double quotes to
+// include blanks. Absent fields compare as empty strings, and records of
+// a type which does not have a field never match a predicate on it.
+typedef struct lsreg_filter lsreg_filter_t;
+
+// Compile a filter expression.
+// Returns NULL, and logs the reason, if expr is not a valid filter.
+lsreg_filter_t *lsreg_filter_compile(const char *expr);
+
+// Free a filter
+void lsreg_filter_free(lsreg_filter_t *f);
+
+// Return 1 if rec satisfies f, otherwise 0
+int lsreg_filter_match(const lsreg_filter_t *f, const lsreg_rec_t *rec);
+
+
+#pragma mark -
+#pragma mark Reader methods
+
+// Open a reader on the output of kLSRegisterCmd
+lsreg_reader_t *lsreg_reader_open_regdump();
+
+// Open a reader on a previously captured dump file,
+// i.e. the output of "lsregister -dump > file"
+lsreg_reader_t *lsreg_reader_open_file(const char *path);
+
+// Open a zero-copy reader on a memory-mapped dump file. String members of
+// records read from it point into the mapping rather than being copied.
+lsreg_reader_t *lsreg_reader_open_mmap(const char *path);
+
+// Open a reader on a file descriptor, i.e. a pipe or a socket.
+// fd is left open when the reader is closed.
+lsreg_reader_t *lsreg_reader_open_fd(int fd);
+
+// Open a reader on an in-memory dump. The buffer is not copied and must
+// stay valid until the reader is closed.
+lsreg_reader_t *lsreg_reader_open_buffer(const void *ptr, size_t length);
+
+// Close a reader and free its resources
+void lsreg_reader_close(lsreg_reader_t *r);
+
+// Only decode the fields selected by fields. Pass NULL to decode all
+// fields, which is the default.
+void lsreg_reader_set_fields(lsreg_reader_t *r, const lsreg_fields_t *fields);
+
+// Only produce records of the types in types (kLSRegRecTypeMasks).
+// Sections of other types are skipped without being parsed. The default
+// is kLSRegAllTypesMask.
+void lsreg_reader_set_types(lsreg_reader_t *r, unsigned int types);
+
+// Intern repeated string fields in t, or stop interning if t is NULL.
+// The table must outlive the records read, and any lsreg_db_t opened on
+// r. Snapshots already store each distinct string once and ignore t.
+void lsreg_reader_set_intern(lsreg_reader_t *r, lsreg_intern_t *t);
+
+// Only produce records which satisfy f, or all records if f is NULL.
+// Predicates are evaluated while a record is parsed, as soon as the line
+// of their field is read. A record which fails one is abandoned and the
+// rest of its section is skipped without being parsed. Sections of types
+// f can not match, and predicates on id, are checked before any field is
+// decoded. The filter must outlive the reader.
+void lsreg_reader_set_filter(lsreg_reader_t *r, const lsreg_filter_t *f);
+
+// Read the next record into rec.
+// Returns 1 if a record was read or 0 when there are no more records.
+// The record is flagged kLSRegRecBorrowed and its members are allocated
+// from an arena owned by the reader, which is reset for the next record.
+int lsreg_reader_next(lsreg_reader_t *r, lsreg_rec_t *rec);
+
+
+#pragma mark -
+#pragma mark Iteration
+
+// Iterate records read from r, calling factory_cb and handler_cb for each record.
+void lsreg_iterate_reader(lsreg_reader_t *r,
+                          lsreg_rec_factory_cb *factory_cb,
+                          lsreg_rec_handler_cb *handler_cb,
+                          void *something);
+
 // Iterate records, calling factory_cb and handler_cb for each record.
-void lsreg_iterate(lsreg_rec_factory_cb *factory_cb,
-                   lsreg_rec_handler_cb *handler_cb,
-                   void *something);
+// Returns 0 on success or -1 if the registry dump could not be opened.
+int lsreg_iterate(lsreg_rec_factory_cb *factory_cb,
+                  lsreg_rec_handler_cb *handler_cb,
+                  void *something);
+
+// Like lsreg_iterate(), but only decodes the fields selected by fields.
+// See: lsreg_fields_t
+int lsreg_iterate_fields(const lsreg_fields_t *fields,
+                         lsreg_rec_factory_cb *factory_cb,
+                         lsreg_rec_handler_cb *handler_cb,
+                         void *something);
+
+// Like lsreg_iterate(), but only produces records of the types in types.
+// See: lsreg_reader_set_types()
+int lsreg_iterate_types(unsigned int types,
+                        lsreg_rec_factory_cb *factory_cb,
+                        lsreg_rec_handler_cb *handler_cb,
+                        void *something);
+
+// Like lsreg_iterate(), but reads a captured dump file
+int lsreg_iterate_file(const char *path,
+                       lsreg_rec_factory_cb *factory_cb,
+                       lsreg_rec_handler_cb *handler_cb,
+                       void *something);
+
+// Like lsreg_iterate_file(), but uses a zero-copy reader.
+// See: lsreg_reader_open_mmap()
+int lsreg_iterate_mmap(const char *path,
+                       lsreg_rec_factory_cb *factory_cb,
+                       lsreg_rec_handler_cb *handler_cb,
+                       void *something);
+
+// Like lsreg_iterate(), but reads a dump from a file descriptor
+int lsreg_iterate_fd(int fd,
+                     lsreg_rec_factory_cb *factory_cb,
+                     lsreg_rec_handler_cb *handler_cb,
+                     void *something);
+
+// Like lsreg_iterate(), but reads a dump from memory
+int lsreg_iterate_buffer(const void *ptr, size_t length,
+                         lsreg_rec_factory_cb *factory_cb,
+                         lsreg_rec_handler_cb *handler_cb,
+                         void *something);
 
 // Convenience function which dumps everything in the registry to stdout.
 void lsreg_dump();
 
+
+#pragma mark -
+#pragma mark Parallel iteration
+
+// Parallel iteration flags
+enum kLSRegParallelFlags {
+  // Deliver records in the order they appear in the dump. Otherwise they
+  // are delivered in the order they are parsed, which is faster.
+  kLSRegParallelOrdered = 1
+};
+
+// Iterate records read from r using nthreads threads (0 for one per CPU).
+// The remaining input of r is read into memory and split at section
+// delimiters into chunks which are parsed concurrently. factory_cb and
+// handler_cb are called from the parsing threads, but never concurrently,
+// and records are borrowed as with lsreg_iterate_reader().
+// Returns 0 on success or -1 if the input could not be loaded.
+int lsreg_iterate_reader_parallel(lsreg_reader_t *r, int nthreads, int flags,
+                                  lsreg_rec_factory_cb *factory_cb,
+                                  lsreg_rec_handler_cb *handler_cb,
+                                  void *something);
+
+// Like lsreg_iterate_reader_parallel(), but reads a captured dump file
+// See: lsreg_reader_open_mmap()
+int lsreg_iterate_parallel(const char *path, int nthreads, int flags,
+                           lsreg_rec_factory_cb *factory_cb,
+                           lsreg_rec_handler_cb *handler_cb,
+                           void *something);
+
+// Like lsreg_iterate_reader_parallel(), but reads a dump from memory
+int lsreg_iterate_buffer_parallel(const void *ptr, size_t length,
+                                  int nthreads, int flags,
+                                  lsreg_rec_factory_cb *factory_cb,
+                                  lsreg_rec_handler_cb *handler_cb,
+                                  void *something);
+
+// Iterate records read from r in three stages running concurrently: a
+// thread reading the source, a thread parsing records and the calling
+// thread, which runs factory_cb and handler_cb. Reading lsregister's
+// output, parsing it and handling records thus overlap. Records are
+// delivered in order and borrowed as with lsreg_iterate_reader().
+// Returns 0 on success.
+int lsreg_iterate_reader_pipelined(lsreg_reader_t *r,
+                                   lsreg_rec_factory_cb *factory_cb,
+                                   lsreg_rec_handler_cb *handler_cb,
+                                   void *something);
+
+// Like lsreg_iterate(), but pipelined.
+// See: lsreg_iterate_reader_pipelined()
+int lsreg_iterate_pipelined(lsreg_rec_factory_cb *factory_cb,
+                            lsreg_rec_handler_cb *handler_cb,
+                            void *something);
+
+
+#pragma mark -
+#pragma mark Snapshots
+
+// Write a snapshot of all records read from r to path. If r is NULL, the
+// registry is dumped using kLSRegisterCmd. A snapshot is a binary file
+// with fixed-size record tables and a shared string table, which is
+// opened without parsing (see lsreg_snapshot_open()). path is replaced
+// atomically. Bundle properties are not stored.
+// Returns 0 on success or -1 on failure.
+int lsreg_snapshot_write(lsreg_reader_t *r, const char *path);
+
+// Open a reader on a snapshot written by lsreg_snapshot_write(). The file
+// is memory-mapped and records are read in place, in the order of the
+// original dump. String members point into the mapping.
+// Returns NULL if the file can not be opened or is not a valid snapshot.
+lsreg_reader_t *lsreg_snapshot_open(const char *path);
+
+
+#pragma mark -
+#pragma mark Database
+
+// Database keys
+enum kLSRegDBKey {
+  kLSRegDBBundleUID = 0,
+  kLSRegDBBundleIdentifierHash,
+  kLSRegDBBundleCanonicalIdentifier,
+  kLSRegDBBundlePath,
+  kLSRegDBBundleCanonicalIdentifierHash,
+  kLSRegDBHandlerExtension,
+  kLSRegDBHandlerContentType,
+  kLSRegDBHandlerURIScheme,
+  kLSRegDBKeyCount
+};
+
+// In-memory registry database. All records are loaded once and indexed by
+// each of the kLSRegDBKey keys, which are looked up in constant time.
+// Handlers are joined with the bundle of their role, see
+// lsreg_handler_t.bundle. Records are owned by the database and valid
+// until it is closed.
+typedef struct lsreg_db lsreg_db_t;
+
+// Load all records read from r into a new database, which takes ownership
+// of r. If r is NULL, the registry is dumped using kLSRegisterCmd.
+// Returns NULL on failure.
+lsreg_db_t *lsreg_db_open(lsreg_reader_t *r);
+
+// Close a database and free all of its records
+void lsreg_db_close(lsreg_db_t *db);
+
+// All records of a type, in dump order. The number of records is stored
+// in count.
+lsreg_bundle_t *lsreg_db_bundles(lsreg_db_t *db, size_t *count);
+lsreg_volume_t *lsreg_db_volumes(lsreg_db_t *db, size_t *count);
+lsreg_handler_t *lsreg_db_handlers(lsreg_db_t *db, size_t *count);
+
+// Find the first bundle, in dump order, with a key. Returns NULL if there
+// is none. Several bundles may share a key (i.e. different versions of an
+// application); use lsreg_db_bundle_next() to find the others.
+lsreg_bundle_t *lsreg_db_bundle_by_uid(lsreg_db_t *db, unsigned int uid);
+lsreg_bundle_t *lsreg_db_bundle_by_identifier_hash(lsreg_db_t *db, unsigned int hash);
+lsreg_bundle_t *lsreg_db_bundle_by_canonical_identifier(lsreg_db_t *db, const char *name);
+lsreg_bundle_t *lsreg_db_bundle_by_path(lsreg_db_t *db, const char *path);
+lsreg_bundle_t *lsreg_db_bundle_by_canonical_identifier_hash(lsreg_db_t *db, unsigned int hash);
+
+// Returns the bundle following bundle with the same key, or NULL
+lsreg_bundle_t *lsreg_db_bundle_next(lsreg_db_t *db, const lsreg_bundle_t *bundle, enum kLSRegDBKey key);
+
+// Find the first handler, in dump order, with a key. Returns NULL if
+// there is none. Use lsreg_db_handler_next() to find the others.
+lsreg_handler_t *lsreg_db_handler_by_extension(lsreg_db_t *db, const char *extension);
+lsreg_handler_t *lsreg_db_handler_by_content_type(lsreg_db_t *db, const char *content_type);
+lsreg_handler_t *lsreg_db_handler_by_uri_scheme(lsreg_db_t *db, const char *uri_scheme);
+
+// Returns the handler following handler with the same key, or NULL
+lsreg_handler_t *lsreg_db_handler_next(lsreg_db_t *db, const lsreg_handler_t *handler, enum kLSRegDBKey key);
+
+// Find bundles which identifier starts with prefix, ignoring (ASCII)
+// case. Returns an array of the matching bundles, ordered by identifier,
+// and stores its length in count. The array is owned by the database.
+// A sorted index of case-folded identifiers is built on the first call,
+// after which each call takes O(log n) time.
+lsreg_bundle_t **lsreg_db_find_prefix(lsreg_db_t *db, const char *prefix, size_t *count);
+
+
+#pragma mark -
+#pragma mark Diff
+
+// Kinds of differences
+enum kLSRegDiffKind {
+  kLSRegDiffAdded = 1,   // record only in b
+  kLSRegDiffRemoved,     // record only in a
+  kLSRegDiffChanged      // record in both, with different fields
+};
+
+// Diff callback.
+// a and b are the record in each source (NULL if it is not in that source).
+// For kLSRegDiffChanged, changed is the mask of fields which differ
+// (kLSRegBundleFields, kLSRegVolumeFields or kLSRegHandlerFields) and
+// fields is a NULL terminated list of their names, as they appear in the
+// dump ("path", "canonical id", ...). Records are borrowed as with
+// lsreg_rec_handler_cb. Diffing ends on non-zero return.
+typedef int lsreg_diff_cb(enum kLSRegDiffKind kind,
+                          const lsreg_rec_t *a, const lsreg_rec_t *b,
+                          unsigned int changed, const char * const *fields,
+                          void *something);
+
+// Diff the records of two readers (dumps or snapshots), calling cb for
+// each record which was added, removed or changed from a to b. Records
+// are matched by uid and type in a single pass over both sources, which
+// must list records in ascending uid order, as lsregister does. Only one
+// record of each source is held in memory at a time.
+// Returns 0 on success or -1 if a source is not in ascending uid order.
+int lsreg_diff(lsreg_reader_t *a, lsreg_reader_t *b, lsreg_diff_cb *cb, void *something);
+
+
+#pragma mark -
+#pragma mark Column export
+
+// Column encodings
+enum kLSRegColumnEncoding {
+  kLSRegColumnUInt = 1,   // rows unsigned integers of width bytes
+  kLSRegColumnInt,        // rows signed integers of width bytes
+  kLSRegColumnString,     // uint32_t offsets[rows+1], then the string bytes
+  kLSRegColumnDictionary, // uint32_t count, uint32_t offsets[count+1],
+                          // rows codes of width bytes, then the bytes of
+                          // the count distinct strings
+  kLSRegColumnList        // uint32_t offsets[rows+1] into the rows of the
+                          // next column
+};
+
+// A column file starts with this header, followed by ncolumns
+// lsreg_column_t and the data block of each column. Strings are not NUL
+// terminated and an absent string is empty. Dates are seconds since the
+// epoch, 0 if unknown. Integers are in the byte order of the writer.
+typedef struct {
+  char magic[8];          // "lsregcol"
+  uint32_t version;       // 1
+  uint32_t byte_order;    // 0x01020304
+  uint32_t ncolumns;
+  uint32_t reserved;
+} lsreg_columns_header_t;
+
+typedef struct {
+  char name[40];          // "bundle.identifier", "handler.roles", ...
+  uint32_t rows;          // records of the column's type, or list items
+  uint8_t encoding;       // kLSRegColumnEncoding
+  uint8_t width;          // bytes per integer or dictionary code
+  uint16_t reserved;
+  uint64_t offset;        // of the data block, from the start of the file
+  uint64_t size;          // of the data block
+} lsreg_column_t;
+
+// Write the records read from r to f as a column file, with one column
+// per field and record type. If r is NULL, the registry is dumped using
+// kLSRegisterCmd. String columns are dictionary encoded when that makes
+// them smaller, which it does for fields with few distinct values. Data
+// blocks start at 8 byte boundaries, so a consumer can map the file and
+// read only the columns it needs.
+// Returns 0 on success or -1 on failure.
+int lsreg_columns_write(lsreg_reader_t *r, FILE *f);
+
 #endif
@@ -11,11 +11,18 @@
 #include <stdarg.h>
 #include <string.h>
 #include <time.h>
+#include <signal.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
 
 const char *progname;
 
 static struct {
   const char* format;
+  unsigned int interval;
 } options;
 
 // Declarations
@@ -65,6 +72,179 @@ int command_get(int argc, char * const *argv, const command_t *commands) {
 }
 
 
+// ---------------------------------------------
+#pragma mark -
+#pragma mark Output
+
+// Formatted records are collected in one static buffer which is written
+// to stdout in large blocks. Strings are escaped straight into it.
+
+#define OUT_SIZE (256 * 1024)
+
+static char out_buf[OUT_SIZE];
+static size_t out_len = 0;
+
+static void out_flush() {
+  if(out_len && fwrite(out_buf, 1, out_len, stdout) != out_len) {
+    die("Failed to write output");
+  }
+  out_len = 0;
+}
+
+
+static void out_write(const char *ptr, size_t len) {
+  if(len > OUT_SIZE - out_len) {
+    out_flush();
+    if(len >= OUT_SIZE) {
+      if(fwrite(ptr, 1, len, stdout) != len) {
+        die("Failed to write output");
+      }
+      return;
+    }
+  }
+  memcpy(out_buf + out_len, ptr, len);
+  out_len += len;
+}
+
+
+static inline void out_putc(char c) {
+  if(out_len == OUT_SIZE) {
+    out_flush();
+  }
+  out_buf[out_len++] = c;
+}
+
+
+#define out_puts(str) out_write((str), strlen(str))
+
+// Writes a string literal without measuring it
+#define out_lit(str) out_write((str), sizeof(str)-1)
+
+
+static void out_uint(unsigned long long v) {
+  char digits[20];
+  size_t i = sizeof(digits);
+  do {
+    digits[--i] = '0' + (v % 10);
+  } while((v /= 10));
+  out_write(digits + i, sizeof(digits) - i);
+}
+
+
+static void out_int(long long v) {
+  if(v < 0) {
+    out_putc('-');
+    out_uint(-(unsigned long long)v);
+  }
+  else {
+    out_uint(v);
+  }
+}
+
+
+// Writes v in hexadecimal, padded with zeros to at least width digits
+static void out_hex(unsigned int v, int width) {
+  static const char hex[] = "0123456789abcdef";
+  char digits[8];
+  int i = sizeof(digits);
+  do {
+    digits[--i] = hex[v & 0xf];
+  } while((v >>= 4) || (int)sizeof(digits) - i < width);
+  out_write(digits + i, sizeof(digits) - i);
+}
+
+
+// Returns the first of &, ", < or > in [p, end), or end
+static inline const char *out_xml_special(const char *p, const char *end) {
+#if defined(__SSE2__)
+  const __m128i vamp = _mm_set1_epi8('&');
+  const __m128i vquot = _mm_set1_epi8('"');
+  const __m128i vlt = _mm_set1_epi8('<');
+  const __m128i vgt = _mm_set1_epi8('>');
+  __m128i v;
+  int m;
+  
+  for(; end - p >= 16; p += 16) {
+    v = _mm_loadu_si128((const __m128i *)p);
+    m = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, vamp),
+                                                    _mm_cmpeq_epi8(v, vquot)),
+                                       _mm_or_si128(_mm_cmpeq_epi8(v, vlt),
+                                                    _mm_cmpeq_epi8(v, vgt))));
+    if(m) {
+      return p + __builtin_ctz(m);
+    }
+  }
+#endif
+  for(; p < end; p++) {
+    if(*p == '&' || *p == '"' || *p == '<' || *p == '>') {
+      break;
+    }
+  }
+  return p;
+}
+
+
+// Writes str with &, ", < and > replaced by character references, i.e.
+// 'foo <bar> "baz" & etc'  becomes  'foo &#60;bar&#62; &#34;baz&#34; &#38; etc'
+static void out_xml(const char *str) {
+  const char *end = str + strlen(str);
+  const char *p;
+  
+  for(; (p = out_xml_special(str, end)) != end; str = p + 1) {
+    out_write(str, p - str);
+    switch(*p) {
+      case '&': out_lit("&#38;"); break;
+      case '"': out_lit("&#34;"); break;
+      case '<': out_lit("&#60;"); break;
+      case '>': out_lit("&#62;"); break;
+    }
+  }
+  out_write(str, end - str);
+}
+
+
+// What each byte is replaced with inside a JSON string: 0 if it is copied
+// as is, 'u' for \u00XX or else the character following the backslash
+static const char out_json_escapes[256] = {
+  'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u', // 0x00
+  'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', // 0x10
+  ['"'] = '"', ['\\'] = '\\', [0x7f] = 'u',
+};
+
+
+// Writes str as a quoted JSON string. Runs of bytes which need no escaping
+// are copied in one go. Bytes >= 0x80 are passed through, as the registry
+// dump is UTF-8.
+static void out_json_string(const char *str) {
+  static const char hex[] = "0123456789abcdef";
+  const unsigned char *p = (const unsigned char *)str, *run;
+  char esc[6] = { '\\', 'u', '0', '0' };
+  char e;
+  
+  out_putc('"');
+  for(;;) {
+    for(run = p; !(e = out_json_escapes[*p]); p++) {}
+    if(p != run) {
+      out_write((const char *)run, p - run);
+    }
+    if(*p == '\0') {
+      break;
+    }
+    if(e == 'u') {
+      esc[4] = hex[*p >> 4];
+      esc[5] = hex[*p & 0xf];
+      out_write(esc, 6);
+    }
+    else {
+      out_putc('\\');
+      out_putc(e);
+    }
+    p++;
+  }
+  out_putc('"');
+}
+
+
 // ---------------------------------------------
 #pragma mark -
 #pragma mark Dump
@@ -83,138 +263,112 @@ static const char *dump_rec_xml_indents[] = {
 };
 
 
-// 'foo <bar> "baz" & etc'  becomes  'foo &#62;bar&#60; &#34;baz&#34; &#38; etc'
-// You are responsible for freeing the newly allocated string returned.
-char *xml_encode(const char *str) {
-  char *buf, *sub;
-  size_t siz, i;
-  
-  if(!str) {
-    return NULL;
-  }
-  
-  i = 0;
-  siz = strlen(str) + 1;
-  if((buf = (char *)malloc(siz)) == NULL) {
-    die("malloc() failed in main.c");
-  }
+static void dump_rec_xml_open(const char *tagname, int indent) {
+  out_puts(dump_rec_xml_indents[indent]);
+  out_putc('<');
+  out_puts(tagname);
+}
 
-  for (; *str; str++, i++)  {
-    switch(*str) {
-      case '&': sub = "&#38;"; break;
-      case '"': sub = "&#34;"; break;
-      case '>': sub = "&#60;"; break;
-      case '<': sub = "&#62;"; break;
-      default:  sub = NULL;
-    }
-    
-    if (sub) {
-      if((buf = realloc(buf, siz += 4)) == NULL) {
-        die("realloc() failed in main.c");
-      }
-      strcpy(buf+i, sub);
-      i += 4;
-    }
-    else {
-      buf[i] = *str;
-    }
+
+static void dump_rec_xml_close(const char *tagname, int indent) {
+  out_puts(dump_rec_xml_indents[indent]);
+  out_lit("</");
+  out_puts(tagname);
+  out_lit(">\n");
+}
+
+
+// Writes ' name="value"', with an empty value for NULL
+static void dump_rec_xml_attr(const char *name, const char *value) {
+  out_putc(' ');
+  out_puts(name);
+  out_lit("=\"");
+  if(value) {
+    out_xml(value);
   }
+  out_putc('"');
+}
+
+
+static void dump_rec_xml_attr_uint(const char *name, unsigned int value) {
+  out_putc(' ');
+  out_puts(name);
+  out_lit("=\"");
+  out_uint(value);
+  out_putc('"');
+}
 
-  buf[i] = '\0';
-  return buf;
+
+static void dump_rec_xml_attr_hex(const char *name, unsigned int value, int width) {
+  out_putc(' ');
+  out_puts(name);
+  out_lit("=\"");
+  out_hex(value, width);
+  out_putc('"');
 }
 
 
 static void dump_rec_xml_identifier(lsreg_identifier_t *s, const char *tagname, int indent) {
   if(s && s->name) {
-    char *name = xml_encode(s->name);
-    fprintf(stdout,
-            "%s<%s hash=\"%x\">%s</%s>\n",
-            dump_rec_xml_indents[indent],
-            tagname,
-            s->hash,
-            name,
-            tagname);
-    free(name);
+    dump_rec_xml_open(tagname, indent);
+    dump_rec_xml_attr_hex("hash", s->hash, 0);
+    out_putc('>');
+    out_xml(s->name);
+    dump_rec_xml_close(tagname, 0);
   }
 }
 
 
 static void dump_rec_xml_string(const char *ptr, const char *tagname, int indent) {
-  if(ptr && strlen(ptr)) {
-    char *escaped = xml_encode(ptr);
-    fprintf(stdout, "%s<%s>%s</%s>\n", 
-            dump_rec_xml_indents[indent], tagname, escaped, tagname);
-    free(escaped);
+  if(ptr && *ptr) {
+    dump_rec_xml_open(tagname, indent);
+    out_putc('>');
+    out_xml(ptr);
+    dump_rec_xml_close(tagname, 0);
   }
 }
 
 
-static void dump_rec_xml_date(const struct tm *date, const char *tagname, int indent) {
+static void dump_rec_xml_date(time_t date, const char *tagname, int indent) {
+  char formatted[LSREG_DATE_SIZE];
   if(date) {
-    char *formatted = strdup("0000-00-00T00:00:00+0000");
-    strftime(formatted, strlen(formatted), "%Y-%m-%dT%T%z", date);
-    fprintf(stdout, "%s<%s>%s</%s>\n", 
-            dump_rec_xml_indents[indent],
-            tagname,
-            formatted,
-            tagname);
-    free(formatted);
+    dump_rec_xml_open(tagname, indent);
+    out_putc('>');
+    out_puts(lsreg_date_format(date, 'T', formatted));
+    out_lit("+0000");
+    dump_rec_xml_close(tagname, 0);
   }
 }
 
 
 static void dump_rec_xml_strings(const char **ptr, const char *tagname, const char *item_tagname, int indent) {
-  const char *item;
   const char **v;
-  int first;
-  
-  if(ptr) {
-    first = 1;
-    
-    for( v = ptr; (item = *v); v++ ) {
-      if(first) {
-        fprintf(stdout, "%s<%s>\n", dump_rec_xml_indents[indent], tagname);
-        indent++;
-        first = 0;
-      }
-      dump_rec_xml_string(item, item_tagname, indent);
-    }
-    
-    if(!first) {
-      indent--;
-      fprintf(stdout, "%s</%s>\n", dump_rec_xml_indents[indent], tagname);
+  
+  if(ptr && *ptr) {
+    dump_rec_xml_open(tagname, indent);
+    out_lit(">\n");
+    for(v = ptr; *v; v++) {
+      dump_rec_xml_string(*v, item_tagname, indent+1);
     }
+    dump_rec_xml_close(tagname, indent);
   }
 }
 
 
 static void dump_rec_xml_bundle(lsreg_rec_t *rec, const char *tagname, int indent) {
   lsreg_bundle_t *bundle;
-  char *name, *version, *type_code, *id;
+  char fourcc[LSREG_FOURCC_SIZE];
   
   if((bundle = (lsreg_bundle_t *)rec->rec) == NULL) {
     return;
   }
-  name = xml_encode(bundle->name);
-  version = xml_encode(bundle->version);
-  type_code = xml_encode(bundle->type_code);
-  id = xml_encode(bundle->canonical_identifier.name);
-  
-  fprintf(stdout,
-          "%s<%s id=\"%u\" name=\"%s\" version=\"%s\" type_code=\"%s\" identifier=\"%s\">\n",
-          dump_rec_xml_indents[indent],
-          tagname,
-          bundle->uid,
-          (name ? name : ""),
-          (version ? version : ""),
-          (type_code ? type_code : ""),
-          (id ? id : ""));
-  
-  if(name)      free(name);
-  if(version)   free(version);
-  if(type_code) free(type_code);
-  if(id)        free(id);
+  dump_rec_xml_open(tagname, indent);
+  dump_rec_xml_attr_uint("id", bundle->uid);
+  dump_rec_xml_attr("name", bundle->name);
+  dump_rec_xml_attr("version", bundle->version);
+  dump_rec_xml_attr("type_code", lsreg_fourcc_format(bundle->type_code, fourcc));
+  dump_rec_xml_attr("identifier", bundle->canonical_identifier.name);
+  out_lit(">\n");
   
   indent++;
   
@@ -228,7 +382,7 @@ static void dump_rec_xml_bundle(lsreg_rec_t *rec, const char *tagname, int inden
   dump_rec_xml_strings((const char**)bundle->library_items, "library_items", "item", indent);
   
   indent--;
-  fprintf(stdout, "%s</%s>\n", dump_rec_xml_indents[indent], tagname);
+  dump_rec_xml_close(tagname, indent);
 }
 
 
@@ -239,59 +393,47 @@ static void dump_rec_xml_volume(lsreg_rec_t *rec, const char *tagname, int inden
   if(s == NULL) {
     return;
   }
-  fprintf(stdout, "%s<%s id=\"%u\" mounted=\"%s\" vrefnum=\"%d\" flags=\"%08x\">\n", 
-          dump_rec_xml_indents[indent],
-          tagname,
-          s->uid,
-          (s->is_mounted ? "true" : "false"),
-          s->vrefnum,
-          s->flags);
+  dump_rec_xml_open(tagname, indent);
+  dump_rec_xml_attr_uint("id", s->uid);
+  dump_rec_xml_attr("mounted", (s->is_mounted ? "true" : "false"));
+  out_lit(" vrefnum=\"");
+  out_int(s->vrefnum);
+  out_putc('"');
+  dump_rec_xml_attr_hex("flags", s->flags, 8);
+  out_lit(">\n");
   indent++;
   
   dump_rec_xml_string(s->path,        "path", indent);
   dump_rec_xml_string(s->disk_image,  "disk_image", indent);
   
   indent--;
-  fprintf(stdout, "%s</%s>\n", dump_rec_xml_indents[indent], tagname);
+  dump_rec_xml_close(tagname, indent);
 }
 
 
 static void dump_rec_xml_handler(lsreg_rec_t *rec, const char *tagname, int indent) {
   lsreg_handler_t *s;
-  char *content_type, *extension, *uri_scheme;
   
   if((s = (lsreg_handler_t *)rec->rec) == NULL) {
     return;
   }
-  content_type = xml_encode(s->content_type);
-  extension = xml_encode(s->extension);
-  uri_scheme = xml_encode(s->uri_scheme);
-  
-  fprintf(stdout, "%s<%s id=\"%u\" content_type=\"%s\" extension=\"%s\" uri_scheme=\"%s\" options=\"%08x\">\n", 
-          dump_rec_xml_indents[indent],
-          tagname,
-          s->uid,
-          (content_type ? content_type : ""),
-          (extension ? extension : ""),
-          (uri_scheme ? uri_scheme : ""),
-          s->options
-  );
-  
-  if(content_type)  free(content_type);
-  if(extension)     free(extension);
-  if(uri_scheme)   free(uri_scheme);
+  dump_rec_xml_open(tagname, indent);
+  dump_rec_xml_attr_uint("id", s->uid);
+  dump_rec_xml_attr("content_type", s->content_type);
+  dump_rec_xml_attr("extension", s->extension);
+  dump_rec_xml_attr("uri_scheme", s->uri_scheme);
+  dump_rec_xml_attr_hex("options", s->options, 8);
+  out_lit(">\n");
   
   indent++;
   dump_rec_xml_identifier(&s->roles, "roles", indent);
   indent--;
   
-  fprintf(stdout, "%s</%s>\n", dump_rec_xml_indents[indent], tagname);
+  dump_rec_xml_close(tagname, indent);
 }
 
 
-static int dump_rec_xml_cb(lsreg_rec_t *rec, void *d) {
-  int indent = 1;
-  
+static void dump_rec_xml(lsreg_rec_t *rec, int indent) {
   switch(rec->type) {
     case kLSRegRecTypeBundle:
       dump_rec_xml_bundle(rec, "bundle", indent);
@@ -303,23 +445,431 @@ static int dump_rec_xml_cb(lsreg_rec_t *rec, void *d) {
       dump_rec_xml_handler(rec, "handler", indent);
       break;
   }
+}
+
+
+static int dump_rec_xml_cb(lsreg_rec_t *rec, void *d) {
+  dump_rec_xml(rec, 1);
   return 0;
 }
 
 
+// Each record is written as one JSON object on a line of its own. Absent
+// fields are left out, as in the XML output.
+
+static void dump_rec_json_key(const char *key) {
+  out_lit(",\"");
+  out_puts(key);
+  out_lit("\":");
+}
+
+
+static void dump_rec_json_string(const char *ptr, const char *key) {
+  if(ptr && *ptr) {
+    dump_rec_json_key(key);
+    out_json_string(ptr);
+  }
+}
+
+
+static void dump_rec_json_identifier(lsreg_identifier_t *s, const char *key) {
+  if(s && s->name) {
+    dump_rec_json_key(key);
+    out_lit("{\"name\":");
+    out_json_string(s->name);
+    out_lit(",\"hash\":");
+    out_uint(s->hash);
+    out_putc('}');
+  }
+}
+
+
+static void dump_rec_json_date(time_t date, const char *key) {
+  char formatted[LSREG_DATE_SIZE];
+  if(date) {
+    dump_rec_json_key(key);
+    out_putc('"');
+    out_puts(lsreg_date_format(date, 'T', formatted));
+    out_lit("Z\"");
+  }
+}
+
+
+static void dump_rec_json_strings(const char **ptr, const char *key) {
+  const char **v;
+  
+  if(ptr && *ptr) {
+    dump_rec_json_key(key);
+    out_putc('[');
+    for(v = ptr; *v; v++) {
+      if(v != ptr) {
+        out_putc(',');
+      }
+      out_json_string(*v);
+    }
+    out_putc(']');
+  }
+}
+
+
+static void dump_rec_json_bundle(lsreg_bundle_t *bundle) {
+  char fourcc[LSREG_FOURCC_SIZE];
+  
+  out_lit("{\"type\":\"bundle\",\"id\":");
+  out_uint(bundle->uid);
+  dump_rec_json_string(bundle->name,    "name");
+  dump_rec_json_string(bundle->version, "version");
+  dump_rec_json_string(lsreg_fourcc_format(bundle->type_code, fourcc), "type_code");
+  dump_rec_json_identifier(&bundle->identifier,           "identifier");
+  dump_rec_json_identifier(&bundle->canonical_identifier, "canonical_identifier");
+  dump_rec_json_string(bundle->path,       "path");
+  dump_rec_json_string(bundle->executable, "executable");
+  dump_rec_json_date(bundle->regdate,      "regdate");
+  dump_rec_json_date(bundle->moddate,      "moddate");
+  dump_rec_json_string(bundle->library,    "library");
+  dump_rec_json_strings((const char**)bundle->library_items, "library_items");
+  out_lit("}\n");
+}
+
+
+static void dump_rec_json_volume(lsreg_volume_t *s) {
+  out_lit("{\"type\":\"volume\",\"id\":");
+  out_uint(s->uid);
+  if(s->is_mounted) {
+    out_lit(",\"mounted\":true,\"vrefnum\":");
+  }
+  else {
+    out_lit(",\"mounted\":false,\"vrefnum\":");
+  }
+  out_int(s->vrefnum);
+  out_lit(",\"flags\":");
+  out_uint((unsigned int)s->flags);
+  dump_rec_json_string(s->path,       "path");
+  dump_rec_json_string(s->disk_image, "disk_image");
+  out_lit("}\n");
+}
+
+
+static void dump_rec_json_handler(lsreg_handler_t *s) {
+  out_lit("{\"type\":\"handler\",\"id\":");
+  out_uint(s->uid);
+  dump_rec_json_string(s->content_type, "content_type");
+  dump_rec_json_string(s->extension,    "extension");
+  dump_rec_json_string(s->uri_scheme,   "uri_scheme");
+  out_lit(",\"options\":");
+  out_uint((unsigned int)s->options);
+  dump_rec_json_identifier(&s->roles,   "roles");
+  out_lit("}\n");
+}
+
+
+static int dump_rec_json_cb(lsreg_rec_t *rec, void *d) {
+  if(rec->rec == NULL) {
+    return 0;
+  }
+  switch(rec->type) {
+    case kLSRegRecTypeBundle:
+      dump_rec_json_bundle((lsreg_bundle_t *)rec->rec);
+      break;
+    case kLSRegRecTypeVolume:
+      dump_rec_json_volume((lsreg_volume_t *)rec->rec);
+      break;
+    case kLSRegRecTypeHandler:
+      dump_rec_json_handler((lsreg_handler_t *)rec->rec);
+      break;
+    default:
+      break;
+  }
+  return 0;
+}
+
+
+// Iterates the records read from r, or from the registry if r is NULL
+static void dump_iterate(lsreg_reader_t *r, lsreg_rec_handler_cb *handler_cb) {
+  if(r) {
+    lsreg_iterate_reader(r, dump_rec_factory, handler_cb, NULL);
+  }
+  else {
+    lsreg_iterate(dump_rec_factory, handler_cb, NULL);
+  }
+}
+
+
+// Outputs the records read from r, or from the registry if r is NULL, in
+// the selected format
+static void dump_reader(lsreg_reader_t *r) {
+  if( (options.format == NULL) || (strcasecmp(options.format, "c") == 0) ) {
+    dump_iterate(r, dump_rec_c_cb);
+  }
+  else if(strcasecmp(options.format, "xml") == 0) {
+    out_lit("<?xml version=\"1.0\" encoding=\"UTF-8\">\n"
+            "<records>\n");
+    dump_iterate(r, dump_rec_xml_cb);
+    out_lit("</records>\n");
+    out_flush();
+  }
+  else if(strcasecmp(options.format, "json") == 0) {
+    dump_iterate(r, dump_rec_json_cb);
+    out_flush();
+  }
+  else if(strcasecmp(options.format, "columnar") == 0) {
+    if(lsreg_columns_write(r, stdout) != 0) {
+      exit(1);
+    }
+  }
+  else {
+    die("Unsupported format: %s", options.format);
+  }
+}
+
+
 void dump(int argc, const char * argv[]) {
+  dump_reader(NULL);
+}
+
+
+
+// ---------------------------------------------
+#pragma mark -
+#pragma mark Query
+
+// Filters are evaluated by the parser, so records which do not match are
+// skipped as soon as one of their fields fails a predicate
+void query(int argc, const char * argv[]) {
+  lsreg_filter_t *f;
+  lsreg_reader_t *r;
+  
+  if(argc < 2) {
+    die("Missing filter expression");
+  }
+  if((f = lsreg_filter_compile(argv[1])) == NULL) {
+    die("Invalid filter: %s", argv[1]);
+  }
+  r = (argc > 2) ? lsreg_reader_open_file(argv[2]) : lsreg_reader_open_regdump();
+  if(r == NULL) {
+    die("Failed to read the registry");
+  }
+  lsreg_reader_set_filter(r, f);
+  dump_reader(r);
+  lsreg_reader_close(r);
+  lsreg_filter_free(f);
+}
+
+
+
+// ---------------------------------------------
+#pragma mark -
+#pragma mark Watch
+
+// Each pass dumps the registry into a snapshot which is diffed against the
+// snapshot of the previous pass. Unchanged records are compared in place
+// in the two mapped snapshots and never formatted or copied.
+
+static volatile sig_atomic_t watch_triggered = 0;
+static volatile sig_atomic_t watch_stopped = 0;
+
+static void watch_signal(int sig) {
+  if(sig == SIGUSR1) {
+    watch_triggered = 1;
+  }
+  else {
+    watch_stopped = 1;
+  }
+}
+
+
+// Waits for the interval to elapse, SIGUSR1 or a request to stop
+static void watch_wait() {
+  unsigned int remaining = options.interval;
+  
+  while(!watch_triggered && !watch_stopped) {
+    if(options.interval == 0) {
+      pause();
+    }
+    else if((remaining = sleep(remaining)) == 0) {
+      break;
+    }
+  }
+  watch_triggered = 0;
+}
+
+
+// The header of a pass is only written once it has a change to report
+typedef struct {
+  char date[32];
+  int started;
+} watch_pass_t;
+
+
+static int watch_rec_c_cb(enum kLSRegDiffKind kind,
+                          const lsreg_rec_t *a,
+                          const lsreg_rec_t *b,
+                          unsigned int changed,
+                          const char * const *fields,
+                          void *d)
+{
+  watch_pass_t *pass = (watch_pass_t *)d;
+  
+  if(!pass->started) {
+    fprintf(stdout, "// pass %s\n", pass->date);
+    pass->started = 1;
+  }
+  switch(kind) {
+    case kLSRegDiffAdded:
+      fputs("// added\n", stdout);
+      lsreg_rec_dump((lsreg_rec_t *)b, stdout);
+      break;
+    case kLSRegDiffRemoved:
+      fputs("// removed\n", stdout);
+      lsreg_rec_dump((lsreg_rec_t *)a, stdout);
+      break;
+    case kLSRegDiffChanged:
+      fputs("// changed:", stdout);
+      for(; *fields; fields++) {
+        fprintf(stdout, " %s", *fields);
+      }
+      fputc('\n', stdout);
+      lsreg_rec_dump((lsreg_rec_t *)b, stdout);
+      break;
+  }
+  return 0;
+}
+
+
+static int watch_rec_xml_cb(enum kLSRegDiffKind kind,
+                            const lsreg_rec_t *a,
+                            const lsreg_rec_t *b,
+                            unsigned int changed,
+                            const char * const *fields,
+                            void *d)
+{
+  watch_pass_t *pass = (watch_pass_t *)d;
+  const char *tagname = NULL;
+  
+  if(!pass->started) {
+    dump_rec_xml_open("pass", 1);
+    dump_rec_xml_attr("date", pass->date);
+    out_lit(">\n");
+    pass->started = 1;
+  }
+  switch(kind) {
+    case kLSRegDiffAdded:
+      dump_rec_xml_open((tagname = "added"), 2);
+      break;
+    case kLSRegDiffRemoved:
+      dump_rec_xml_open((tagname = "removed"), 2);
+      b = a;
+      break;
+    case kLSRegDiffChanged:
+      dump_rec_xml_open((tagname = "changed"), 2);
+      out_lit(" fields=\"");
+      for(; *fields; fields++) {
+        out_puts(*fields);
+        if(fields[1]) {
+          out_putc(' ');
+        }
+      }
+      out_putc('"');
+      break;
+  }
+  out_lit(">\n");
+  dump_rec_xml((lsreg_rec_t *)b, 3);
+  dump_rec_xml_close(tagname, 2);
+  return 0;
+}
+
+
+// Writes a snapshot of the registry, or of the dump file at path, to dst
+static int watch_snapshot(const char *path, const char *dst) {
+  lsreg_reader_t *r = NULL;
+  
+  if(path && (r = lsreg_reader_open_file(path)) == NULL) {
+    return -1;
+  }
+  return lsreg_snapshot_write(r, dst);
+}
+
+
+void watch(int argc, const char * argv[]) {
+  char dir[] = "/tmp/lsreg-watch.XXXXXX";
+  char prev[sizeof(dir) + 16], curr[sizeof(dir) + 16];
+  const char *path = (argc > 1) ? argv[1] : NULL;
+  lsreg_reader_t *a, *b;
+  lsreg_diff_cb *cb;
+  struct sigaction sa;
+  watch_pass_t pass;
+  time_t now;
+  int xml;
+  
   if( (options.format == NULL) || (strcasecmp(options.format, "c") == 0) ) {
-    lsreg_iterate(dump_rec_factory, dump_rec_c_cb, NULL);
+    xml = 0;
+    cb = watch_rec_c_cb;
   }
   else if(strcasecmp(options.format, "xml") == 0) {
-    fputs("<?xml version=\"1.0\" encoding=\"UTF-8\">\n"
-          "<records>\n", stdout);
-    lsreg_iterate(dump_rec_factory, dump_rec_xml_cb, NULL);
-    fputs("</records>\n", stdout);
+    xml = 1;
+    cb = watch_rec_xml_cb;
   }
   else {
     die("Unsupported format: %s", options.format);
   }
+  
+  if(mkdtemp(dir) == NULL) {
+    die("Failed to create a temporary directory");
+  }
+  snprintf(prev, sizeof(prev), "%s/prev.snap", dir);
+  snprintf(curr, sizeof(curr), "%s/curr.snap", dir);
+  
+  // No SA_RESTART, so that a signal cuts the wait short
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = watch_signal;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  
+  if(watch_snapshot(path, prev) != 0) {
+    rmdir(dir);
+    die("Failed to read the registry");
+  }
+  if(xml) {
+    out_lit("<?xml version=\"1.0\" encoding=\"UTF-8\">\n"
+            "<watch>\n");
+    out_flush();
+  }
+  fflush(stdout);
+  
+  for(watch_wait(); !watch_stopped; watch_wait()) {
+    if(watch_snapshot(path, curr) != 0) {
+      fprintf(stderr, "%s: Failed to read the registry\n", progname);
+      continue;
+    }
+    a = lsreg_snapshot_open(prev);
+    b = lsreg_snapshot_open(curr);
+    if(a && b) {
+      now = time(NULL);
+      strftime(pass.date, sizeof(pass.date), "%Y-%m-%dT%T%z", localtime(&now));
+      pass.started = 0;
+      if(lsreg_diff(a, b, cb, &pass) != 0) {
+        fprintf(stderr, "%s: Failed to compare registry passes\n", progname);
+      }
+      if(xml && pass.started) {
+        dump_rec_xml_close("pass", 1);
+      }
+      out_flush();
+      fflush(stdout);
+    }
+    if(a) lsreg_reader_close(a);
+    if(b) lsreg_reader_close(b);
+    rename(curr, prev);
+  }
+  
+  if(xml) {
+    out_lit("</watch>\n");
+    out_flush();
+  }
+  unlink(prev);
+  unlink(curr);
+  rmdir(dir);
 }
 
 
@@ -334,12 +884,23 @@ void usage() {
           "Launch Services registry access.\n"
           "\n"
           "Options:\n"
-          "  -f --format FORMAT  Output format. Valid formats are: 'xml' and 'c' (default).\n"
+          "  -f --format FORMAT  Output format. Valid formats are: 'xml', 'json'\n"
+          "                      (one object per line), 'columnar' (binary, see\n"
+          "                      lsreg_columns_write()) and 'c' (default).\n"
+          "  -i --interval SECS  Seconds between passes of watch (default 60). With 0,\n"
+          "                      passes are only triggered by SIGUSR1.\n"
           "  -h --help           Show this help message and quit.\n"
           "  -V --version        Show version number and build date and quit.\n"
           "\n"
           "Commands:\n"
           "  dump (list)         Output all information available.\n"
+          "  watch [dumpfile]    Re-read the registry (or dumpfile) every interval or on\n"
+          "                      SIGUSR1 and output the records which were added, removed\n"
+          "                      or changed since the previous pass.\n"
+          "  query FILTER [dumpfile]\n"
+          "                      Output the records of the registry (or dumpfile) which\n"
+          "                      match FILTER, i.e. 'type=bundle and identifier^=com.'\n"
+          "                      (see lsreg_filter_compile() in lsreg.h).\n"
           "  help                Show this help message and quit.\n"
           ,
           progname);
@@ -357,11 +918,13 @@ int main (int argc, const char * argv[]) {
   int ch;
   
   options.format = NULL;
+  options.interval = 60;
   progname = basename(strdup(argv[0]));
   
   // Options
   static struct option longopts[] = {
     { "format",   optional_argument, NULL, 'f' },
+    { "interval", required_argument, NULL, 'i' },
     { "help",     no_argument,       NULL, 'h' },
     { "version",  no_argument,       NULL, 'V' },
   {NULL,0,NULL,0}/* sentinel */};
@@ -370,13 +933,18 @@ int main (int argc, const char * argv[]) {
   static command_t commands[] = {
     { "dump", "list", NULL,NULL },
     { "help", NULL,   NULL,NULL },
+    { "watch", NULL,  NULL,NULL },
+    { "query", NULL,  NULL,NULL },
   {NULL,NULL,NULL,NULL}/* sentinel */};
   
   // Parse options
-  while ((ch = getopt_long(argc, (char * const *)argv, "f:hV", longopts, NULL)) != -1) switch (ch) {
+  while ((ch = getopt_long(argc, (char * const *)argv, "f:i:hV", longopts, NULL)) != -1) switch (ch) {
     case 'f':
       options.format = optarg;
       break;
+    case 'i':
+      options.interval = (unsigned int)strtoul(optarg, NULL, 10);
+      break;
     case 'V':
       version();
       break;
@@ -398,6 +966,12 @@ int main (int argc, const char * argv[]) {
       break;
     case 1:
       usage();
+    case 2:
+      watch(argc, argv);
+      break;
+    case 3:
+      query(argc, argv);
+      break;
     default:
       if(argc) {
         die("Unknown command: '%s'", argv[0]);